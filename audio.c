@@ -15,13 +15,55 @@
 #endif /* WINDOWS */
 #include "bits.h"
 
+// The host's sound output, shared by whatever is playing through it; machines only supply the 'bits'
 uint8_t internal_sinc_rate=6, *sinc_rate=&internal_sinc_rate;
+double sincgroups[MAX_SINC_RATE][AUDIOSYNCLEN];
 
 uint8_t *get_sinc_rate(void)
 {
 	return(sinc_rate);
 }
 
+// Pulls *sinc_rate bits from the 'bits' buffer and filters them down to one sample
+static Uint16 mix_sample(audiobuf *a, bool wait)
+{
+	for(unsigned int g=0;g<*sinc_rate;g++)
+	{
+		unsigned int waits=0;
+		while(wait&&!a->play&&(a->rp==a->wp))
+		{
+			usleep(AUDIO_WAIT);
+			if(waits++>AUDIO_MAXWAITS)
+			{
+				fprintf(stderr, "Audio underrun!  waits %u\n", waits);
+				break;
+			}
+		}
+		a->cbuf[a->crp]=a->bits[a->rp];
+		a->rp=(a->rp+1)%AUDIOBITLEN;
+		a->crp=(a->crp+1)%SINCBUFLEN;
+	}
+	unsigned int l=a->play?SINCBUFLEN>>2:SINCBUFLEN, sbl=SINCBUFLEN, sr=*sinc_rate;
+	unsigned int p=(a->crp+sbl-1)%sbl, q=p?p-1:sbl-1; // cbuf indices of j and j+1 bits ago
+	unsigned int jm=1%sr, jd=1/sr; // j%sr and j/sr, kept incrementally to avoid divisions
+	double v=0;
+	for(unsigned int j=1;j<l;j++)
+	{
+		signed int d=a->cbuf[p]-a->cbuf[q];
+		if(d)
+			v+=d*sincgroups[sr-jm-1][jd];
+		p=q;
+		q=q?q-1:sbl-1;
+		if(++jm==sr)
+		{
+			jm=0;
+			jd++;
+		}
+	}
+	//if(a->play) v*=0.6;
+	return(floor(v*2.0));
+}
+
 void mixaudio(void *abuf, Uint8 *stream, int len)
 {
 	static bool abusy=true;
@@ -52,40 +94,31 @@ void mixaudio(void *abuf, Uint8 *stream, int len)
 	}
 	for(int i=0;i<len;i+=2)
 	{
-		for(unsigned int g=0;g<*sinc_rate;g++)
-		{
-			unsigned int waits=0;
-			while(!a->play&&(a->rp==a->wp))
-			{
-				usleep(AUDIO_WAIT);
-				if(waits++>AUDIO_MAXWAITS)
-				{
-					fprintf(stderr, "Audio underrun!  waits %u\n", waits);
-					break;
-				}
-			}
-			a->cbuf[a->crp]=a->bits[a->rp];
-			a->rp=(a->rp+1)%AUDIOBITLEN;
-			a->crp=(a->crp+1)%SINCBUFLEN;
-		}
-		unsigned int l=a->play?SINCBUFLEN>>2:SINCBUFLEN;
-		double v=0;
-		for(unsigned int j=1;j<l;j++)
-		{
-			signed int d=a->cbuf[(a->crp+SINCBUFLEN-j)%SINCBUFLEN]-a->cbuf[(a->crp+SINCBUFLEN-j-1)%SINCBUFLEN];
-			if(d)
-				v+=d*sincgroups[*sinc_rate-(j%*sinc_rate)-1][j/(*sinc_rate)];
-		}
-		//if(a->play) v*=0.6;
-		Uint16 samp=floor(v*2.0);
+		Uint16 samp=mix_sample(a, true);
 		stream[i]=samp;
 		stream[i+1]=samp>>8;
-		if(a->record)
-		{
-			fputc(stream[i], a->record);
-			fputc(stream[i+1], a->record);
-		}
 	}
+	if(a->taken) // there's room now, if the core was waiting for it
+	{
+		SDL_LockMutex(a->lock);
+		SDL_CondSignal(a->taken);
+		SDL_UnlockMutex(a->lock);
+	}
+	if(a->record)
+		bgw_write(a->record, stream, len);
+}
+
+unsigned int mixaudio_offline(audiobuf *a, FILE *out)
+{
+	unsigned int n=0;
+	while((a->wp+AUDIOBITLEN-a->rp)%AUDIOBITLEN>=*sinc_rate)
+	{
+		Uint16 samp=mix_sample(a, false);
+		fputc(samp, out);
+		fputc(samp>>8, out);
+		n++;
+	}
+	return(n);
 }
 
 void update_sinc(uint16_t filterfactor)
@@ -137,6 +170,24 @@ void wavheader(FILE *a)
 	fwrite("data", 1, 4, a);
 	fwrite("\377\377\377\377", 1, 4, a);
 }
+
+void wavfinish(FILE *a)
+{
+	long end=ftell(a);
+	if(end<44) return;
+	uint32_t riff=end-8, data=end-44;
+	fseek(a, 4, SEEK_SET);
+	fputc(riff, a);
+	fputc(riff>>8, a);
+	fputc(riff>>16, a);
+	fputc(riff>>24, a);
+	fseek(a, 40, SEEK_SET);
+	fputc(data, a);
+	fputc(data>>8, a);
+	fputc(data>>16, a);
+	fputc(data>>24, a);
+	fseek(a, 0, SEEK_END);
+}
 #endif /* AUDIO */
 
 void ay_init(ay_t *ay)
@@ -10,6 +10,7 @@
 #include <stdbool.h>
 #ifdef AUDIO
 #include <SDL.h>
+#include "bgwrite.h"
 #define MAX_SINC_RATE	32
 #define SAMPLE_RATE		16000 // Audio sample rate, Hz
 #define AUDIOBUFLEN		(256)
@@ -20,9 +21,10 @@
 #define SINCBUFLEN		(AUDIOSYNCLEN**sinc_rate)
 #define AUDIO_WAIT		5e3
 #define AUDIO_MAXWAITS	40
+#define AUDIO_OVERRUN_MS	200 // longest we'll wait for the sound card to make room in 'bits'
+#define AUDIO_TRIM		0.005 // most we'll stretch or squeeze the 'bits' clock by, to keep up with the sound card's
 uint8_t *get_sinc_rate(void);
 void update_sinc(uint16_t filterfactor);
-void mixaudio(void *abuf, Uint8 *stream, int len);
 typedef struct
 {
 	uint8_t bits[AUDIOBITBUFLEN];
@@ -30,18 +32,22 @@ typedef struct
 	unsigned int rp, wp; // read & write pointers for 'bits' circular buffer
 	unsigned int crp, cwp; // read & write pointers for 'cbuf' circular buffer
 	bool play; // true if tape is playing (we mute and allow skipping)
-	FILE *record;
+	bgwriter *record; // audio capture, written out by a background thread
 	bool busy[2]; // true if [core, audio] thread is using.  see file 'sound' for shutdown sequence
+	SDL_mutex *lock; // with taken, for the core to wait for room in 'bits' (NULL if there's no sound card)
+	SDL_cond *taken; // signalled by mixaudio when it's taken bits
 }
 audiobuf;
 
-double sincgroups[MAX_SINC_RATE][AUDIOSYNCLEN];
+void mixaudio(void *abuf, Uint8 *stream, int len);
+unsigned int mixaudio_offline(audiobuf *a, FILE *out); // drains 'bits' synchronously, for non-realtime rendering; returns number of samples written
+
+extern double sincgroups[MAX_SINC_RATE][AUDIOSYNCLEN];
 
 void wavheader(FILE *a);
+void wavfinish(FILE *a); // fills in the RIFF and data chunk sizes
 #endif /* AUDIO */
 
-bool ay_enabled;
-
 typedef struct
 {
 	uint8_t reg[16]; // The programmable registers R0-R15
@@ -58,7 +64,5 @@ typedef struct
 }
 ay_t;
 
-ay_t ay;
-
 void ay_init(ay_t *ay);
 void ay_tstep(ay_t *ay, unsigned int steps);
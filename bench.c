@@ -0,0 +1,753 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	bench.c - built-in benchmarks, and the batch runner
+
+	Each workload runs in its own headless child, so that it starts from a clean process and we can get its peak
+	RSS from wait4(); the child reports back how many frames and T-states it ran, and how long that took, with
+	--dump-stats.  The first workload boots the ROM and leaves a snapshot behind; the others are that snapshot
+	with a test program poked into it, so apart from the ROM there's nothing to ship.
+
+	The batch runner works the same way, with a pool of children (one per CPU) running through a corpus of titles;
+	a tape is loaded with LOAD "" typed into a snapshot of the booted machine.
+*/
+
+#include "bench.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <strings.h>
+#include <signal.h>
+#endif /* !WINDOWS */
+#include "bits.h"
+#include "sysvars.h"
+
+#define SNA_HDR		27
+#define SNA_48		(SNA_HDR+0xc000)
+#define BENCH_ARGS	8
+#define BATCH_MAXJOBS	64
+#define BATCH_TIMEOUT	600 // seconds a title may run before we give up on it
+
+typedef struct
+{
+	const char *name;
+	const char *args[BENCH_ARGS]; // NULL-terminated; %s is replaced by the scratch directory
+	bool until; // should stop by itself (--until-pc), well before --frames
+}
+workload;
+
+static const workload workloads[]=
+{
+	{.name="boot", .args={"--until-pc=10a8", "--frames=500", "--dump-snap=%s/boot.sna", NULL}, .until=true}, // ROM boot, up to the editor waiting for a key
+	{.name="basic-for", .args={"--frames=1000", "%s/basic.sna", NULL}},
+	#ifdef AUDIO
+	{.name="ay-music", .args={"--ay", "--frames=1000", "--render=%s/ay.wav", "%s/ay.sna", NULL}},
+	#endif /* AUDIO */
+	{.name="tape-trap", .args={"--frames=5000", "--until-pc=8019", "%s/load.sna", "%s/load.tap", NULL}, .until=true},
+	{.name="tape-edge", .args={"--no-traps", "--frames=5000", "--until-pc=8019", "%s/load.sna", "%s/load.tap", NULL}, .until=true},
+	{.name="filters", .args={"--filters=7e", "--frames=500", "--dump-screen=%s/filters.bmp", "%s/basic.sna", NULL}}, // everything except B&W, drawing every frame
+};
+#define NWORKLOADS	(sizeof(workloads)/sizeof(workloads[0]))
+
+static const char *scratch[]={"boot.sna", "basic.sna", "ay.sna", "ay.wav", "load.sna", "load.tap", "filters.bmp"};
+#define NSCRATCH	(sizeof(scratch)/sizeof(scratch[0]))
+
+static const uint8_t load_quote[]={0xef, '"', '"'}; // LOAD ""
+
+static const uint8_t basic_for[]={0xeb, 'I', '=', '1', 0xcc, '3', '0', '0', '0', '0', ':', 0xf3, 'I'}; // FOR I=1 TO 30000:NEXT I
+
+static const uint8_t ay_code[]= // at 0x8000: turn on the tones, then play with their periods every frame
+{
+	0x16, 0x07, 0x3e, 0x38, 0xcd, 0x40, 0x80,	// LD D,7; LD A,38h; CALL ayout ; mixer: tones only
+	0x16, 0x08, 0x3e, 0x0f, 0xcd, 0x40, 0x80,	// LD D,8; LD A,0Fh; CALL ayout ; volumes
+	0x14, 0xcd, 0x40, 0x80,						// INC D; CALL ayout
+	0x14, 0xcd, 0x40, 0x80,						// INC D; CALL ayout
+	0x1e, 0x00,									// LD E,0
+	0x76, 0x1c,									// loop: HALT; INC E
+	0x16, 0x00, 0x7b, 0xcd, 0x40, 0x80,			// LD D,0; LD A,E; CALL ayout
+	0x16, 0x02, 0x87, 0xcd, 0x40, 0x80,			// LD D,2; ADD A,A; CALL ayout
+	0x16, 0x04, 0x7b, 0x2f, 0xcd, 0x40, 0x80,	// LD D,4; LD A,E; CPL; CALL ayout
+	0x16, 0x01, 0x7b, 0x0f, 0x0f, 0x0f, 0x0f,	// LD D,1; LD A,E; RRCA x4
+	0xe6, 0x03, 0xcd, 0x40, 0x80,				// AND 3; CALL ayout
+	0x18, 0xdd,									// JR loop
+	0, 0, 0, 0, 0,
+	0x01, 0xfd, 0xff, 0xed, 0x51,				// ayout (0x8040): LD BC,FFFDh; OUT (C),D
+	0x06, 0xbf, 0xed, 0x79, 0xc9,				// LD B,BFh; OUT (C),A; RET
+};
+
+static const uint8_t load_code[]= // at 0x8000: LD-BYTES a header, then a SCREEN$, then sit at 0x8019
+{
+	0xdd, 0x21, 0x00, 0x90, 0x11, 0x11, 0x00,	// LD IX,9000h; LD DE,17
+	0xaf, 0x37, 0xcd, 0x56, 0x05,				// XOR A; SCF; CALL LD-BYTES
+	0xdd, 0x21, 0x00, 0x40, 0x11, 0x00, 0x1b,	// LD IX,4000h; LD DE,1B00h
+	0x3e, 0xff, 0x37, 0xcd, 0x56, 0x05,			// LD A,FFh; SCF; CALL LD-BYTES
+	0x18, 0xfe,									// JR $
+};
+
+#ifndef WINDOWS
+static uint8_t *sna_at(uint8_t *sna, uint16_t addr)
+{
+	return(sna+SNA_HDR+addr-0x4000);
+}
+
+static unsigned int sna_peekw(uint8_t *sna, uint16_t addr)
+{
+	return(sna_at(sna, addr)[0]|(sna_at(sna, addr)[1]<<8));
+}
+
+static void sna_pokew(uint8_t *sna, uint16_t addr, unsigned int val)
+{
+	sna_at(sna, addr)[0]=val;
+	sna_at(sna, addr)[1]=val>>8;
+}
+
+static void sna_run(uint8_t *sna, uint16_t addr, const uint8_t *code, size_t len) // poke code in and jump to it
+{
+	memcpy(sna_at(sna, addr), code, len);
+	sna_pokew(sna, sna[23]|(sna[24]<<8), addr); // a 48k SNA's PC is on its stack
+}
+
+static bool sna_basic(uint8_t *sna, const uint8_t *cmd, size_t len) // type cmd into the editor, and press ENTER
+{
+	unsigned int e_line=sna_peekw(sna, sysvarbyname("E_LINE")->addr), worksp=sna_peekw(sna, sysvarbyname("WORKSP")->addr);
+	if((worksp!=e_line+2)||(sna_peekw(sna, sysvarbyname("STKEND")->addr)!=worksp)) return(false); // not the empty editor we expected
+	memcpy(sna_at(sna, e_line), cmd, len);
+	sna_at(sna, e_line+len)[0]=0x0d;
+	sna_at(sna, e_line+len)[1]=0x80;
+	sna_pokew(sna, sysvarbyname("K_CUR")->addr, e_line+len);
+	sna_pokew(sna, sysvarbyname("WORKSP")->addr, e_line+len+2);
+	sna_pokew(sna, sysvarbyname("STKBOT")->addr, e_line+len+2);
+	sna_pokew(sna, sysvarbyname("STKEND")->addr, e_line+len+2);
+	sna_at(sna, sysvarbyname("LAST_K")->addr)[0]=0x0d;
+	sna_at(sna, sysvarbyname("FLAGS")->addr)[0]|=0x20; // new key
+	return(true);
+}
+
+static void tap_block(FILE *fp, uint8_t flag, const uint8_t *data, size_t len)
+{
+	uint8_t parity=flag;
+	fputc((len+2)&0xff, fp);
+	fputc((len+2)>>8, fp);
+	fputc(flag, fp);
+	fwrite(data, 1, len, fp);
+	for(size_t i=0;i<len;i++)
+		parity^=data[i];
+	fputc(parity, fp);
+}
+
+static bool write_file(const char *dir, const char *fn, const uint8_t *buf, size_t len)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", dir, fn);
+	FILE *fp=fopen(path, "wb");
+	if(!fp)
+	{
+		fprintf(stderr, "bench: failed to open `%s': %s\n", path, strerror(errno));
+		return(false);
+	}
+	fwrite(buf, 1, len, fp);
+	fclose(fp);
+	return(true);
+}
+
+static bool make_files(const char *dir) // everything the later workloads need, from the boot workload's snapshot
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/boot.sna", dir);
+	mapfile boot;
+	if(!map_file(path, &boot)) return(false);
+	if(boot.len!=SNA_48)
+	{
+		fprintf(stderr, "bench: `%s' isn't a 48k SNA\n", path);
+		unmap_file(&boot);
+		return(false);
+	}
+	uint8_t sna[SNA_48];
+	bool ok=true;
+	memcpy(sna, boot.buf, SNA_48);
+	if(!sna_basic(sna, basic_for, sizeof(basic_for)))
+	{
+		fprintf(stderr, "bench: boot snapshot isn't waiting in the editor\n");
+		ok=false;
+	}
+	else
+		ok=write_file(dir, "basic.sna", sna, SNA_48);
+	memcpy(sna, boot.buf, SNA_48);
+	sna_run(sna, 0x8000, ay_code, sizeof(ay_code));
+	ok=ok&&write_file(dir, "ay.sna", sna, SNA_48);
+	memcpy(sna, boot.buf, SNA_48);
+	sna_run(sna, 0x8000, load_code, sizeof(load_code));
+	ok=ok&&write_file(dir, "load.sna", sna, SNA_48);
+	unmap_file(&boot);
+	if(!ok) return(false);
+	snprintf(path, sizeof(path), "%s/load.tap", dir);
+	FILE *fp=fopen(path, "wb");
+	if(!fp)
+	{
+		fprintf(stderr, "bench: failed to open `%s': %s\n", path, strerror(errno));
+		return(false);
+	}
+	uint8_t hdr[17]={3, 'b', 'e', 'n', 'c', 'h', ' ', ' ', ' ', ' ', ' ', 0x00, 0x1b, 0x00, 0x40, 0x00, 0x80}; // CODE, 6912 bytes at 16384
+	uint8_t scr[0x1b00];
+	uint32_t x=1;
+	for(size_t i=0;i<sizeof(scr);i++) // something that looks like data, not a test pattern
+	{
+		x=x*1103515245+12345;
+		scr[i]=x>>16;
+	}
+	tap_block(fp, 0x00, hdr, sizeof(hdr));
+	tap_block(fp, 0xff, scr, sizeof(scr));
+	fclose(fp);
+	return(true);
+}
+
+static pid_t spawn(const char *self, char *const argv[], int *outfd) // self with argv, its stdout on *outfd and its stderr thrown away.  -1 on failure
+{
+	int pfd[2];
+	if(pipe(pfd))
+	{
+		perror("bench: pipe");
+		return(-1);
+	}
+	fflush(stdout);
+	pid_t pid=fork();
+	if(pid<0)
+	{
+		perror("bench: fork");
+		close(pfd[0]);
+		close(pfd[1]);
+		return(-1);
+	}
+	if(!pid)
+	{
+		int null=open("/dev/null", O_WRONLY);
+		dup2(pfd[1], STDOUT_FILENO);
+		if(null>=0) dup2(null, STDERR_FILENO); // it's chatty, and we only want the stats
+		close(pfd[0]);
+		close(pfd[1]);
+		execvp(self, argv);
+		_exit(127);
+	}
+	close(pfd[1]);
+	*outfd=pfd[0];
+	return(pid);
+}
+
+static bool run_workload(const char *self, const char *dir, const workload *w)
+{
+	char argbuf[BENCH_ARGS][256];
+	char *argv[BENCH_ARGS+4];
+	unsigned int argc=0;
+	argv[argc++]=(char *)self;
+	argv[argc++]="--headless";
+	argv[argc++]="--dump-stats";
+	for(unsigned int a=0;w->args[a];a++)
+	{
+		snprintf(argbuf[a], sizeof(argbuf[a]), w->args[a], dir);
+		argv[argc++]=argbuf[a];
+	}
+	argv[argc]=NULL;
+	int outfd;
+	pid_t pid=spawn(self, argv, &outfd);
+	if(pid<0) return(false);
+	FILE *fp=fdopen(outfd, "r");
+	char *line=fp?fgetl(fp):NULL;
+	if(fp) fclose(fp);
+	else close(outfd);
+	int status;
+	struct rusage ru;
+	if(wait4(pid, &status, 0, &ru)<0)
+	{
+		perror("bench: wait4");
+		free(line);
+		return(false);
+	}
+	int frames;
+	long long Tstates, usec;
+	bool ok=line&&(sscanf(line, "frames=%d Tstates=%lld usec=%lld", &frames, &Tstates, &usec)==3);
+	free(line);
+	if(!(WIFEXITED(status)&&!WEXITSTATUS(status)&&ok))
+	{
+		fprintf(stderr, "bench: %s: failed (status %d)\n", w->name, WIFEXITED(status)?WEXITSTATUS(status):-1);
+		return(false);
+	}
+	unsigned int maxframes=0;
+	for(unsigned int a=0;w->args[a];a++)
+		sscanf(w->args[a], "--frames=%u", &maxframes);
+	if(w->until&&((unsigned int)frames>=maxframes))
+	{
+		fprintf(stderr, "bench: %s: ran out of frames\n", w->name);
+		return(false);
+	}
+	double secs=max(usec, 1)/1e6;
+	printf("{\"workload\": \"%s\", \"frames\": %d, \"tstates\": %lld, \"seconds\": %.6f, \"tstates_per_sec\": %.0f, \"fps\": %.2f, \"ns_per_tstate\": %.3f, \"peak_rss_kb\": %ld}\n", w->name, frames, Tstates, secs, Tstates/secs, frames/secs, max(usec, 1)*1e3/max(Tstates, 1), ru.ru_maxrss);
+	fflush(stdout);
+	return(true);
+}
+
+int bench_run(const char *self)
+{
+	char dir[]="/tmp/spiffy-bench.XXXXXX";
+	if(!mkdtemp(dir))
+	{
+		perror("bench: mkdtemp");
+		return(1);
+	}
+	int rv=0;
+	for(unsigned int w=0;w<NWORKLOADS;w++)
+	{
+		if(!run_workload(self, dir, workloads+w))
+		{
+			rv=1;
+			if(!w) break; // nothing else can run without the boot snapshot
+		}
+		if(!w&&!make_files(dir))
+		{
+			rv=1;
+			break;
+		}
+	}
+	for(unsigned int i=0;i<NSCRATCH;i++)
+	{
+		char path[256];
+		snprintf(path, sizeof(path), "%s/%s", dir, scratch[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+	return(rv);
+}
+typedef struct
+{
+	char *path;
+	char name[256]; // for its screenshot: the file's name, made unique
+	bool tape;
+	// result
+	const char *status; // ok, short (stopped before its frames were up), failed, crashed, timeout, missing
+	int code; // exit status, or signal
+	unsigned long long hash;
+	int frames;
+	long long Tstates, usec;
+	int diverged; // from the baseline: 1 if it did, 0 if not, -1 if it's not in the baseline
+}
+batch_title;
+
+typedef struct
+{
+	pid_t pid;
+	int outfd;
+	unsigned int title;
+	struct timeval start;
+	bool killed; // for taking too long
+}
+batch_job;
+
+static int batch_kind(const char *fn) // 1 for a tape, 0 for a snapshot, -1 for anything else
+{
+	static const char *tapes[]={".tap", ".tzx", ".csw", ".pzx"}, *snaps[]={".sna", ".z80", ".szx", ".sp", ".snp", ".zxs", ".slt"};
+	const char *ext=strrchr(fn, '.');
+	if(!ext) return(-1);
+	for(unsigned int i=0;i<sizeof(tapes)/sizeof(*tapes);i++)
+		if(!strcasecmp(ext, tapes[i])) return(1);
+	for(unsigned int i=0;i<sizeof(snaps)/sizeof(*snaps);i++)
+		if(!strcasecmp(ext, snaps[i])) return(0);
+	return(-1);
+}
+
+static bool batch_add(batch_title **titles, unsigned int *n, unsigned int *l, const char *dir, const char *fn, bool tape)
+{
+	if(*n>=*l)
+	{
+		unsigned int nl=*l?*l*2:256;
+		batch_title *nt=realloc(*titles, nl*sizeof(*nt));
+		if(!nt)
+		{
+			perror("batch: realloc");
+			return(false);
+		}
+		*titles=nt;
+		*l=nl;
+	}
+	batch_title *t=*titles+*n;
+	memset(t, 0, sizeof(*t));
+	size_t len=(dir?strlen(dir)+1:0)+strlen(fn)+1;
+	if(!(t->path=malloc(len)))
+	{
+		perror("batch: malloc");
+		return(false);
+	}
+	snprintf(t->path, len, "%s%s%s", dir?dir:"", dir?"/":"", fn);
+	t->tape=tape;
+	t->status="failed";
+	t->code=-1;
+	t->diverged=-1;
+	(*n)++;
+	return(true);
+}
+
+static int batch_cmp_path(const void *a, const void *b)
+{
+	return(strcmp(((const batch_title *)a)->path, ((const batch_title *)b)->path));
+}
+
+static batch_title *batch_titles(const char *corpus, unsigned int *n) // a directory, or a file listing one title per line
+{
+	batch_title *titles=NULL;
+	unsigned int l=0;
+	bool ok=true;
+	*n=0;
+	struct stat st;
+	if(stat(corpus, &st))
+	{
+		fprintf(stderr, "batch: `%s': %s\n", corpus, strerror(errno));
+		return(NULL);
+	}
+	if(S_ISDIR(st.st_mode))
+	{
+		DIR *d=opendir(corpus);
+		if(!d)
+		{
+			fprintf(stderr, "batch: failed to open `%s': %s\n", corpus, strerror(errno));
+			return(NULL);
+		}
+		struct dirent *e;
+		while(ok&&(e=readdir(d)))
+		{
+			int kind=batch_kind(e->d_name);
+			if((e->d_name[0]!='.')&&(kind>=0))
+				ok=batch_add(&titles, n, &l, corpus, e->d_name, kind);
+		}
+		closedir(d);
+		qsort(titles, *n, sizeof(*titles), batch_cmp_path);
+	}
+	else
+	{
+		FILE *fp=fopen(corpus, "r");
+		if(!fp)
+		{
+			fprintf(stderr, "batch: failed to open `%s': %s\n", corpus, strerror(errno));
+			return(NULL);
+		}
+		while(ok&&!feof(fp))
+		{
+			char *line=fgetl(fp);
+			if(!line)
+			{
+				perror("batch: fgetl");
+				ok=false;
+				break;
+			}
+			if(*line&&(*line!='#'))
+				ok=batch_add(&titles, n, &l, NULL, line, batch_kind(line)>0);
+			free(line);
+		}
+		fclose(fp);
+	}
+	for(unsigned int i=0;i<*n;i++) // screenshot names: the file's name, or if that's taken, with its number on
+	{
+		const char *slash=strrchr(titles[i].path, '/');
+		snprintf(titles[i].name, sizeof(titles[i].name), "%s", slash?slash+1:titles[i].path);
+		for(unsigned int j=0;j<i;j++)
+			if(!strcmp(titles[i].name, titles[j].name))
+			{
+				snprintf(titles[i].name, sizeof(titles[i].name), "%s.%u", slash?slash+1:titles[i].path, i);
+				break;
+			}
+	}
+	if(!ok)
+	{
+		for(unsigned int i=0;i<*n;i++)
+			free(titles[i].path);
+		free(titles);
+		return(NULL);
+	}
+	return(titles);
+}
+
+static bool batch_boot(const char *self, const char *dir) // writes dir/load.sna, the booted machine with LOAD "" entered
+{
+	char snap[256], arg[300];
+	snprintf(snap, sizeof(snap), "%s/boot.sna", dir);
+	snprintf(arg, sizeof(arg), "--dump-snap=%s", snap);
+	char *argv[]={(char *)self, "--headless", "--until-pc=10a8", "--frames=500", arg, NULL};
+	int outfd, status;
+	pid_t pid=spawn(self, argv, &outfd);
+	if(pid<0) return(false);
+	close(outfd);
+	if((waitpid(pid, &status, 0)<0)||!WIFEXITED(status)||WEXITSTATUS(status))
+	{
+		fprintf(stderr, "batch: failed to boot the machine for the tapes\n");
+		return(false);
+	}
+	mapfile boot;
+	if(!map_file(snap, &boot)) return(false);
+	uint8_t sna[SNA_48];
+	bool ok=(boot.len==SNA_48);
+	if(ok)
+	{
+		memcpy(sna, boot.buf, SNA_48);
+		ok=sna_basic(sna, load_quote, sizeof(load_quote));
+	}
+	unmap_file(&boot);
+	unlink(snap);
+	if(!ok)
+	{
+		fprintf(stderr, "batch: boot snapshot isn't waiting in the editor\n");
+		return(false);
+	}
+	return(write_file(dir, "load.sna", sna, SNA_48));
+}
+
+static bool batch_start(const char *self, const char *scratch, const char *outdir, unsigned int frames, batch_title *t, batch_job *j)
+{
+	char fr[32], screen[600], load[300];
+	snprintf(fr, sizeof(fr), "--frames=%u", frames);
+	snprintf(screen, sizeof(screen), "--dump-screen=%s/%s.bmp", outdir, t->name);
+	snprintf(load, sizeof(load), "%s/load.sna", scratch);
+	char *argv[]={(char *)self, "--headless", fr, "--dump-hash", "--dump-stats", screen, t->tape?load:t->path, t->tape?t->path:NULL, NULL};
+	if(access(t->path, R_OK)) // it'd only be ignored
+	{
+		t->status="missing";
+		return(false);
+	}
+	gettimeofday(&j->start, NULL);
+	j->killed=false;
+	return((j->pid=spawn(self, argv, &j->outfd))>=0);
+}
+
+static void batch_finish(batch_job *j, int status, unsigned int frames, batch_title *t)
+{
+	FILE *fp=fdopen(j->outfd, "r");
+	char *hash=fp?fgetl(fp):NULL, *stats=fp?fgetl(fp):NULL;
+	if(fp) fclose(fp);
+	else close(j->outfd);
+	bool ok=hash&&stats&&(sscanf(hash, "%llx", &t->hash)==1)&&(sscanf(stats, "frames=%d Tstates=%lld usec=%lld", &t->frames, &t->Tstates, &t->usec)==3);
+	free(hash);
+	free(stats);
+	if(WIFSIGNALED(status))
+	{
+		t->status=j->killed?"timeout":"crashed";
+		t->code=WTERMSIG(status);
+	}
+	else if(WIFEXITED(status)&&WEXITSTATUS(status))
+	{
+		t->status="failed";
+		t->code=WEXITSTATUS(status);
+	}
+	else if(!ok)
+		t->status="failed";
+	else
+	{
+		t->status=((unsigned int)t->frames<frames)?"short":"ok";
+		t->code=0;
+	}
+	if(!ok)
+		t->hash=t->frames=t->Tstates=t->usec=0;
+}
+
+typedef struct
+{
+	char *line; // the results line; path points into it
+	const char *path;
+	unsigned long long hash;
+}
+batch_base;
+
+static int batch_cmp_base(const void *a, const void *b)
+{
+	return(strcmp(((const batch_base *)a)->path, ((const batch_base *)b)->path));
+}
+
+static void batch_baseline(const char *fn, batch_title *titles, unsigned int n) // compares the hashes with the ok titles' in a previous results file
+{
+	FILE *fp=fopen(fn, "r");
+	if(!fp)
+	{
+		fprintf(stderr, "batch: failed to open `%s': %s\n", fn, strerror(errno));
+		return;
+	}
+	batch_base *base=NULL;
+	unsigned int nbase=0, lbase=0;
+	while(!feof(fp))
+	{
+		char *line=fgetl(fp);
+		if(!line) break;
+		char status[16];
+		unsigned long long hash;
+		int off;
+		if((sscanf(line, "%15s %llx %*d %*d %*d %n", status, &hash, &off)!=2)||strcmp(status, "ok"))
+		{
+			free(line);
+			continue;
+		}
+		if(nbase>=lbase)
+		{
+			unsigned int nl=lbase?lbase*2:256;
+			batch_base *nb=realloc(base, nl*sizeof(*nb));
+			if(!nb)
+			{
+				perror("batch: realloc");
+				free(line);
+				break;
+			}
+			base=nb;
+			lbase=nl;
+		}
+		base[nbase++]=(batch_base){.line=line, .path=line+off, .hash=hash};
+	}
+	fclose(fp);
+	qsort(base, nbase, sizeof(*base), batch_cmp_base);
+	for(unsigned int i=0;i<n;i++)
+	{
+		batch_base key={.path=titles[i].path}, *b=nbase?bsearch(&key, base, nbase, sizeof(*base), batch_cmp_base):NULL;
+		if(b)
+			titles[i].diverged=strcmp(titles[i].status, "ok")||(titles[i].hash!=b->hash);
+	}
+	for(unsigned int i=0;i<nbase;i++)
+		free(base[i].line);
+	free(base);
+}
+
+int batch_run(const char *self, const char *corpus, const char *outdir, unsigned int frames, const char *baseline)
+{
+	unsigned int n;
+	batch_title *titles=batch_titles(corpus, &n);
+	if(!titles) return(1);
+	if((mkdir(outdir, 0777)<0)&&(errno!=EEXIST))
+	{
+		fprintf(stderr, "batch: failed to create `%s': %s\n", outdir, strerror(errno));
+		return(1);
+	}
+	char scratch[]="/tmp/spiffy-batch.XXXXXX";
+	bool tapes=false;
+	for(unsigned int i=0;i<n;i++)
+		tapes|=titles[i].tape;
+	if(tapes)
+	{
+		if(!mkdtemp(scratch))
+		{
+			perror("batch: mkdtemp");
+			return(1);
+		}
+		if(!batch_boot(self, scratch))
+		{
+			rmdir(scratch);
+			return(1);
+		}
+	}
+	long ncpus=sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int njobs=min(max(ncpus, 1), BATCH_MAXJOBS), running=0, next=0, done=0;
+	batch_job jobs[BATCH_MAXJOBS];
+	struct timeval start, now;
+	gettimeofday(&start, NULL);
+	while((next<n)||running)
+	{
+		while((running<njobs)&&(next<n))
+		{
+			jobs[running].title=next;
+			if(batch_start(self, scratch, outdir, frames, titles+next, jobs+running))
+				running++;
+			else
+				fprintf(stderr, "batch: [%u/%u] %s %s\n", ++done, n, titles[next].status, titles[next].path);
+			next++;
+		}
+		if(!running) continue;
+		int status;
+		pid_t pid=waitpid(-1, &status, WNOHANG);
+		if(pid<=0)
+		{
+			if((pid<0)&&(errno!=EINTR))
+			{
+				perror("batch: waitpid");
+				break;
+			}
+			gettimeofday(&now, NULL);
+			for(unsigned int i=0;i<running;i++)
+				if(!jobs[i].killed&&(now.tv_sec-jobs[i].start.tv_sec>BATCH_TIMEOUT))
+				{
+					kill(jobs[i].pid, SIGKILL);
+					jobs[i].killed=true;
+				}
+			usleep(10000);
+			continue;
+		}
+		for(unsigned int i=0;i<running;i++)
+			if(jobs[i].pid==pid)
+			{
+				batch_title *t=titles+jobs[i].title;
+				batch_finish(jobs+i, status, frames, t);
+				fprintf(stderr, "batch: [%u/%u] %s %s\n", ++done, n, t->status, t->path);
+				jobs[i]=jobs[--running];
+				break;
+			}
+	}
+	gettimeofday(&now, NULL);
+	if(tapes)
+	{
+		char path[300];
+		snprintf(path, sizeof(path), "%s/load.sna", scratch);
+		unlink(path);
+		rmdir(scratch);
+	}
+	if(baseline)
+		batch_baseline(baseline, titles, n);
+	char rfn[300];
+	snprintf(rfn, sizeof(rfn), "%s/results", outdir);
+	FILE *rf=fopen(rfn, "w");
+	if(!rf)
+		fprintf(stderr, "batch: failed to open `%s': %s\n", rfn, strerror(errno));
+	unsigned int nok=0, nshort=0, nfailed=0, ncrashed=0, ntimeout=0, ndiverged=0; // failed includes missing
+	for(unsigned int i=0;i<n;i++)
+	{
+		batch_title *t=titles+i;
+		if(rf) fprintf(rf, "%s %016llx %d %lld %lld %s\n", t->status, t->hash, t->frames, t->Tstates, t->usec, t->path);
+		bool ok=!strcmp(t->status, "ok");
+		if(ok) nok++;
+		else if(!strcmp(t->status, "short")) nshort++;
+		else if(!strcmp(t->status, "crashed")) ncrashed++;
+		else if(!strcmp(t->status, "timeout")) ntimeout++;
+		else nfailed++;
+		if(ok&&(t->diverged>0))
+		{
+			ndiverged++;
+			printf("diverged: %s\n", t->path);
+		}
+		else if(!ok)
+			printf("%s (%d): %s\n", t->status, t->code, t->path);
+	}
+	if(rf) fclose(rf);
+	double secs=(now.tv_sec-start.tv_sec)+(now.tv_usec-start.tv_usec)/1e6;
+	printf("batch: %u titles in %.1fs (%u jobs): %u ok, %u short, %u failed, %u crashed, %u timed out", n, secs, njobs, nok, nshort, nfailed, ncrashed, ntimeout);
+	if(baseline)
+		printf("; %u diverged from `%s'", ndiverged, baseline);
+	printf("\nbatch: results in `%s'\n", rfn);
+	for(unsigned int i=0;i<n;i++)
+		free(titles[i].path);
+	free(titles);
+	return((nok<n)||ndiverged);
+}
+#else /* WINDOWS */
+int bench_run(__attribute__((unused)) const char *self)
+{
+	fprintf(stderr, "bench: not supported on Windows\n");
+	return(1);
+}
+
+int batch_run(__attribute__((unused)) const char *self, __attribute__((unused)) const char *corpus, __attribute__((unused)) const char *outdir, __attribute__((unused)) unsigned int frames, __attribute__((unused)) const char *baseline)
+{
+	fprintf(stderr, "batch: not supported on Windows\n");
+	return(1);
+}
+#endif /* WINDOWS */
@@ -0,0 +1,20 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	bench.h - built-in benchmarks
+*/
+
+#define BATCH_FRAMES	1000 // default frames to run each title for
+
+/* Runs each workload in a child `self --headless`, and prints one line of results for each to stdout.
+   Returns nonzero if any of them failed */
+int bench_run(const char *self);
+
+/* Runs each title in corpus (a directory of snapshots and tapes, or a file listing them, one per line) in a child
+   `self --headless` for frames frames, as many at once as there are CPUs.  Writes a screenshot of each to outdir, and
+   its status, final state hash and timings to outdir/results; if baseline (a previous results file) isn't NULL, reports
+   any title whose hash differs from it.  Prints a summary, and returns nonzero if any title didn't run cleanly or
+   diverged */
+int batch_run(const char *self, const char *corpus, const char *outdir, unsigned int frames, const char *baseline);
@@ -0,0 +1,109 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	bgwrite.c - background (asynchronous) file writer
+*/
+
+#include "bgwrite.h"
+#include <stdint.h>
+#include <SDL.h>
+#include "bits.h"
+
+#define BGW_IDLE	10 // ms to sleep when the queue is empty
+
+/* Single-producer, single-consumer ring.  rp and wp are free-running byte counts;
+   only the writer thread advances rp, and only the producer advances wp, so no locking is needed */
+struct bgwriter
+{
+	FILE *fp;
+	uint8_t *buf;
+	size_t rp, wp;
+	bool done; // set by bgw_finish once the producer has stopped
+	size_t dropped; // bytes discarded because the queue was full (producer side only)
+	bool err; // fwrite failed (writer side only)
+	SDL_Thread *thread;
+};
+
+static int bgw_thread(void *data)
+{
+	bgwriter *w=data;
+	while(1)
+	{
+		bool done=__atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+		size_t wp=__atomic_load_n(&w->wp, __ATOMIC_ACQUIRE), rp=w->rp;
+		if(wp==rp)
+		{
+			if(done) break;
+			SDL_Delay(BGW_IDLE);
+			continue;
+		}
+		size_t off=rp&(BGW_BUFLEN-1), len=min(wp-rp, BGW_BUFLEN-off);
+		if(fwrite(w->buf+off, 1, len, w->fp)!=len)
+			w->err=true;
+		__atomic_store_n(&w->rp, rp+len, __ATOMIC_RELEASE);
+	}
+	fflush(w->fp);
+	return(0);
+}
+
+bgwriter *bgw_open(FILE *fp)
+{
+	if(!fp) return(NULL);
+	bgwriter *w=malloc(sizeof(bgwriter));
+	if(!w)
+	{
+		perror("malloc");
+		return(NULL);
+	}
+	if(!(w->buf=malloc(BGW_BUFLEN)))
+	{
+		perror("malloc");
+		free(w);
+		return(NULL);
+	}
+	w->fp=fp;
+	w->rp=w->wp=0;
+	w->done=false;
+	w->dropped=0;
+	w->err=false;
+	if(!(w->thread=SDL_CreateThread(bgw_thread, w)))
+	{
+		fprintf(stderr, "bgw_open: SDL_CreateThread: %s\n", SDL_GetError());
+		free(w->buf);
+		free(w);
+		return(NULL);
+	}
+	return(w);
+}
+
+bool bgw_write(bgwriter *w, const void *buf, size_t len)
+{
+	if(unlikely(!w)) return(false);
+	size_t wp=w->wp, rp=__atomic_load_n(&w->rp, __ATOMIC_ACQUIRE);
+	if(unlikely(BGW_BUFLEN-(wp-rp)<len))
+	{
+		w->dropped+=len;
+		return(false);
+	}
+	size_t off=wp&(BGW_BUFLEN-1), first=min(len, BGW_BUFLEN-off);
+	memcpy(w->buf+off, buf, first);
+	memcpy(w->buf, (const uint8_t *)buf+first, len-first);
+	__atomic_store_n(&w->wp, wp+len, __ATOMIC_RELEASE);
+	return(true);
+}
+
+FILE *bgw_finish(bgwriter *w)
+{
+	if(!w) return(NULL);
+	__atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+	SDL_WaitThread(w->thread, NULL);
+	if(w->dropped)
+		fprintf(stderr, "bgwrite: queue overrun, %zu bytes dropped\n", w->dropped);
+	if(w->err)
+		fprintf(stderr, "bgwrite: write error, output is incomplete\n");
+	FILE *fp=w->fp;
+	free(w->buf);
+	free(w);
+	return(fp);
+}
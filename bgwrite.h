@@ -0,0 +1,19 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	bgwrite.h - background (asynchronous) file writer
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BGW_BUFLEN	(1<<20) // must be a power of 2
+
+typedef struct bgwriter bgwriter;
+
+bgwriter *bgw_open(FILE *fp); // takes over fp, which should already have any header written to it
+bool bgw_write(bgwriter *w, const void *buf, size_t len); // never blocks; returns false (and drops the data) if the queue is full
+FILE *bgw_finish(bgwriter *w); // drains the queue, stops the thread and frees w.  Returns fp, positioned at the end, for header fixups
@@ -1,4 +1,11 @@
 #include "bits.h"
+#include <errno.h>
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif /* !WINDOWS */
 
 char *fgetl(FILE *fp)
 {
@@ -68,6 +75,60 @@ string sslurp(FILE *fp)
 	return(s);
 }
 
+bool map_file(const char *fn, mapfile *m)
+{
+	m->buf=NULL;
+	m->len=0;
+	m->mapped=false;
+	#ifndef WINDOWS
+	int fd=open(fn, O_RDONLY);
+	if(fd<0)
+	{
+		fprintf(stderr, "Failed to open '%s': %s\n", fn, strerror(errno));
+		return(false);
+	}
+	struct stat st;
+	if(!fstat(fd, &st)&&S_ISREG(st.st_mode)&&(st.st_size>0)) // mmap() can't do empty files, nor pipes and such
+	{
+		void *p=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p!=MAP_FAILED)
+		{
+			close(fd);
+			m->buf=p;
+			m->len=st.st_size;
+			m->mapped=true;
+			return(true);
+		}
+	}
+	close(fd);
+	#endif /* !WINDOWS */
+	FILE *fp=fopen(fn, "rb");
+	if(!fp)
+	{
+		fprintf(stderr, "Failed to open '%s': %s\n", fn, strerror(errno));
+		return(false);
+	}
+	string s=sslurp(fp);
+	fclose(fp);
+	if(!s.buf) return(false);
+	m->buf=(const uint8_t *)s.buf;
+	m->len=s.i;
+	return(true);
+}
+
+void unmap_file(mapfile *m)
+{
+	#ifndef WINDOWS
+	if(m->mapped)
+		munmap((void *)m->buf, m->len);
+	else
+	#endif /* !WINDOWS */
+		free((void *)m->buf);
+	m->buf=NULL;
+	m->len=0;
+	m->mapped=false;
+}
+
 void append_char(string *s, char c)
 {
 	if(s->buf)
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -13,6 +14,14 @@ typedef struct
 }
 string;
 
+typedef struct
+{
+	const uint8_t *buf; // file contents
+	size_t len;
+	bool mapped; // buf is an mmap() of the file, else a malloc-like pointer
+}
+mapfile;
+
 #ifndef min
 #define min(a,b)	((a)<(b)?(a):(b))
 #endif /* min */
@@ -28,6 +37,8 @@ char *fgetl(FILE *); // gets a line of string data; returns a malloc-like pointe
 char *finpl(FILE *); // gets a line of string data; returns a malloc-like pointer
 char *slurp(FILE *); // gets a file of string data; returns a malloc-like pointer
 string sslurp(FILE *fp); // gets a file of string data possibly containing NULs; return contains a malloc-like pointer
+bool map_file(const char *fn, mapfile *m); // maps a file read-only (or reads it in, where we can't map it); reports errors to stderr
+void unmap_file(mapfile *m);
 string init_string(void); // initialises a string buffer in heap
 string null_string(void); // returns a null string (no allocation)
 string make_string(const char *str); // initialises a string buffer in heap, with initial contents copied from str
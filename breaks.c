@@ -0,0 +1,197 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	breaks.c - debugger breakpoints
+*/
+
+#include "breaks.h"
+#include <stdlib.h>
+#include <string.h>
+
+void breaks_init(breaks *b, machine m)
+{
+	memset(b, 0, sizeof(*b));
+	b->roms=rom_length(m);
+	b->rams=cap_128_paging(m)?8:3;
+}
+
+void breaks_free(breaks *b)
+{
+	free(b->list);
+	free(b->banked);
+	b->list=NULL;
+	b->banked=NULL;
+	b->n=b->live=b->nbanks=0;
+}
+
+bool breaks_parse(const breaks *b, const char *s, uint16_t *addr, int *bank)
+{
+	unsigned int n, a;
+	int bk=-1, len=0;
+	if(sscanf(s, "rom%u:%n", &n, &len)==1&&len)
+	{
+		if(n>=b->roms) return(false);
+		bk=n;
+	}
+	else if(sscanf(s, "ram%u:%n", &n, &len)==1&&len)
+	{
+		if(n>=b->rams) return(false);
+		bk=b->roms+n;
+	}
+	else
+		len=0;
+	if(sscanf(s+len, "%x", &a)!=1||(a>0xffff))
+		return(false);
+	*addr=a;
+	*bank=bk;
+	return(true);
+}
+
+bool breaks_add(breaks *b, uint16_t addr, int bank, unsigned int flags)
+{
+	breakpoint *list=realloc(b->list, (b->n+1)*sizeof(*list));
+	if(!list)
+	{
+		perror("breaks: realloc");
+		return(false);
+	}
+	(b->list=list)[b->n++]=(breakpoint){.addr=addr, .bank=bank, .flags=flags};
+	return(true);
+}
+
+void breaks_del(breaks *b, unsigned int i)
+{
+	if(i>=b->n) return;
+	memmove(b->list+i, b->list+i+1, (--b->n-i)*sizeof(*b->list));
+}
+
+bool breaks_match(const breakpoint *bp, uint16_t addr, int bank)
+{
+	if(bank<0)
+		return(bp->addr==addr);
+	return((bp->bank==bank)&&((bp->addr&0x3fff)==(addr&0x3fff)));
+}
+
+void breaks_sync(breaks *b, const ram_t *ram)
+{
+	memset(b->addrs, 0, sizeof(b->addrs));
+	free(b->banked);
+	b->banked=NULL;
+	b->nbanks=0;
+	b->live=0;
+	for(unsigned int i=0;i<b->n;i++)
+	{
+		const breakpoint *bp=b->list+i;
+		if(bp->flags&BREAK_DISABLED)
+			continue;
+		if(bp->bank<0)
+			b->addrs[bp->addr>>3]|=1<<(bp->addr&7);
+		else if((unsigned int)bp->bank<ram->banks)
+		{
+			if(!b->banked)
+			{
+				if(!(b->banked=calloc(ram->banks, 0x800)))
+				{
+					perror("breaks: calloc");
+					continue;
+				}
+				b->nbanks=ram->banks;
+			}
+			unsigned int j=(bp->bank<<14)|(bp->addr&0x3fff);
+			b->banked[j>>3]|=1<<(j&7);
+		}
+		else
+			continue;
+		b->live++;
+	}
+}
+
+void breaks_hit(breaks *b, const ram_t *ram, uint16_t addr)
+{
+	bool changed=false;
+	for(unsigned int i=0;i<b->n;)
+	{
+		breakpoint *bp=b->list+i;
+		if(!(bp->flags&BREAK_DISABLED)&&breaks_match(bp, addr, (bp->bank<0)?-1:(int)ram->paged[addr>>14]))
+		{
+			if(bp->flags&BREAK_TEMP)
+			{
+				breaks_del(b, i);
+				changed=true;
+				continue;
+			}
+			if(bp->flags&BREAK_ONCE)
+			{
+				bp->flags|=BREAK_DISABLED;
+				changed=true;
+			}
+		}
+		i++;
+	}
+	if(changed)
+		breaks_sync(b, ram);
+}
+
+void breaks_show(FILE *fp, const breaks *b, const breakpoint *bp)
+{
+	fprintf(fp, "%04x", bp->addr);
+	if(bp->bank>=0)
+	{
+		if((unsigned int)bp->bank<b->roms)
+			fprintf(fp, " (rom%d)", bp->bank);
+		else
+			fprintf(fp, " (ram%u)", bp->bank-b->roms);
+	}
+	if(bp->flags&BREAK_ONCE)
+		fprintf(fp, ", one-shot");
+	if(bp->flags&BREAK_TEMP)
+		fprintf(fp, ", temporary");
+	if(bp->flags&BREAK_DISABLED)
+		fprintf(fp, ", disabled");
+}
+
+#define CHECK(what, cond)	do { if(!(cond)) { fprintf(stderr, "breaks_check: %s\n", what); fails++; } } while(0)
+
+int breaks_check(void)
+{
+	int fails=0;
+	ram_t ram;
+	if(ram_init(&ram, NULL, MACHINE_128))
+	{
+		fprintf(stderr, "breaks_check: couldn't set up RAM\n");
+		return(1);
+	}
+	breaks b;
+	breaks_init(&b, MACHINE_128);
+	uint16_t addr;
+	int bank;
+	CHECK("parse ram5:c010", breaks_parse(&b, "ram5:c010", &addr, &bank)&&(addr==0xc010)&&(bank==7));
+	CHECK("parse ram8:c010 (no such bank)", !breaks_parse(&b, "ram8:c010", &addr, &bank));
+	breaks_add(&b, 0xc010, 7, BREAK_ONCE); // RAM5, which is always at 4000 too
+	breaks_add(&b, 0x8000, 4, BREAK_TEMP); // RAM2
+	breaks_add(&b, 0x0038, -1, 0);
+	breaks_sync(&b, &ram);
+	CHECK("three live", b.live==3);
+	CHECK("ram5 at 4010", breaks_test(&b, &ram, 0x4010));
+	CHECK("not ram0 at c010", !breaks_test(&b, &ram, 0xc010));
+	ram.paged[3]=7; // RAM5 at c000 too
+	CHECK("ram5 at c010", breaks_test(&b, &ram, 0xc010));
+	breaks_hit(&b, &ram, 0x4010); // hit through its alias: the one-shot is spent
+	CHECK("one-shot disabled at 4010", !breaks_test(&b, &ram, 0x4010)&&!breaks_test(&b, &ram, 0xc010)&&(b.list[0].flags&BREAK_DISABLED));
+	CHECK("en ram5:4010 finds c010", breaks_match(&b.list[0], 0x4010, 7));
+	CHECK("en 4010 doesn't", !breaks_match(&b.list[0], 0x4010, -1));
+	ram.paged[3]=4; // RAM2 at c000
+	CHECK("ram2 at c000", breaks_test(&b, &ram, 0xc000));
+	breaks_hit(&b, &ram, 0xc000);
+	CHECK("temporary deleted at c000", (b.n==2)&&!breaks_test(&b, &ram, 0x8000)&&!breaks_test(&b, &ram, 0xc000));
+	CHECK("0038 unbanked", breaks_test(&b, &ram, 0x0038));
+	ram.paged[0]=1;
+	CHECK("0038 in either ROM", breaks_test(&b, &ram, 0x0038));
+	breaks_hit(&b, &ram, 0x0038);
+	CHECK("plain breakpoint kept", (b.n==2)&&breaks_test(&b, &ram, 0x0038));
+	breaks_free(&b);
+	ram_free(&ram);
+	fprintf(stderr, "breaks_check: %d failed\n", fails);
+	return(fails);
+}
@@ -0,0 +1,61 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	breaks.h - debugger breakpoints
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "vchips.h"
+#include "machine.h"
+
+#define BREAK_DISABLED	0x01 // kept, but doesn't stop anything
+#define BREAK_ONCE		0x02 // one-shot: disabled once it's been hit
+#define BREAK_TEMP		0x04 // temporary: deleted once it's been hit
+
+typedef struct
+{
+	uint16_t addr;
+	int bank; // the bank (index into ram_t.bank) that has to be paged in there, or -1 for whatever is
+	unsigned int flags;
+}
+breakpoint;
+
+/* Looking for a breakpoint at PC costs a bit test or two, however many there are: the enabled ones are kept as bitmaps,
+   one of the 64k addresses, and one of every byte of every bank for those tied to a bank, so whatever is paged in is
+   covered.  The bitmaps are rebuilt from the list whenever it changes, which is rare */
+typedef struct
+{
+	breakpoint *list;
+	unsigned int n;
+	unsigned int live; // enabled; if none, there's nothing to test
+	unsigned int roms, rams; // banks the machine has, by the names the user gives them (rom<n>, ram<n>)
+	uint8_t addrs[0x2000]; // a bit per address
+	uint8_t *banked; // a bit per byte of each bank, for banks 0 to nbanks-1; NULL if no enabled breakpoint has a bank
+	unsigned int nbanks;
+}
+breaks;
+
+void breaks_init(breaks *b, machine m);
+void breaks_free(breaks *b);
+bool breaks_parse(const breaks *b, const char *s, uint16_t *addr, int *bank); // "[rom<n>:|ram<n>:]xxxx"; false if it isn't
+bool breaks_add(breaks *b, uint16_t addr, int bank, unsigned int flags);
+void breaks_del(breaks *b, unsigned int i);
+bool breaks_match(const breakpoint *bp, uint16_t addr, int bank); // is bp the breakpoint the user means by addr (and bank, if >=0)?  A bank's breakpoint is at every address it can be paged in at
+void breaks_sync(breaks *b, const ram_t *ram); // rebuilds the bitmaps; after any change to the list, or its flags
+void breaks_hit(breaks *b, const ram_t *ram, uint16_t addr); // we've stopped at addr: one-shot breakpoints there are disabled, and temporary ones deleted
+void breaks_show(FILE *fp, const breaks *b, const breakpoint *bp); // "c000 (ram3), one-shot"
+int breaks_check(void); // self-test, on a 128's paging: returns the number of checks failed, having said which
+static inline bool breaks_test(const breaks *b, const ram_t *ram, uint16_t addr) // is there an enabled breakpoint at addr, as ram's paged now?
+{
+	if(b->addrs[addr>>3]&(1<<(addr&7)))
+		return(true);
+	unsigned int bank=ram->paged[addr>>14];
+	if(!b->banked||(bank>=b->nbanks))
+		return(false);
+	unsigned int i=(bank<<14)|(addr&0x3fff);
+	return(b->banked[i>>3]&(1<<(i&7)));
+}
@@ -1,146 +1,437 @@
 /*
 	spiffy - ZX spectrum emulator
-	
+
 	Copyright Edward Cree, 2010-13
 	coretest.c - Z80 core tests
-	
+
 	Acknowledgements: Based on the FUSE coretests by Phil Kendall <philip@shadowmagic.org.uk>
 		<http://fuse-emulator.sourceforge.net/>
+
+	tests.in and tests.expected are each parsed once, up front.  The tests are then shared out among worker threads,
+	each with its own machine, and every result is compared with the expected one: the final registers and memory,
+	and the reads and writes (MR, MW, PR, PW) the core put on the bus along the way, with their timings.
+	The MC and PC events are Fuse's contention probes, which follow its model of the ULA rather than anything on the
+	bus, so they aren't checked as such.  But Fuse also just probes, without reading, the operands of a conditional
+	jump or call that isn't taken, which a real Z80 (and our core) does read; so an MC that isn't followed by a read
+	or write of its address is kept, as a read that may or may not happen.
+
+	The same machinery runs the differential fuzzer (--fuzz), which checks the ways we have of running the core against
+	each other (see ct_cores) on random code, rather than against Fuse.
 */
 
 #include "coretest.h"
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <SDL.h>
+#ifndef WINDOWS
+#include <unistd.h>
+#endif /* !WINDOWS */
 #include "ops.h"
 #include "vchips.h"
 
-int read_test( FILE *f, unsigned int *end_tstates, z80 *cpu, uint8_t *memory )
-{
-	const char *progname="spiffy";
-	unsigned af, bc, de, hl, af_, bc_, de_, hl_, ix, iy, sp, pc;
-	unsigned i, r, iff1, iff2, im;
-	unsigned end_tstates2;
-	unsigned address;
-	char test_name[ 80 ];
+#define CT_MAXTHREADS	64
+#define CT_MAXFAIL		16 // diverging fuzz cases to find before we stop
+#define CT_FUZZ_BYTES	32 // most bytes of code in a fuzz case
+#define CT_FUZZ_TSTATES	64 // most T-states (before the instruction boundary) in a fuzz case
 
-	do {
+typedef struct
+{
+	unsigned int T; // T-states from the start of the test
+	char what[3]; // MR, MW, PR or PW; or MC, for a read that may or may not happen
+	uint16_t addr;
+	uint8_t data;
+}
+ct_event;
 
-		if( !fgets( test_name, sizeof( test_name ), f ) ) {
+typedef struct
+{
+	char name[80];
+	unsigned int regs[12]; // AF BC DE HL AF' BC' DE' HL' IX IY SP PC
+	unsigned int i, r, iff1, iff2, im, end_tstates;
+	int halted;
+	size_t nmem;
+	struct {uint16_t addr; uint8_t val;} *mem; // initial memory, on top of DEADBEEF
+	// from tests.expected
+	ct_event *events;
+	size_t nevents;
+	char *state; // final registers and memory, as dumped
+	bool known; // listed as a known failure
+	// result
+	bool pass;
+	string report; // what went wrong
+	unsigned long number; // fuzz case number
+}
+ct_test;
 
-			if( feof( f ) ) return 1;
+typedef struct
+{
+	const char *name;
+	machine m; // memory map: MACHINE_48's is flat, MACHINE_128's paged (ROM0, RAM5, RAM2, RAM0)
+	bool skip; // count off the core's idle T-states (cpu->nothing) ourselves, rather than calling z80_tstep for them
+}
+ct_core;
 
-			fprintf( stderr, "%s: error reading test description from file: %s\n",
-				 progname, strerror( errno ) );
-			return 1;
-		}
+/* The ways of running the core that ought to agree.  The first is the reference, and is what the coretests use */
+static const ct_core ct_cores[]=
+{
+	{"48k", MACHINE_48, true},
+	{"48k-tstep", MACHINE_48, false}, // as the main loop runs it
+	{"128k", MACHINE_128, true},
+};
+#define CT_NCORES	(sizeof(ct_cores)/sizeof(*ct_cores))
 
-	} while( test_name[0] == '\n' );
+typedef struct
+{
+	ram_t ram;
+	// results of the last run
+	z80 cpu;
+	unsigned int tstates;
+	ct_event *events;
+	size_t nevents, levents;
+}
+ct_machine;
 
-	if( fscanf( f, "%x %x %x %x %x %x %x %x %x %x %x %x", &af, &bc,
-				&de, &hl, &af_, &bc_, &de_, &hl_, &ix, &iy, &sp, &pc ) != 12 ) {
-		fprintf( stderr, "%s: first registers line in file corrupt\n", progname);
-		return 1;
-	}
+typedef struct
+{
+	ct_test *tests;
+	unsigned int ntests;
+	volatile unsigned int next; // next test to run, shared by the workers
+}
+ct_suite;
 
-	*AF	= af;	*BC	= bc;	*DE	= de;	*HL	= hl;
-	*AF_ = af_; *BC_ = bc_; *DE_ = de_; *HL_ = hl_;
-	*Ix	= ix;	*Iy	= iy;	*SP	= sp;	*PC	= pc;
+typedef struct
+{
+	uint64_t seed;
+	unsigned long cases;
+	volatile unsigned long next; // next case to run, shared by the workers
+	volatile unsigned long done;
+	volatile unsigned int failed; // cases that diverged; the first CT_MAXFAIL are in failures[]
+	ct_test failures[CT_MAXFAIL];
+}
+ct_fuzz;
 
-	int halted;
-	if( fscanf( f, "%x %x %u %u %u %d %u", &i, &r, &iff1, &iff2, &im,
-				&halted, &end_tstates2 ) != 7 ) {
-		fprintf( stderr, "%s: second registers line in file corrupt\n", progname);
-		return 1;
+static bool read_known(FILE *k, ct_test *t, unsigned int n) // marks the tests k lists; comments start with '#'
+{
+	char *line;
+	bool ok=true;
+	while(!feof(k)&&(line=fgetl(k)))
+	{
+		char name[80];
+		if((line[0]!='#')&&(sscanf(line, "%79s", name)==1))
+		{
+			unsigned int i;
+			for(i=0;(i<n)&&strcmp(t[i].name, name);i++);
+			if(i<n)
+				t[i].known=true;
+			else
+			{
+				fprintf(stderr, "coretest: known failure `%s' isn't a test\n", name);
+				ok=false;
+			}
+		}
+		free(line);
 	}
+	return(ok);
+}
 
-	*Intvec = i; *Refresh = r; cpu->IFF[0] = iff1; cpu->IFF[1] = iff2; cpu->intmode = im; cpu->halt=halted;
-	*end_tstates = end_tstates2;
-
-	while( 1 ) {
+static void ct_free(ct_test *t, unsigned int n)
+{
+	for(unsigned int i=0;i<n;i++)
+	{
+		free(t[i].mem);
+		free(t[i].events);
+		free(t[i].state);
+		free_string(&t[i].report);
+	}
+	free(t);
+}
 
-		if( fscanf( f, "%x", &address ) != 1 ) {
-			fprintf( stderr, "%s: no address found in file\n", progname);
-			return 1;
+static int read_test(FILE *f, ct_test *t) // 0 on success, 1 at EOF, -1 on error
+{
+	do
+	{
+		if(!fgets(t->name, sizeof(t->name), f))
+		{
+			if(feof(f)) return(1);
+			fprintf(stderr, "coretest: error reading test description from file: %s\n", strerror(errno));
+			return(-1);
 		}
-
-		if( address >= 0x10000 ) break;
-
-		while( 1 ) {
-
-			unsigned byte;
-
-			if( fscanf( f, "%x", &byte ) != 1 ) {
-	fprintf( stderr, "%s: no data byte found in file\n", progname);
-	return 1;
+	}
+	while(t->name[0]=='\n');
+	t->name[strcspn(t->name, "\n")]=0;
+	unsigned int *r=t->regs;
+	if(fscanf(f, "%x %x %x %x %x %x %x %x %x %x %x %x", r, r+1, r+2, r+3, r+4, r+5, r+6, r+7, r+8, r+9, r+10, r+11)!=12)
+	{
+		fprintf(stderr, "coretest: %s: first registers line in file corrupt\n", t->name);
+		return(-1);
+	}
+	if(fscanf(f, "%x %x %u %u %u %d %u", &t->i, &t->r, &t->iff1, &t->iff2, &t->im, &t->halted, &t->end_tstates)!=7)
+	{
+		fprintf(stderr, "coretest: %s: second registers line in file corrupt\n", t->name);
+		return(-1);
+	}
+	size_t lmem=0;
+	t->nmem=0;
+	t->mem=NULL;
+	while(1)
+	{
+		unsigned int address;
+		if(fscanf(f, "%x", &address)!=1)
+		{
+			fprintf(stderr, "coretest: %s: no address found in file\n", t->name);
+			return(-1);
+		}
+		if(address>=0x10000) break;
+		while(1)
+		{
+			unsigned int byte;
+			if(fscanf(f, "%x", &byte)!=1)
+			{
+				fprintf(stderr, "coretest: %s: no data byte found in file\n", t->name);
+				return(-1);
 			}
-		
-			if( byte >= 0x100 ) break;
-
-			memory[ address++ ] = byte;
+			if(byte>=0x100) break;
+			if(t->nmem>=lmem)
+			{
+				lmem=lmem?lmem*2:16;
+				void *nm=realloc(t->mem, lmem*sizeof(*t->mem));
+				if(!nm)
+				{
+					perror("realloc");
+					return(-1);
+				}
+				t->mem=nm;
+			}
+			t->mem[t->nmem].addr=address++;
+			t->mem[t->nmem++].val=byte;
+		}
+	}
+	return(0);
+}
 
+static bool read_expected(FILE *f, ct_test *t) // one block of tests.expected: name, events, then the dumped state up to a blank line
+{
+	char line[256];
+	do
+	{
+		if(!fgets(line, sizeof(line), f))
+		{
+			fprintf(stderr, "coretest: %s: missing from expected results\n", t->name);
+			return(false);
+		}
+	}
+	while(line[0]=='\n');
+	line[strcspn(line, "\n")]=0;
+	if(strcmp(line, t->name))
+	{
+		fprintf(stderr, "coretest: expected results for `%s', found `%s'\n", t->name, line);
+		return(false);
+	}
+	string state=init_string();
+	size_t levents=0;
+	while(fgets(line, sizeof(line), f)&&(line[0]!='\n'))
+	{
+		unsigned int T, addr, data=0;
+		char what[3];
+		if(line[0]==' ') // an event
+		{
+			int n=sscanf(line, "%u %2s %x %x", &T, what, &addr, &data);
+			if(n<3)
+			{
+				fprintf(stderr, "coretest: %s: bad event `%s'\n", t->name, line);
+				free_string(&state);
+				return(false);
+			}
+			if(t->nevents&&(t->events[t->nevents-1].what[1]=='C')) // was the last probe followed by its access?
+			{
+				ct_event *probe=t->events+t->nevents-1;
+				if((what[0]=='M')&&(what[1]!='C')&&(addr==probe->addr))
+					t->nevents--;
+			}
+			if((what[0]=='P')&&(what[1]=='C')) continue;
+			if(what[1]=='C')
+				T+=3; // when the read would be stamped
+			if(t->nevents>=levents)
+			{
+				levents=levents?levents*2:16;
+				void *ne=realloc(t->events, levents*sizeof(*t->events));
+				if(!ne)
+				{
+					perror("realloc");
+					free_string(&state);
+					return(false);
+				}
+				t->events=ne;
+			}
+			t->events[t->nevents++]=(ct_event){.T=T, .what={what[0], what[1], 0}, .addr=addr, .data=data};
 		}
+		else
+			append_str(&state, line);
 	}
+	t->state=state.buf;
+	return(true);
+}
 
-	printf( "%s", test_name );
+static uint8_t *ct_mem(const ram_t *ram, uint16_t addr)
+{
+	return(ram->bank[ram->paged[addr>>14]]+(addr&0x3fff));
+}
 
-	return 0;
+static bool ct_machine_init(ct_machine *mc, machine m)
+{
+	memset(mc, 0, sizeof(*mc));
+	if(ram_init(&mc->ram, NULL, m)) return(false);
+	for(unsigned int i=0;i<mc->ram.banks;i++) // the tests write anywhere, ROM included
+		mc->ram.write[i]=true;
+	return(true);
 }
 
-void dump_z80_state( z80 *cpu, unsigned int tstates )
+static void ct_machine_free(ct_machine *mc)
 {
-	printf( "%04x %04x %04x %04x %04x %04x %04x %04x %04x %04x %04x %04x\n",
-		*AF, *BC, *DE, *HL, *AF_, *BC_, *DE_, *HL_, *Ix, *Iy, *SP, *PC );
-	printf( "%02x %02x %d %d %d %d %d\n", *Intvec, *Refresh,
-		cpu->IFF[0], cpu->IFF[1], cpu->intmode, cpu->halt, tstates );
+	ram_free(&mc->ram);
+	free(mc->events);
 }
 
-void dump_memory_state( uint8_t *memory, uint8_t *initial_memory )
+static void dump_z80_state(string *s, z80 *cpu, unsigned int tstates)
 {
-	size_t i;
+	char line[80];
+	snprintf(line, sizeof(line), "%04x %04x %04x %04x %04x %04x %04x %04x %04x %04x %04x %04x\n",
+		*AF, *BC, *DE, *HL, *AF_, *BC_, *DE_, *HL_, *Ix, *Iy, *SP, *PC);
+	append_str(s, line);
+	snprintf(line, sizeof(line), "%02x %02x %d %d %d %d %d\n", *Intvec, *Refresh,
+		cpu->IFF[0], cpu->IFF[1], cpu->intmode, cpu->halt, tstates);
+	append_str(s, line);
+}
 
-	for( i = 0; i < 0x10000; i++ ) {
+static void dump_memory_state(string *s, const ram_t *ram, const uint8_t *initial_memory)
+{
+	char byte[8];
+	for(unsigned int i=0;i<0x10000;i++)
+	{
+		if(*ct_mem(ram, i)==initial_memory[i]) continue;
+		snprintf(byte, sizeof(byte), "%04x ", i);
+		append_str(s, byte);
+		while((i<0x10000)&&(*ct_mem(ram, i)!=initial_memory[i]))
+		{
+			snprintf(byte, sizeof(byte), "%02x ", *ct_mem(ram, i++));
+			append_str(s, byte);
+		}
+		append_str(s, "-1\n");
+	}
+}
 
-		if( memory[ i ] == initial_memory[ i ] ) continue;
+static bool match_event(const ct_test *t, size_t *ev, const ct_event *got) // consumes the expected events up to the one that should match got
+{
+	while(*ev<t->nevents)
+	{
+		const ct_event *want=t->events+(*ev)++;
+		bool same=(want->T==got->T)&&(want->addr==got->addr);
+		if(want->what[1]=='C')
+		{
+			if(same&&!strcmp(got->what, "MR")) return(true);
+			continue;
+		}
+		return(same&&!strcmp(want->what, got->what)&&(want->data==got->data));
+	}
+	return(false);
+}
 
-		printf( "%04x ", (unsigned)i );
+static const ct_event *next_event(const ct_test *t, size_t ev) // the next expected event that has to happen
+{
+	for(;ev<t->nevents;ev++)
+		if(t->events[ev].what[1]!='C')
+			return(t->events+ev);
+	return(NULL);
+}
 
-		while( i < 0x10000 && memory[ i ] != initial_memory[ i ] )
-			printf( "%02x ", memory[ i++ ] );
+static void report_event(string *s, const char *which, const ct_event *e)
+{
+	char line[80];
+	if(e)
+		snprintf(line, sizeof(line), "%s:%5u %s %04x %02x\n", which, e->T, e->what, e->addr, e->data);
+	else
+		snprintf(line, sizeof(line), "%s: (none)\n", which);
+	append_str(s, line);
+}
 
-		printf( "-1\n" );
+static bool ct_push_event(ct_machine *mc, const ct_event *e)
+{
+	if(mc->nevents>=mc->levents)
+	{
+		size_t n=mc->levents?mc->levents*2:64;
+		ct_event *ne=realloc(mc->events, n*sizeof(*ne));
+		if(!ne)
+		{
+			perror("realloc");
+			return(false);
+		}
+		mc->events=ne;
+		mc->levents=n;
 	}
+	mc->events[mc->nevents++]=*e;
+	return(true);
 }
 
-int run_test(FILE *f)
+/* Runs t on core, leaving the final state and the bus events in mc.  Returns false if it ran out of memory.
+   Bus events are read off the bus as the core leaves it after each T-state: a read or write lasts while MREQ (not
+   refresh) or IORQ (not interrupt acknowledge) is held with the same address.  They're stamped as Fuse does: a memory
+   access at the end of its machine cycle (the T-state after the access, or two after for an M1, which has the refresh
+   to come), and a port access when it starts */
+static bool ct_exec(const ct_test *t, const ct_core *core, ct_machine *mc, const uint8_t *initial_memory)
 {
-	size_t i;
-	unsigned int tstates=0;
-	uint8_t memory[0x10000], initial_memory[0x10000];
-	for( i = 0; i < 0x10000; i += 4 ) {
-		memory[ i     ] = 0xde; memory[ i + 1 ] = 0xad;
-		memory[ i + 2 ] = 0xbe; memory[ i + 3 ] = 0xef;
-	}
+	ram_t *ram=&mc->ram;
+	for(unsigned int p=0;p<4;p++)
+		memcpy(ram->bank[ram->paged[p]], initial_memory+(p<<14), 0x4000);
 
-	z80 _cpu, *cpu=&_cpu;
+	z80 *cpu=&mc->cpu;
 	bus_t _bus, *bus=&_bus;
-	ram_t _ram, *ram=&_ram;
 	z80_reset(cpu, bus);
-	ram_init(ram, NULL, MACHINE_48);
-	unsigned int end_tstates;
-	if( read_test( f, &end_tstates, cpu, memory ) ) return 0;
-	/* fill in the ram_t */
-	for(unsigned int i=0;i<0x10000;i++)
-		ram->bank[i>>14][i&0x3fff]=memory[i];
-
-	/* Grab a copy of the memory for comparison at the end */
-	memcpy( initial_memory, memory, 0x10000 );
-
+	*AF=t->regs[0]; *BC=t->regs[1]; *DE=t->regs[2]; *HL=t->regs[3];
+	*AF_=t->regs[4]; *BC_=t->regs[5]; *DE_=t->regs[6]; *HL_=t->regs[7];
+	*Ix=t->regs[8]; *Iy=t->regs[9]; *SP=t->regs[10]; *PC=t->regs[11];
+	*Intvec=t->i; *Refresh=t->r; cpu->IFF[0]=t->iff1; cpu->IFF[1]=t->iff2; cpu->intmode=t->im; cpu->halt=t->halted;
+
+	mc->nevents=0;
+	ct_event cur={.what={0}};
+	bool curm1=false;
+	unsigned int tstates=0;
 	int errupt=0;
 	while(!errupt)
 	{
 		do_ram(ram, bus);
-		fflush(stdout);
-		if(cpu->nothing)
+		char what[3]={0};
+		if(bus->tris!=TRIS_OFF)
+		{
+			if(bus->mreq&&!bus->rfsh)
+				what[0]='M';
+			else if(bus->iorq&&!bus->m1)
+			{
+				what[0]='P';
+				if(bus->tris==TRIS_IN)
+					bus->data=bus->addr>>8; // as Fuse's tests do
+			}
+			if(what[0])
+				what[1]=(bus->tris==TRIS_IN)?'R':'W';
+		}
+		if(cur.what[0]&&(strcmp(what, cur.what)||(bus->addr!=cur.addr))) // the access has ended
+		{
+			if(cur.what[0]=='M')
+				cur.T=tstates+(curm1?2:1);
+			if(!ct_push_event(mc, &cur)) return(false);
+			cur.what[0]=0;
+		}
+		if(what[0])
+		{
+			if(!cur.what[0])
+			{
+				cur=(ct_event){.T=tstates, .what={what[0], what[1], 0}, .addr=bus->addr};
+				curm1=bus->m1;
+			}
+			cur.data=bus->data;
+		}
+		if(core->skip&&cpu->nothing)
 		{
 			cpu->nothing--;
 			if(cpu->steps)
@@ -149,22 +440,503 @@ int run_test(FILE *f)
 		}
 		else
 			errupt=z80_tstep(cpu, bus, errupt);
-		fflush(stderr);
-		if(++tstates>=end_tstates)
+		if(++tstates>=t->end_tstates)
 		{
 			if((cpu->M==0)&&(cpu->dT==0)&&!cpu->block_ints)
 				errupt++;
 		}
 	}
-	/* copy memory back out of the ram_t */
+	mc->tstates=tstates;
+	return(true);
+}
+
+static void check_test(ct_test *t, ct_machine *mc, const uint8_t *initial_memory)
+{
+	size_t ev=0;
+	bool evmatch=true;
+	for(size_t i=0;evmatch&&(i<=mc->nevents);i++)
+	{
+		const ct_event *want=next_event(t, ev), *got=(i<mc->nevents)?mc->events+i:NULL;
+		if(got?!match_event(t, &ev, got):(want!=NULL))
+		{
+			evmatch=false;
+			append_str(&t->report, "bus events differ:\n");
+			report_event(&t->report, "expected", want);
+			report_event(&t->report, "     got", got);
+		}
+	}
+
+	string state=init_string();
+	dump_z80_state(&state, &mc->cpu, mc->tstates);
+	dump_memory_state(&state, &mc->ram, initial_memory);
+	bool stmatch=!strcmp(state.buf, t->state);
+	if(!stmatch)
+	{
+		append_str(&t->report, "final state differs:\nexpected:\n");
+		append_str(&t->report, t->state);
+		append_str(&t->report, "     got:\n");
+		append_string(&t->report, state);
+	}
+	free_string(&state);
+	t->pass=evmatch&&stmatch;
+}
+
+static const uint8_t deadbeef[4]={0xde, 0xad, 0xbe, 0xef};
+
+static void ct_fill(uint8_t *initial_memory, const ct_test *t, bool apply) // puts t's memory on top of the DEADBEEF, or takes it off again
+{
+	for(size_t i=0;i<t->nmem;i++)
+		initial_memory[t->mem[i].addr]=apply?t->mem[i].val:deadbeef[t->mem[i].addr&3];
+}
+
+static uint8_t *ct_initial_memory(void)
+{
+	uint8_t *initial_memory=malloc(0x10000);
+	if(!initial_memory)
+	{
+		perror("malloc");
+		return(NULL);
+	}
 	for(unsigned int i=0;i<0x10000;i++)
-		memory[i]=ram->bank[i>>14][i&0x3fff];
+		initial_memory[i]=deadbeef[i&3];
+	return(initial_memory);
+}
+
+static int ct_worker(void *data)
+{
+	ct_suite *s=data;
+	ct_machine mc;
+	if(!ct_machine_init(&mc, ct_cores[0].m)) return(1);
+	uint8_t *initial_memory=ct_initial_memory();
+	if(!initial_memory)
+	{
+		ct_machine_free(&mc);
+		return(1);
+	}
+	int rv=0;
+	unsigned int n;
+	while((n=__sync_fetch_and_add(&s->next, 1))<s->ntests)
+	{
+		ct_test *t=s->tests+n;
+		t->report=init_string();
+		ct_fill(initial_memory, t, true);
+		if(ct_exec(t, ct_cores, &mc, initial_memory))
+			check_test(t, &mc, initial_memory);
+		else
+			rv=1;
+		ct_fill(initial_memory, t, false);
+	}
+	free(initial_memory);
+	ct_machine_free(&mc);
+	return(rv);
+}
+
+static unsigned int ct_nthreads(void)
+{
+	long n=1;
+	#ifndef WINDOWS
+	n=sysconf(_SC_NPROCESSORS_ONLN);
+	#endif /* !WINDOWS */
+	return(min(max(n, 1), CT_MAXTHREADS));
+}
+
+static unsigned int ct_spawn(int (*worker)(void *), void *data, unsigned int nthreads, int *rv) // runs worker on nthreads threads, this one included; returns how many it got
+{
+	SDL_Thread *threads[CT_MAXTHREADS];
+	unsigned int started=0;
+	for(unsigned int i=1;i<nthreads;i++)
+		if((threads[started]=SDL_CreateThread(worker, data)))
+			started++;
+		else
+			fprintf(stderr, "coretest: SDL_CreateThread: %s\n", SDL_GetError());
+	*rv=worker(data);
+	for(unsigned int i=0;i<started;i++)
+	{
+		int trv;
+		SDL_WaitThread(threads[i], &trv);
+		*rv|=trv;
+	}
+	return(started+1);
+}
+
+int coretest_run(const char *testsfile, const char *expectedfile, const char *knownfile)
+{
+	FILE *f=fopen(testsfile, "r"), *e=fopen(expectedfile, "r");
+	if(!f||!e)
+	{
+		fprintf(stderr, "coretest: couldn't open `%s': %s\n", f?expectedfile:testsfile, strerror(errno));
+		if(f) fclose(f);
+		if(e) fclose(e);
+		return(1);
+	}
+	ct_suite s={.tests=NULL, .ntests=0, .next=0};
+	unsigned int ltests=0;
+	int rv;
+	while(1)
+	{
+		if(s.ntests>=ltests)
+		{
+			ltests=ltests?ltests*2:1024;
+			ct_test *nt=realloc(s.tests, ltests*sizeof(*s.tests));
+			if(!nt)
+			{
+				perror("realloc");
+				rv=-1;
+				break;
+			}
+			s.tests=nt;
+		}
+		ct_test *t=s.tests+s.ntests;
+		memset(t, 0, sizeof(*t));
+		t->report=null_string();
+		if((rv=read_test(f, t)))
+		{
+			free(t->mem);
+			break;
+		}
+		s.ntests++;
+		if(!read_expected(e, t))
+		{
+			rv=-1;
+			break;
+		}
+	}
+	fclose(f);
+	fclose(e);
+	if(rv<0)
+	{
+		ct_free(s.tests, s.ntests);
+		return(1);
+	}
+	bool known_bad=false; // the list of known failures is missing or wrong; the gate fails, whatever the tests do
+	if(knownfile)
+	{
+		FILE *k=fopen(knownfile, "r");
+		if(!k)
+			fprintf(stderr, "coretest: couldn't open `%s': %s\n", knownfile, strerror(errno));
+		if(!k||!read_known(k, s.tests, s.ntests))
+			known_bad=true;
+		if(k)
+			fclose(k);
+	}
+	unsigned int nthreads=ct_spawn(ct_worker, &s, min(ct_nthreads(), max(s.ntests, 1u)), &rv);
+	unsigned int passed=0, known=0, fixed=0;
+	for(unsigned int i=0;i<s.ntests;i++)
+	{
+		ct_test *t=s.tests+i;
+		if(t->pass)
+		{
+			passed++;
+			if(t->known)
+			{
+				printf("%s: passes, but is listed as a known failure\n", t->name);
+				fixed++;
+			}
+		}
+		else if(t->known)
+			known++;
+		else
+			printf("%s: FAIL\n%s\n", t->name, t->report.buf?t->report.buf:"(not run)\n");
+	}
+	printf("coretest: %u of %u tests passed, %u failed (%u of them known) (%u threads)\n", passed, s.ntests, s.ntests-passed, known, nthreads);
+	if(fixed)
+		printf("coretest: %u known failures now pass\n", fixed);
+	ct_free(s.tests, s.ntests);
+	return((rv||known_bad||(passed+known<s.ntests))?1:0);
+}
+
+/* Differential fuzzing.  Each case is a random machine state with a short random instruction stream at PC (often
+   behind a prefix, or two), run for a random number of T-states on every core in ct_cores; the first divergence
+   from ct_cores[0] is reported, earliest first: a bus event, then the final registers and T-states, then memory.
+   A diverging case is minimised (shortest run, fewest bytes of memory, most registers zero) before being reported, and
+   written to the fuzz file in the tests.in format, so Fuse's coretest can give its expected results.
+   Cases are generated from the seed and their number alone, so a run is repeatable whatever the number of threads */
+
+static uint64_t ct_rand(uint64_t *state) // splitmix64
+{
+	uint64_t z=(*state+=0x9e3779b97f4a7c15ull);
+	z=(z^(z>>30))*0xbf58476d1ce4e5b9ull;
+	z=(z^(z>>27))*0x94d049bb133111ebull;
+	return(z^(z>>31));
+}
+
+static void ct_generate(ct_test *t, uint64_t seed, unsigned long n) // t->mem must have room for CT_FUZZ_BYTES
+{
+	static const uint8_t prefixes[][2]={{0xcb}, {0xed}, {0xdd}, {0xfd}, {0xdd, 0xcb}, {0xfd, 0xcb}};
+	uint64_t r=seed^(n*0xd1342543de82ef95ull);
+	snprintf(t->name, sizeof(t->name), "fuzz_%llx_%lu", (unsigned long long)seed, n);
+	for(unsigned int i=0;i<12;i++)
+		t->regs[i]=ct_rand(&r)&0xffff;
+	uint64_t v=ct_rand(&r);
+	t->i=v&0xff;
+	t->r=(v>>8)&0xff;
+	t->iff1=t->iff2=(v>>16)&1;
+	t->im=((v>>17)&3)%3;
+	t->halted=!((v>>19)&0xf); // one in 16
+	t->end_tstates=1+((v>>23)%CT_FUZZ_TSTATES);
+	unsigned int nbytes=1+((v>>31)%CT_FUZZ_BYTES);
+	uint16_t addr=t->regs[11];
+	t->nmem=0;
+	if((v>>40)&1) // half the streams start with a prefix
+	{
+		const uint8_t *p=prefixes[((v>>41)&0xff)%(sizeof(prefixes)/sizeof(*prefixes))];
+		for(unsigned int i=0;(i<2)&&p[i]&&(t->nmem<nbytes);i++)
+		{
+			t->mem[t->nmem].addr=addr++;
+			t->mem[t->nmem++].val=p[i];
+		}
+	}
+	while(t->nmem<nbytes)
+	{
+		v=ct_rand(&r);
+		for(unsigned int i=0;(i<8)&&(t->nmem<nbytes);i++)
+		{
+			t->mem[t->nmem].addr=addr++;
+			t->mem[t->nmem++].val=v>>(i*8);
+		}
+	}
+}
 
-	/* And dump our final state */
-	dump_z80_state(cpu, tstates);
-	dump_memory_state(memory, initial_memory);
+static int ct_diverges(const ct_test *t, ct_machine *mc, uint8_t *initial_memory, string *report) // runs t on every core.  1 if any differs from the first (and says how in report, if not NULL), 0 if not, -1 if out of memory
+{
+	int rv=0;
+	ct_fill(initial_memory, t, true);
+	if(!ct_exec(t, ct_cores, mc, initial_memory))
+		rv=-1;
+	for(unsigned int c=1;!rv&&(c<CT_NCORES);c++)
+	{
+		ct_machine *a=mc, *b=mc+c;
+		if(!ct_exec(t, ct_cores+c, b, initial_memory))
+		{
+			rv=-1;
+			break;
+		}
+		char which[2][40];
+		snprintf(which[0], sizeof(which[0]), "%12s", ct_cores[0].name);
+		snprintf(which[1], sizeof(which[1]), "%12s", ct_cores[c].name);
+		for(size_t i=0;!rv&&(i<max(a->nevents, b->nevents));i++)
+		{
+			const ct_event *ea=(i<a->nevents)?a->events+i:NULL, *eb=(i<b->nevents)?b->events+i:NULL;
+			if(ea&&eb&&(ea->T==eb->T)&&!strcmp(ea->what, eb->what)&&(ea->addr==eb->addr)&&(ea->data==eb->data))
+				continue;
+			rv=1;
+			if(report)
+			{
+				append_str(report, "bus events differ:\n");
+				report_event(report, which[0], ea);
+				report_event(report, which[1], eb);
+			}
+		}
+		if(rv) break;
+		string sa=init_string(), sb=init_string();
+		dump_z80_state(&sa, &a->cpu, a->tstates);
+		dump_z80_state(&sb, &b->cpu, b->tstates);
+		if(strcmp(sa.buf, sb.buf))
+		{
+			rv=1;
+			if(report)
+			{
+				append_str(report, "final registers differ:\n");
+				for(unsigned int w=0;w<2;w++)
+				{
+					append_str(report, which[w]);
+					append_str(report, ":\n");
+					append_string(report, w?sb:sa);
+				}
+			}
+		}
+		free_string(&sa);
+		free_string(&sb);
+		for(unsigned int p=0;!rv&&(p<4);p++)
+		{
+			const uint8_t *pa=ct_mem(&a->ram, p<<14), *pb=ct_mem(&b->ram, p<<14);
+			if(!memcmp(pa, pb, 0x4000)) continue;
+			rv=1;
+			if(report)
+			{
+				unsigned int i=0;
+				while(pa[i]==pb[i]) i++;
+				char line[160]; // room for both of which[], and the rest
+				snprintf(line, sizeof(line), "memory differs at %04x:\n%s: %02x\n%s: %02x\n", (p<<14)|i, which[0], pa[i], which[1], pb[i]);
+				append_str(report, line);
+			}
+		}
+		if(rv&&report)
+		{
+			append_str(report, "(");
+			append_str(report, ct_cores[0].name);
+			append_str(report, " vs ");
+			append_str(report, ct_cores[c].name);
+			append_str(report, ")\n");
+		}
+	}
+	ct_fill(initial_memory, t, false);
+	return(rv);
+}
 
-	printf( "\n" );
+static void ct_minimise(ct_test *t, ct_machine *mc, uint8_t *initial_memory) // greedily, for as long as anything helps; t must diverge to start with
+{
+	bool changed=true;
+	while(changed)
+	{
+		changed=false;
+		unsigned int end=t->end_tstates;
+		for(t->end_tstates=1;t->end_tstates<end;t->end_tstates++)
+			if(ct_diverges(t, mc, initial_memory, NULL)>0)
+			{
+				changed=true;
+				break;
+			}
+		for(size_t i=t->nmem;i-->0;) // a byte dropped is left as DEADBEEF
+		{
+			typeof(*t->mem) save=t->mem[i];
+			memmove(t->mem+i, t->mem+i+1, (t->nmem-i-1)*sizeof(*t->mem));
+			t->nmem--;
+			if(ct_diverges(t, mc, initial_memory, NULL)>0)
+			{
+				changed=true;
+				continue;
+			}
+			memmove(t->mem+i+1, t->mem+i, (t->nmem-i)*sizeof(*t->mem));
+			t->mem[i]=save;
+			t->nmem++;
+		}
+		unsigned int *fields[]={t->regs, t->regs+1, t->regs+2, t->regs+3, t->regs+4, t->regs+5, t->regs+6, t->regs+7, t->regs+8, t->regs+9, t->regs+10, t->regs+11, &t->i, &t->r, &t->iff1, &t->iff2, &t->im};
+		for(unsigned int f=0;f<sizeof(fields)/sizeof(*fields);f++)
+		{
+			if(!*fields[f]) continue;
+			unsigned int save=*fields[f];
+			*fields[f]=0;
+			if((f==11)&&t->nmem) // moving PC takes the code with it
+			{
+				for(size_t i=0;i<t->nmem;i++)
+					t->mem[i].addr-=save;
+			}
+			if(ct_diverges(t, mc, initial_memory, NULL)>0)
+			{
+				changed=true;
+				continue;
+			}
+			*fields[f]=save;
+			if((f==11)&&t->nmem)
+			{
+				for(size_t i=0;i<t->nmem;i++)
+					t->mem[i].addr+=save;
+			}
+		}
+		if(t->halted)
+		{
+			t->halted=0;
+			if(ct_diverges(t, mc, initial_memory, NULL)>0)
+				changed=true;
+			else
+				t->halted=1;
+		}
+	}
+}
 
-	return 1;
+static void ct_write_test(FILE *f, const ct_test *t) // in the tests.in format
+{
+	fprintf(f, "%s\n", t->name);
+	for(unsigned int i=0;i<12;i++)
+		fprintf(f, "%04x%c", t->regs[i], (i<11)?' ':'\n');
+	fprintf(f, "%02x %02x %u %u %u %d %5u\n", t->i, t->r, t->iff1, t->iff2, t->im, t->halted, t->end_tstates);
+	for(size_t i=0;i<t->nmem;i++)
+	{
+		if(!i||(t->mem[i].addr!=t->mem[i-1].addr+1u))
+			fprintf(f, "%s%04x", i?" -1\n":"", t->mem[i].addr);
+		fprintf(f, " %02x", t->mem[i].val);
+	}
+	fprintf(f, "%s-1\n\n", t->nmem?" -1\n":"");
+}
+
+static int ct_cmp_number(const void *a, const void *b)
+{
+	unsigned long na=((const ct_test *)a)->number, nb=((const ct_test *)b)->number;
+	return((na>nb)-(na<nb));
+}
+
+static int ct_fuzz_worker(void *data)
+{
+	ct_fuzz *z=data;
+	ct_machine mc[CT_NCORES];
+	unsigned int c;
+	for(c=0;c<CT_NCORES;c++)
+		if(!ct_machine_init(mc+c, ct_cores[c].m))
+			break;
+	uint8_t *initial_memory=(c==CT_NCORES)?ct_initial_memory():NULL;
+	ct_test t={.mem=malloc(CT_FUZZ_BYTES*sizeof(*t.mem))};
+	int rv=0;
+	if(!initial_memory||!t.mem)
+		rv=1;
+	unsigned long n, done=0;
+	while(!rv&&(z->failed<CT_MAXFAIL)&&((n=__sync_fetch_and_add(&z->next, 1))<z->cases))
+	{
+		ct_generate(&t, z->seed, n);
+		int d=ct_diverges(&t, mc, initial_memory, NULL);
+		done++;
+		if(d<0)
+			rv=1;
+		else if(d)
+		{
+			unsigned int slot=__sync_fetch_and_add(&z->failed, 1);
+			if(slot>=CT_MAXFAIL) break;
+			ct_minimise(&t, mc, initial_memory);
+			ct_test *f=z->failures+slot;
+			*f=t;
+			f->number=n;
+			f->report=init_string();
+			if(!(f->mem=malloc(max(t.nmem, 1u)*sizeof(*t.mem))))
+			{
+				perror("malloc");
+				f->nmem=0;
+			}
+			else
+				memcpy(f->mem, t.mem, t.nmem*sizeof(*t.mem));
+			if(ct_diverges(f, mc, initial_memory, &f->report)<0)
+				rv=1;
+		}
+	}
+	__sync_fetch_and_add(&z->done, done);
+	free(t.mem);
+	free(initial_memory);
+	while(c--)
+		ct_machine_free(mc+c);
+	return(rv);
+}
+
+int coretest_fuzz(unsigned long cases, uint64_t seed, const char *fuzzfile)
+{
+	ct_fuzz z={.seed=seed, .cases=cases, .next=0, .done=0, .failed=0};
+	struct timeval start, end;
+	printf("fuzz: seed %llx, %lu cases, cores:", (unsigned long long)seed, cases);
+	for(unsigned int c=0;c<CT_NCORES;c++)
+		printf(" %s", ct_cores[c].name);
+	printf("\n");
+	fflush(stdout);
+	gettimeofday(&start, NULL);
+	int rv;
+	unsigned int nthreads=ct_spawn(ct_fuzz_worker, &z, ct_nthreads(), &rv);
+	gettimeofday(&end, NULL);
+	double secs=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)/1e6;
+	unsigned int nfail=min(z.failed, CT_MAXFAIL);
+	qsort(z.failures, nfail, sizeof(*z.failures), ct_cmp_number);
+	FILE *f=NULL;
+	if(nfail&&!(f=fopen(fuzzfile, "w")))
+		fprintf(stderr, "coretest: couldn't open `%s': %s\n", fuzzfile, strerror(errno));
+	for(unsigned int i=0;i<nfail;i++)
+	{
+		ct_test *t=z.failures+i;
+		printf("%s: DIVERGES\n%s\n", t->name, t->report.buf);
+		if(f) ct_write_test(f, t);
+		free(t->mem);
+		free_string(&t->report);
+	}
+	if(f)
+	{
+		fclose(f);
+		printf("fuzz: minimised cases written to `%s'\n", fuzzfile);
+	}
+	printf("fuzz: %lu cases, %u diverged%s (%u threads, %.1fs, %.0f cases/min)\n", z.done, nfail, (z.failed>=CT_MAXFAIL)?", stopped early":"", nthreads, secs, secs>0?z.done*60/secs:0);
+	return((rv||nfail)?1:0);
 }
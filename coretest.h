@@ -11,7 +11,12 @@
 #include <stdio.h>
 #include "z80.h"
 
-int read_test( FILE *f, unsigned int *end_tstates, z80 *cpu, uint8_t *memory);
-void dump_z80_state( z80 *cpu, unsigned int tstates );
-void dump_memory_state( uint8_t *memory, uint8_t *initial_memory );
-int run_test( FILE *f );
+/* Runs all the tests in testsfile, on as many threads as there are CPUs, and checks them against expectedfile.  Prints
+   each failure, and a summary, to stdout; returns nonzero if anything failed that isn't listed in knownfile (which may
+   be NULL), the tests we're known to fail.  Known failures that now pass are reported too */
+int coretest_run(const char *testsfile, const char *expectedfile, const char *knownfile);
+
+/* Runs cases random tests (generated from seed) on each of the ways we have of running the core, on as many threads as
+   there are CPUs, and reports any that don't all agree; minimised, they're also written to fuzzfile, in the tests.in
+   format.  Returns nonzero if anything diverged */
+int coretest_fuzz(unsigned long cases, uint64_t seed, const char *fuzzfile);
@@ -107,7 +107,7 @@ void dwrite(debugaddr addr, debugval val, debugctx ctx)
 			ram_write_bytes(ctx.ram, addr.addr, len, bytes);
 		break;
 		case DEBUGADDR_PAGE:
-			if(ctx.ram)
+			if(ctx.ram&&!ram_own(ctx.ram))
 				for(size_t i=0;i<len;i++)
 				{
 					uint16_t page=(addr.addr+i)>>14, offset=(addr.addr+i)&0x3fff;
@@ -716,7 +716,7 @@ debugval de_recursive(FILE *f, int *e, int ec, const char *const ev[256], debugc
 				far++;
 				if(strcasecmp(far, "AY")==0)
 				{
-					if(!ay_enabled)
+					if(!ctx.ay)
 					{
 						fprintf(f, "error: .: AY is not enabled\n");
 						return((debugval){DEBUGTYPE_ERR, (debugval_val){.b=0}, DNULL});
@@ -67,7 +67,7 @@ typedef struct
 	bus_t *bus;
 	ram_t *ram;
 	ula_t *ula;
-	ay_t *ay;
+	ay_t *ay; // NULL if the AY is not enabled
 }
 debugctx;
 
@@ -172,8 +172,12 @@ c[ont]         continue emulation\n\
 h[elp] [sect]  get debugger help (see 'h h')\n\
 s[tate]        show Z80 state\n\
 t[race]        trace Z80 state\n\
-b[reak] xxxx   set a breakpoint\n\
-!b[reak] xxxx  delete a breakpoint\n\
+b[reak] xxxx   set a breakpoint ([rom<n>:|ram<n>:]xxxx for a bank)\n\
+b1 xxxx        set a one-shot breakpoint (disabled once hit)\n\
+tb xxxx        set a temporary breakpoint (deleted once hit)\n\
+!b[reak] [xxxx] delete breakpoint(s)\n\
+en[able] [xxxx] enable breakpoint(s)\n\
+dis[able] [xxxx] disable breakpoint(s)\n\
 l[ist]         list breakpoints\n\
 p[rint] ...    evaluate & print expression (see 'h p')\n\
 ei             enable interrupts\n\
@@ -186,4 +190,7 @@ k ...          examine BASIC listing (see 'h k')\n\
 y              examine system variables\n\
 a[ystate] [r]  show AY state (if AY enabled)\n\
 u[laplus]      show ULAplus state (if ULA+ enabled)\n\
+tape           list tape blocks (and any recognised edge-sampler)\n\
+tape b n       seek tape to block n\n\
+tape t secs    seek tape to secs from start\n\
 q[uit]         quit Spiffy\n"
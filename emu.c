@@ -0,0 +1,1496 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	emu.c - the machine: everything that happens in a T-state, and the state it happens to
+
+	Everything a machine changes lives in its spiffy_machine; what's shared (the ROM image, the keymap, the decoding
+	tables) is only read, once set up.
+*/
+
+#include "emu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <libspectrum.h>
+#include "bits.h"
+#include "ops.h"
+#include "pbm.h"
+#include "snap.h"
+#include "hash.h"
+
+// helper fns
+static void scrn_update(spiffy_machine *m);
+static uint8_t scale38(uint8_t v);
+static void getedge(spiffy_machine *m);
+static bool ldtrap(tape_deck *deck, z80 *cpu, ram_t *ram);
+static void satrap(z80 *cpu, ram_t *ram, tape_encoder *tenc);
+static unsigned int uncontended_for(const spiffy_machine *m);
+static void putedge(spiffy_machine *m);
+static void trecfinish(bgwriter *trec, unsigned long trecpuls);
+static void loadsnap(libspectrum_snap *snap, z80 *cpu, bus_t *bus, ram_t *ram, int *Tstates);
+static bool rzx_load(spiffy_machine *m, const char *fn);
+
+uint8_t *spiffy_load_rom(machine m, const char *fn)
+{
+	if(!fn) fn=default_rom(m);
+	FILE *fp=configopen(fn, "rb");
+	if(!fp)
+	{
+		fprintf(stderr, "Failed to open Spectrum ROM `%s'!\n", fn);
+		return(NULL);
+	}
+	size_t len=rom_length(m)*0x4000u;
+	uint8_t *rom=malloc(len);
+	if(!rom)
+		perror("malloc");
+	else if(fread(rom, 1, len, fp)!=len)
+	{
+		fprintf(stderr, "Failed to read in ROM file\n");
+		free(rom);
+		rom=NULL;
+	}
+	fclose(fp);
+	return(rom);
+}
+
+spiffy_machine *spiffy_new(machine mt, const uint8_t *rom, SDL_Surface *screen)
+{
+	spiffy_machine *m=calloc(1, sizeof(*m));
+	if(!m)
+	{
+		perror("calloc");
+		return(NULL);
+	}
+	m->m=mt;
+	m->T_per_frame=frame_length(mt);
+	m->clock=1;
+	if(ram_init(&m->ram, rom, mt))
+	{
+		fprintf(stderr, "Failed to set up RAM\n");
+		spiffy_free(m);
+		return(NULL);
+	}
+	if(!screen) // an offscreen surface, so the ULA (and printer) can still draw
+	{
+		if(!(screen=SDL_CreateRGBSurface(SDL_SWSURFACE, 320, 296+120, 32, 0xff0000, 0xff00, 0xff, 0)))
+		{
+			fprintf(stderr, "SDL_CreateRGBSurface: %s\n", SDL_GetError());
+			spiffy_free(m);
+			return(NULL);
+		}
+		m->own_screen=true;
+	}
+	m->screen=screen;
+	m->y_prnt=296;
+	m->paper=true;
+	z80_reset(&m->cpu, &m->bus);
+	bus_reset(&m->bus);
+	m->ay_enabled=cap_ay(mt);
+	ay_init(&m->ay);
+	m->edgeload=true;
+	m->autotape=true;
+	m->oldtapeblock=-1;
+	m->trecfmt=TREC_CSW;
+	m->zxp_stop_motor=true;
+	return(m);
+}
+
+void spiffy_free(spiffy_machine *m)
+{
+	if(!m) return;
+	spiffy_trec_stop(m);
+	spiffy_rzx_stop(m);
+	if(m->zxp_output)
+		fclose(m->zxp_output);
+	tape_free(m->deck);
+	if(m->own_screen)
+		SDL_FreeSurface(m->screen);
+	ram_free(&m->ram);
+	free(m->filt);
+	free(m);
+}
+
+spiffy_machine *spiffy_clone(spiffy_machine *m, SDL_Surface *screen)
+{
+	spiffy_machine *c=malloc(sizeof(*c));
+	if(!c)
+	{
+		perror("malloc");
+		return(NULL);
+	}
+	*c=*m;
+	z80_copy(&c->cpu, &m->cpu);
+	// things we mustn't share (or free twice) until we've made our own
+	c->filt=NULL;
+	c->deck=NULL;
+	c->trec=NULL;
+	c->tenc=NULL;
+	c->zxp_output=NULL;
+	c->rzx=NULL;
+	c->own_screen=false;
+	c->screen=NULL;
+	c->paper=false;
+	if(ram_clone(&c->ram, &m->ram))
+	{
+		spiffy_free(c);
+		return(NULL);
+	}
+	if(m->filt)
+	{
+		if(!(c->filt=malloc(sizeof(*c->filt))))
+		{
+			perror("malloc");
+			spiffy_free(c);
+			return(NULL);
+		}
+		memcpy(c->filt, m->filt, sizeof(*c->filt));
+	}
+	if(m->deck&&!(c->deck=tape_clone(m->deck)))
+	{
+		spiffy_free(c);
+		return(NULL);
+	}
+	if(!screen) // an offscreen copy of the parent's
+	{
+		if(!(screen=SDL_CreateRGBSurface(SDL_SWSURFACE, m->screen->w, m->screen->h, 32, 0xff0000, 0xff00, 0xff, 0)))
+		{
+			fprintf(stderr, "SDL_CreateRGBSurface: %s\n", SDL_GetError());
+			spiffy_free(c);
+			return(NULL);
+		}
+		SDL_BlitSurface(m->screen, NULL, screen, NULL);
+		c->own_screen=true;
+	}
+	c->screen=screen;
+	return(c);
+}
+
+bool spiffy_printer(spiffy_machine *m, const char *fn, bool fix)
+{
+	m->zxp_enabled=true;
+	m->zxp_fix=fix;
+	if(m->zxp_output)
+		fclose(m->zxp_output);
+	if(!(m->zxp_output=fopen(fn, "wb")))
+	{
+		fprintf(stderr, "Failed to open `%s'; ZX printer output will not be saved!\n", fn);
+		perror("\tfopen");
+		return(false);
+	}
+	m->zxp_rows=0;
+	m->zxp_height_offset=pbm_putheader(m->zxp_output, 256, 0);
+	return(true);
+}
+
+bool spiffy_trec_start(spiffy_machine *m, const char *fn)
+{
+	spiffy_trec_stop(m);
+	FILE *tf=fopen(fn, "wb");
+	if(!tf)
+	{
+		perror("fopen");
+		return(false);
+	}
+	if((m->trecfmt=tape_format_from_name(fn))!=TREC_CSW)
+	{
+		tape_write_header(tf, m->trecfmt);
+		if(!(m->trec=bgw_open(tf)))
+		{
+			fclose(tf);
+			return(false);
+		}
+		if(!(m->tenc=tape_encoder_new(m->trec, m->trecfmt)))
+		{
+			fclose(bgw_finish(m->trec));
+			m->trec=NULL;
+			return(false);
+		}
+	}
+	else
+	{
+		m->trecpuls=m->trecdrop=0;
+		fputs("Compressed Square Wave", tf);
+		fputc(0x1A, tf);
+		fputc(0x02, tf);
+		fputc(0x00, tf);
+		fputc(m->T_per_frame*50, tf);
+		fputc(m->T_per_frame*50>>8, tf);
+		fputc(m->T_per_frame*50>>16, tf);
+		fputc(m->T_per_frame*50>>24, tf);
+		fputc(0, tf);
+		fputc(0, tf);
+		fputc(0, tf);
+		fputc(0, tf);
+		fputc(0x01, tf);
+		fputc((m->bus.portfe&PORTFE_MIC)?1:0, tf);
+		fputc(0, tf);
+		fputs("Spiffy", tf);
+		for(unsigned int i=6;i<16;i++) fputc(0, tf);
+		if(!(m->trec=bgw_open(tf)))
+		{
+			fclose(tf);
+			return(false);
+		}
+	}
+	fprintf(stderr, "Recording tape to `%s'\n", fn);
+	m->T_since_tape_edge=0;
+	m->oldmic=m->bus.portfe&PORTFE_MIC;
+	return(true);
+}
+
+bool spiffy_rzx_record(spiffy_machine *m, const char *fn)
+{
+	if(ram_own(&m->ram)) return(false);
+	size_t len;
+	uint8_t *sna=snap_save_sna(m->m, &m->cpu, &m->bus, &m->ram, &len);
+	if(!sna)
+	{
+		perror("malloc");
+		return(false);
+	}
+	if(!snap_load_sna(sna, len, m->m, &m->cpu, &m->bus, &m->ram, &m->Tstates)) // can't happen
+	{
+		fprintf(stderr, "rzx: couldn't reload our own snapshot\n");
+		free(sna);
+		return(false);
+	}
+	ay_init(&m->ay); // the SNA doesn't hold it, so a replay will start with it reset
+	spiffy_rzx_stop(m);
+	m->rzx=rzx_record(fn, sna, len, "sna", m->Tstates);
+	free(sna);
+	if(!m->rzx) return(false);
+	m->edgeload=false;
+	m->fetches=0;
+	m->old_m1=m->bus.m1;
+	return(true);
+}
+
+static bool rzx_load(spiffy_machine *m, const char *fn) // replays an RZX; true if we could load its snapshot
+{
+	rzx *r=rzx_play(fn);
+	if(!r) return(false);
+	bool ok=false;
+	if(!strncasecmp(r->ext, "sna", 4))
+		ok=snap_load_sna(r->snap, r->snaplen, m->m, &m->cpu, &m->bus, &m->ram, &m->Tstates);
+	else if(!strncasecmp(r->ext, "z80", 4))
+		ok=snap_load_z80(r->snap, r->snaplen, m->m, &m->cpu, &m->bus, &m->ram, &m->Tstates);
+	if(!ok)
+	{
+		fprintf(stderr, "rzx: can't load its snapshot (%.4s) into this machine\n", r->ext);
+		free(r->snap);
+		free(r->data);
+		free(r);
+		return(false);
+	}
+	spiffy_rzx_stop(m);
+	if(r->T0<(unsigned int)m->T_per_frame)
+		m->Tstates=r->T0;
+	m->rzx=r;
+	m->edgeload=false;
+	m->fetches=0;
+	m->old_m1=m->bus.m1;
+	fprintf(stderr, "Replaying '%s' (%u frames)\n", fn, r->nframes);
+	return(true);
+}
+
+bool spiffy_rzx_stop(spiffy_machine *m)
+{
+	bool ok=rzx_close(m->rzx);
+	m->rzx=NULL;
+	return(ok);
+}
+
+void spiffy_trec_stop(spiffy_machine *m)
+{
+	if(!m->trec) return;
+	if(m->trecfmt==TREC_CSW)
+	{
+		trecfinish(m->trec, m->trecpuls);
+		if(m->trecdrop)
+			fprintf(stderr, "tape: %lu pulses were dropped, as the disk couldn't keep up; the recording is damaged\n", m->trecdrop);
+	}
+	else
+	{
+		tape_encoder_finish(m->tenc, m->T_since_tape_edge);
+		m->tenc=NULL;
+		fclose(bgw_finish(m->trec));
+	}
+	m->trec=NULL;
+}
+
+void spiffy_keys(spiffy_machine *m, bool kstate[8][5])
+{
+	for(unsigned int i=0;i<8;i++)
+	{
+		m->kenc[i]=0;
+		for(unsigned int j=0;j<5;j++)
+			if(kstate[i][j]) m->kenc[i]|=(1<<j);
+	}
+}
+
+int spiffy_run(spiffy_machine *m, unsigned int frames)
+{
+	while(frames)
+	{
+		int rv=spiffy_tstep(m);
+		if(unlikely(rv&SPIFFY_ERROR))
+			return(SPIFFY_ERROR);
+		if(rv&SPIFFY_FRAME)
+			frames--;
+	}
+	return(0);
+}
+
+uint64_t spiffy_hash(const spiffy_machine *m)
+{
+	return(state_hash(&m->cpu, &m->bus, &m->ram, &m->ay, m->Tstates));
+}
+
+SDL_Surface *spiffy_screen(const spiffy_machine *m)
+{
+	return(m->screen);
+}
+
+__attribute__((gnu_inline)) inline void pset(SDL_Surface * screen, int x, int y, uint8_t r, uint8_t g, uint8_t b)
+{
+	long int s_off = (y*screen->pitch) + x*screen->format->BytesPerPixel;
+	Uint32 pixval = SDL_MapRGB(screen->format, r, g, b),
+		* pixloc = (Uint32 *)(((uint8_t *)screen->pixels)+s_off);
+	*pixloc = pixval;
+}
+
+__attribute__((gnu_inline)) inline void pget(SDL_Surface * screen, int x, int y, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+	long int s_off = (y*screen->pitch) + x*screen->format->BytesPerPixel;
+	Uint32 *pixloc = (Uint32 *)(((uint8_t *)screen->pixels)+s_off),
+		pixval = *pixloc;
+	SDL_GetRGB(pixval, screen->format, r, g, b);
+}
+
+int spiffy_tstep(spiffy_machine *m)
+{
+	z80 *cpu=&m->cpu;
+	bus_t *bus=&m->bus;
+	ram_t *ram=&m->ram;
+	ula_t *ula=&m->ula;
+	int rv=0;
+	unsigned int clock=(m->play||m->trec||m->rzx)?1:m->clock; // the tape, and RZX, keep time in 3.5MHz T-states
+	if(++m->clock_sub>=clock)
+		m->clock_sub=0;
+	if(!m->clock_sub)
+		m->Tstates++;
+	if(m->play)
+	{
+		if(unlikely(!m->deck))
+			m->play=false;
+		else if(m->T_to_tape_edge)
+			m->T_to_tape_edge--;
+		else
+		{
+			getedge(m);
+		}
+	}
+	if(bus->mreq)
+		do_ram(ram, bus);
+	
+	if(m->trec)
+		m->T_since_tape_edge++;
+	
+	if(unlikely(bus->iorq&&(bus->tris==TRIS_OUT)))
+	{
+		if(!(bus->addr&0x01)) // ULA
+		{
+			bus->portfe=bus->data;
+			if(m->trec&&((bus->portfe&PORTFE_MIC)?!m->oldmic:m->oldmic))
+			{
+				if(m->trecfmt==TREC_CSW)
+					putedge(m);
+				else
+				{
+					tape_encode_pulse(m->tenc, m->T_since_tape_edge, m->oldmic);
+					m->T_since_tape_edge=0;
+				}
+				m->oldmic=bus->portfe&PORTFE_MIC;
+			}
+		}
+		else if(cap_128_paging(m->m)&&!(bus->addr&0x8002)) // 128 Paging
+		{
+			if(!(bus->port7ffd&0x20))
+			{
+				bus->port7ffd=bus->data;
+				ram->paged[0]=(bus->port7ffd&0x10)?1:0;
+				ram->paged[3]=(bus->port7ffd&0x7)+2;
+			}
+		}
+		else if(m->zxp_enabled&&!(bus->addr&0x04)&&((!m->zxp_fix)||(bus->addr&0x40))) // ZX Printer
+		{
+			m->zxp_d0_latch=false;
+			m->zxp_d7_latch=false;
+			m->zxp_slow_motor=bus->data&0x02;
+			m->zxp_stop_motor=bus->data&0x04;
+			m->zxp_stylus_power=bus->data&0x80;
+		}
+		else if(m->ay_enabled&&((bus->addr&0x8002)==0x8000))
+		{
+			if(bus->addr&0x4000)
+				m->ay.regsel=bus->data;
+			else if(m->ay.regsel<16)
+			{
+				m->ay.reg[m->ay.regsel]=bus->data;
+				if(m->ay.regsel==13)
+				{
+					m->ay.envcount=0;
+					m->ay.envstop=false;
+					m->ay.envrev=false;
+					if(bus->data&0x04) m->ay.env=0;
+					else m->ay.env=15;
+				}
+			}
+		}
+		else if(ula->ulaplus_enabled&&(bus->addr==0xbf3b))
+		{
+			ula->ulaplus_regsel=bus->data;
+		}
+		else if(ula->ulaplus_enabled&&(bus->addr==0xff3b))
+		{
+			if(!(ula->ulaplus_regsel&0xC0))
+			{
+				ula->ulaplus_regs[ula->ulaplus_regsel]=bus->data;
+			}
+			else if(ula->ulaplus_regsel==0x40)
+			{
+				ula->ulaplus_mode=bus->data;
+			}
+		}
+	}
+	
+	if(unlikely(bus->iorq&&(bus->tris==TRIS_IN)))
+	{
+		if(!(bus->addr&0x01)) // ULA
+		{
+			uint8_t hi=bus->addr>>8;
+			bus->data=(m->ear?0x40:0)|0x1f;
+			for(int i=0;i<8;i++)
+				if(!(hi&(1<<i)))
+					bus->data&=~m->kenc[i];
+			if(m->play&&m->edgeload)
+				m->accel=loader_match(ram, *PC-2, &m->accel_head);
+			if(m->deck) // loaders sample EAR in a tight loop, counting B up (or down) between reads
+			{
+				uint64_t now=(uint64_t)m->frames*m->T_per_frame+m->Tstates;
+				uint8_t db=BREG-m->ear_read_b;
+				if(db||(now-m->ear_read_T>=16)) // else it's the same IN, still on the bus
+				{
+					if((now-m->ear_read_T<=500)&&((db==1)||(db==0xff)))
+					{
+						m->odd_reads=0;
+						if(++m->ear_reads>=10)
+						{
+							m->ear_reads=10;
+							m->loading=m->sampled=true;
+						}
+					}
+					else
+					{
+						m->ear_reads=0;
+						if(++m->odd_reads>=2) // one is just a loader starting a new byte or bit
+						{
+							m->odd_reads=2;
+							m->loading=false;
+						}
+					}
+					m->ear_read_T=now;
+					m->ear_read_b=BREG;
+					if(m->loading&&m->autotape&&!m->play&&!m->deck->ended)
+						m->play=m->autoplay=true;
+				}
+			}
+		}
+		else if(m->zxp_enabled&&!(bus->addr&0x04)&&((!m->zxp_fix)||(bus->addr&0x40))) // ZX Printer
+		{
+			bus->data=0x3e;
+			if(m->zxp_d0_latch) bus->data|=0x01;
+			if(m->zxp_d7_latch) bus->data|=0x80;
+		}
+		else if(m->kempston&&((bus->addr&0xFF)==0x1F)) // Kempston joystick
+		{
+			bus->data=bus->kempbyte;
+		}
+		else if(m->ay_enabled&&((bus->addr&0x8002)==0x8000))
+		{
+			if(bus->addr&0x4000)
+			{
+				bus->data=m->ay.reg[m->ay.regsel];
+			}
+		}
+		else if(ula->ulaplus_enabled&&(bus->addr==0xff3b))
+		{
+			if(!(ula->ulaplus_regsel&0xC0))
+			{
+				bus->data=ula->ulaplus_regs[ula->ulaplus_regsel];
+			}
+			else if(ula->ulaplus_regsel==0x40)
+			{
+				bus->data=ula->ulaplus_mode;
+			}
+		}
+		else
+			bus->data=0xff; // technically this is wrong, TODO floating bus
+		if(m->rzx&&m->rzx->playing)
+			bus->data=rzx_peek(m->rzx);
+	}
+	
+	bool rzx_read=m->rzx&&bus->iorq&&(bus->tris==TRIS_IN)&&!bus->m1;
+	if(z80_tstep(cpu, bus, 0))
+		rv|=SPIFFY_ERROR;
+	if(m->rzx)
+	{
+		if(rzx_read&&!bus->iorq) // the CPU has taken the data
+			rzx_in(m->rzx, bus->data);
+		if(bus->m1&&!m->old_m1)
+			m->fetches++;
+		m->old_m1=bus->m1;
+	}
+	if(unlikely((*PC==0x0556)&&!cpu->M&&m->edgeload&&m->deck&&(ram->paged[0]==(cap_128_paging(m->m)?1u:0u)))&&ldtrap(m->deck, cpu, ram)) // Magic block-loader (LD-BYTES, from the tape image)
+	{
+		m->T_to_tape_edge=0;
+		m->edgeflags=LIBSPECTRUM_TAPE_FLAGS_NO_EDGE;
+	}
+	else if(unlikely((*PC==0x04c2)&&!cpu->M&&!cpu->dT&&!cpu->shiftstate&&m->trec&&(m->trecfmt!=TREC_CSW)&&(*DE<=0xfffd)&&(ram->paged[0]==(cap_128_paging(m->m)?1u:0u)))) // Magic block-saver (SA-BYTES, to a TAP or TZX).  A longer block, with its flag and parity, won't fit in one; the ROM saves it through MIC, and the decoder says it couldn't be written
+		satrap(cpu, ram, m->tenc);
+	else if(unlikely(m->accel&&(*PC==m->accel_head)&&!cpu->M&&!cpu->dT&&!cpu->shiftstate&&m->play&&m->edgeload&&!m->debug)) // Magic edge-sampler (any loader's edge-wait loop, run up to the next edge)
+	{
+		bool bp=false;
+		if(m->breaks&&m->breaks->live)
+			for(unsigned int i=0;i<m->accel->len;i++)
+				if(breaks_test(m->breaks, ram, m->accel_head+i))
+					bp=true;
+		unsigned int skip=bp?0:loader_skip(m->accel, cpu, ram, m->accel_head, m->ear, m->kenc, m->T_to_tape_edge, uncontended_for(m));
+		m->Tstates+=skip;
+		m->T_to_tape_edge-=skip;
+		if(skip) // as far as loader detection is concerned, the skipped passes m->sampled EAR as usual
+		{
+			m->sampled=true;
+			m->ear_read_T=(uint64_t)m->frames*m->T_per_frame+m->Tstates;
+			m->ear_read_b=BREG;
+		}
+	}
+	else if(unlikely((*PC==0x0556)&&!cpu->M&&!cpu->dT&&!cpu->shiftstate&&m->autotape&&m->deck&&!m->play&&!m->deck->ended&&(ram->paged[0]==(cap_128_paging(m->m)?1u:0u)))) // LD-BYTES wants the tape
+		m->play=m->autoplay=m->loading=m->sampled=true;
+	else if(unlikely(m->play&&(*PC==0x05e7)&&(m->edgeload))) // Magic edge-loader (hard-coded implementation of LD-EDGE-1)
+	{
+		m->sampled=true;
+		unsigned int wait=358;
+		while((m->T_to_tape_edge<wait)&&m->play)
+		{
+			m->Tstates+=m->T_to_tape_edge;
+			wait-=m->T_to_tape_edge;
+			getedge(m);
+		}
+		if(m->play)
+		{
+			m->T_to_tape_edge-=wait;
+			m->Tstates+=wait;
+		}
+		while(1)
+		{
+			cpu->regs[5]++;
+			wait=4;
+			while((m->T_to_tape_edge<wait)&&m->play)
+			{
+				m->Tstates+=m->T_to_tape_edge;
+				wait-=m->T_to_tape_edge;
+				getedge(m);
+			}
+			if(m->play)
+			{
+				m->T_to_tape_edge-=wait;
+				m->Tstates+=wait;
+			}
+			cpu->regs[2]&=~FC;
+			if(!cpu->regs[5])
+			{
+				cpu->regs[2]|=FZ;
+				wait=11;
+				while((m->T_to_tape_edge<wait)&&m->play)
+				{
+					m->Tstates+=m->T_to_tape_edge;
+					wait-=m->T_to_tape_edge;
+					getedge(m);
+				}
+				if(m->play)
+				{
+					m->T_to_tape_edge-=wait;
+					m->Tstates+=wait;
+				}
+				*PC=ram_read(ram, (*SP)++);
+				*PC|=ram_read(ram, (*SP)++)<<8;
+				break;
+			}
+			else
+			{
+				cpu->regs[2]&=~FZ;
+				wait=22; // 5 + 7 + 10
+				while((m->T_to_tape_edge<wait)&&m->play)
+				{
+					m->Tstates+=m->T_to_tape_edge;
+					wait-=m->T_to_tape_edge;
+					getedge(m);
+				}
+				if(m->play)
+				{
+					m->T_to_tape_edge-=wait;
+					m->Tstates+=wait;
+				}
+				uint8_t hi=0x7f;
+				uint8_t data=(m->ear?0x40:0)|0x1f;
+				for(int i=0;i<8;i++)
+					if(!(hi&(1<<i)))
+						data&=~m->kenc[i];
+				cpu->regs[3]=(data>>1)|((cpu->regs[2]&FC)?0x80:0);
+				cpu->regs[2]&=~FC;
+				if(data&1) cpu->regs[2]|=FC;
+				wait=10; // 1 + 4 + 5
+				while((m->T_to_tape_edge<wait)&&m->play)
+				{
+					m->Tstates+=m->T_to_tape_edge;
+					wait-=m->T_to_tape_edge;
+					getedge(m);
+				}
+				if(m->play)
+				{
+					m->T_to_tape_edge-=wait;
+					m->Tstates+=wait;
+				}	
+				if(!(cpu->regs[2]&FC))
+				{
+					wait=6;
+					while((m->T_to_tape_edge<wait)&&m->play)
+					{
+						m->Tstates+=m->T_to_tape_edge;
+						wait-=m->T_to_tape_edge;
+						getedge(m);
+					}
+					if(m->play)
+					{
+						m->T_to_tape_edge-=wait;
+						m->Tstates+=wait;
+					}
+					*PC=ram_read(ram, (*SP)++);
+					*PC|=ram_read(ram, (*SP)++)<<8;
+					break;
+				}
+				else
+				{
+					cpu->regs[3]^=cpu->regs[4];
+					cpu->regs[3]&=0x20;
+					cpu->regs[2]&=~FZ;
+					wait=18; // 4 + 7 + 7
+					while((m->T_to_tape_edge<wait)&&m->play)
+					{
+						m->Tstates+=m->T_to_tape_edge;
+						wait-=m->T_to_tape_edge;
+						getedge(m);
+					}
+					if(m->play)
+					{
+						m->T_to_tape_edge-=wait;
+						m->Tstates+=wait;
+					}
+					if(!cpu->regs[3])
+					{
+						wait=5;
+						while((m->T_to_tape_edge<wait)&&m->play)
+						{
+							m->Tstates+=m->T_to_tape_edge;
+							wait-=m->T_to_tape_edge;
+							getedge(m);
+						}
+						if(m->play)
+						{
+							m->T_to_tape_edge-=wait;
+							m->Tstates+=wait;
+						}
+						continue;
+					}
+					cpu->regs[3]=cpu->regs[4];
+					cpu->regs[3]^=0xFF;
+					cpu->regs[4]=cpu->regs[3];
+					cpu->regs[3]&=7;
+					cpu->regs[3]|=8;
+					wait=36; // 4+4+4+7+7+10
+					while((m->T_to_tape_edge<wait)&&m->play)
+					{
+						m->Tstates+=m->T_to_tape_edge;
+						wait-=m->T_to_tape_edge;
+						getedge(m);
+					}
+					if(m->play)
+					{
+						m->T_to_tape_edge-=wait;
+						m->Tstates+=wait;
+					}
+					bus->portfe=cpu->regs[3];
+					cpu->regs[2]|=FC;
+					*PC=ram_read(ram, (*SP)++);
+					*PC|=ram_read(ram, (*SP)++)<<8;
+					wait=15; // 1+4+10
+					while((m->T_to_tape_edge<wait)&&m->play)
+					{
+						m->Tstates+=m->T_to_tape_edge;
+						wait-=m->T_to_tape_edge;
+						getedge(m);
+					}
+					if(m->play)
+					{
+						m->T_to_tape_edge-=wait;
+						m->Tstates+=wait;
+					}
+					break;
+				}
+			}
+		}
+	}
+	else if(m->trec&&(m->trecfmt==TREC_CSW)&&m->edgeload)
+	{
+		if(unlikely(*PC==0x04d8)) // Magic edge-saver part 1 (hard-coded implementation of SA-LEADER)
+		{
+			sa_leader:
+			// DJNZ SA-LEADER
+			while(1)
+			{
+				BREG--;
+				m->T_since_tape_edge+=8;
+				m->Tstates+=8;
+				if(!BREG) break;
+				m->T_since_tape_edge+=5;
+				m->Tstates+=5;
+			}
+			// OUT FE,A
+			bus->portfe=AREG;
+			m->T_since_tape_edge+=10;
+			m->Tstates+=10;
+			if((bus->portfe&PORTFE_MIC)?!m->oldmic:m->oldmic)
+			{
+				putedge(m);
+				m->oldmic=bus->portfe&PORTFE_MIC;
+			}
+			m->T_since_tape_edge++;
+			m->Tstates++;
+			// XOR 0F
+			cpu->ods.y=5;
+			op_alu(cpu, 0x0F);
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			// LD B,A4
+			BREG=0xA4;
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			// DEC L
+			LREG=op_dec8(cpu, LREG);
+			m->T_since_tape_edge+=4;
+			m->Tstates+=4;
+			// JR NZ,SA-LEADER
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			if(!(FREG&FZ))
+			{
+				m->T_since_tape_edge+=5;
+				m->Tstates+=5;
+				goto sa_leader;
+			}
+			// DEC B
+			BREG=op_dec8(cpu, BREG);
+			m->T_since_tape_edge+=4;
+			m->Tstates+=4;
+			// DEC H
+			HREG=op_dec8(cpu, HREG);
+			m->T_since_tape_edge+=4;
+			m->Tstates+=4;
+			// JP P,SA-LEADER
+			m->T_since_tape_edge+=10;
+			m->Tstates+=10;
+			if(!(FREG&FS)) goto sa_leader;
+			// LD B,2F
+			BREG=0x2F;
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			// DJNZ SA-SYNC-1
+			while(1)
+			{
+				BREG--;
+				m->T_since_tape_edge+=8;
+				m->Tstates+=8;
+				if(!BREG) break;
+				m->T_since_tape_edge+=5;
+				m->Tstates+=5;
+			}
+			// OUT FE,A
+			bus->portfe=AREG;
+			m->T_since_tape_edge+=10;
+			m->Tstates+=10;
+			if((bus->portfe&PORTFE_MIC)?!m->oldmic:m->oldmic)
+			{
+				putedge(m);
+				m->oldmic=bus->portfe&PORTFE_MIC;
+			}
+			m->T_since_tape_edge++;
+			m->Tstates++;
+			// LD A,0D
+			AREG=0x0D;
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			// LD B,37
+			BREG=0x37;
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			// DJNZ SA-SYNC-2
+			while(1)
+			{
+				BREG--;
+				m->T_since_tape_edge+=8;
+				m->Tstates+=8;
+				if(!BREG) break;
+				m->T_since_tape_edge+=5;
+				m->Tstates+=5;
+			}
+			// OUT FE,A
+			bus->portfe=AREG;
+			m->T_since_tape_edge+=10;
+			m->Tstates+=10;
+			if((bus->portfe&PORTFE_MIC)?!m->oldmic:m->oldmic)
+			{
+				putedge(m);
+				m->oldmic=bus->portfe&PORTFE_MIC;
+			}
+			m->T_since_tape_edge++;
+			m->Tstates++;
+			// LD BC,3B0E
+			*BC=0x3B0E;
+			m->T_since_tape_edge+=10;
+			m->Tstates+=10;
+			// EX AF,AF'
+			uint16_t tmp=*AF;
+			*AF=*AF_;
+			*AF_=tmp;
+			m->T_since_tape_edge+=4;
+			m->Tstates+=4;
+			// LD L,A
+			LREG=AREG;
+			m->T_since_tape_edge+=4;
+			m->Tstates+=4;
+			// JP 0x0507,SA-START
+			*PC=0x0507;
+			m->T_since_tape_edge+=10;
+			m->Tstates+=10;
+		}
+		else if(unlikely(*PC==0x0514)) // Magic edge-saver part 2 (hard-coded implementation of SA-BIT-1)
+		{
+			// DJNZ SA-BIT-1
+			while(1)
+			{
+				BREG--;
+				m->T_since_tape_edge+=8;
+				m->Tstates+=8;
+				if(!BREG) break;
+				m->T_since_tape_edge+=5;
+				m->Tstates+=5;
+			}
+			// JR NC,SA-OUT
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			if(!(FREG&FC))
+			{
+				m->T_since_tape_edge+=5;
+				m->Tstates+=5;
+				goto sa_out;
+			}
+			// LD B,42
+			BREG=0x42;
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			// DJNZ SA-SET
+			while(1)
+			{
+				BREG--;
+				m->T_since_tape_edge+=8;
+				m->Tstates+=8;
+				if(!BREG) break;
+				m->T_since_tape_edge+=5;
+				m->Tstates+=5;
+			}
+			sa_out:
+			// OUT FE,A
+			bus->portfe=AREG;
+			m->T_since_tape_edge+=10;
+			m->Tstates+=10;
+			if((bus->portfe&PORTFE_MIC)?!m->oldmic:m->oldmic)
+			{
+				putedge(m);
+				m->oldmic=bus->portfe&PORTFE_MIC;
+			}
+			m->T_since_tape_edge++;
+			m->Tstates++;
+			// LD B,3E
+			BREG=0x3E;
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			*PC=0x0520;
+			/* This section doesn't work; if I enable the hardcoded JR NZ, the tapes are unreadable.  Dunno why
+			// JR NZ,0511,SA-BIT-2
+			m->T_since_tape_edge+=7;
+			m->Tstates+=7;
+			if(!(FREG&FZ))
+			{
+				m->T_since_tape_edge+=5;
+				m->Tstates+=5;
+				*PC=0x0511;
+			}
+			else
+			{
+				*PC=0x0522;
+				// DEC B
+				BREG=op_dec8(cpu, BREG);
+				m->T_since_tape_edge+=4;
+				m->Tstates+=4;
+				// XOR A
+				cpu->ods.y=5;
+				op_alu(cpu, AREG);
+				m->T_since_tape_edge+=4;
+				m->Tstates+=4;
+				// INC A
+				AREG=op_inc8(cpu, AREG);
+				m->T_since_tape_edge+=4;
+				m->Tstates+=4;
+				// 0x0525	SA-8-BITS
+				*PC=0x0525;
+			}*/
+		}
+	}
+	if(m->clock_sub) // the CPU has this T-state to itself; the ULA, AY and printer only see every clock'th
+		return(rv);
+	scrn_update(m);
+	if(clock>1) // contention would hold the CPU to the ULA's pace
+		bus->clk_inhibit=false;
+	if(m->ay_enabled&&!(m->Tstates&0xf))
+		ay_tstep(&m->ay, (m->Tstates&0xff));
+	if(unlikely(m->Tstates==32/(int)clock)) // the interrupt is 32 of the CPU's T-states long
+		bus->irq=false;
+	if(m->zxp_enabled&&!(m->Tstates%128)) // ZX Printer emulation
+	{
+		bool paper=m->paper&&!m->blind;
+		if(paper&&m->zxp_stylus_power&&(m->zxp_stylus_posn>=128)) pset(m->screen, m->zxp_stylus_posn-96, m->y_prnt+119, 15, 3, 0);
+		if(!(m->Tstates%256))
+		{
+			if(m->zxp_feed_button||(!m->zxp_stop_motor&&!(m->zxp_slow_motor&&(m->Tstates%512))))
+			{
+				m->zxp_d0_latch=true;
+				if(++m->zxp_stylus_posn>=384)
+				{
+					m->zxp_stylus_posn=0;
+					m->zxp_rows++;
+					if(m->zxp_output)
+					{
+						fseek(m->zxp_output, m->zxp_height_offset, SEEK_SET);
+						fprintf(m->zxp_output, "%u", m->zxp_rows);
+						fseek(m->zxp_output, 0, SEEK_END);
+						for(unsigned int x=0;x<256;x++)
+						{
+							if(x) fprintf(m->zxp_output, " ");
+							uint8_t r, g, b;
+							pget(m->screen, x+32, m->y_prnt+119, &r, &g, &b);
+							bool dark=(r+g+b)<384;
+							fprintf(m->zxp_output, "%c", dark?'1':'0');
+						}
+						fprintf(m->zxp_output, "\n");
+						fflush(m->zxp_output);
+					}
+					if(paper)
+					{
+						SDL_BlitSurface(m->screen, &(SDL_Rect){0, m->y_prnt+2, m->screen->w, 118}, m->screen, &(SDL_Rect){0, m->y_prnt+1, m->screen->w, 118});
+						SDL_FillRect(m->screen, &(SDL_Rect){32, m->y_prnt+119, 256, 1}, SDL_MapRGB(m->screen->format, 191, 191, 195));
+					}
+				}
+				else if(m->zxp_stylus_posn==128)
+					m->zxp_d7_latch=true;
+			}
+		}
+	}
+	if(unlikely(m->Tstates>=m->T_per_frame)) // Frame
+	{
+		bus->reset=false;
+		m->Tstates-=m->T_per_frame;
+		bus->irq=(m->Tstates<32/(int)clock); // if we were edgeloading or edgesaving, we might have missed an irq, but we were DI anyway
+		m->Fstate=(m->Fstate+1)&0x1f; // flash alternates every 16 frames
+		if(m->sampled)
+			m->unsampled=0;
+		else if(++m->unsampled>=100) // not even a read of port FE for two seconds; whatever it was doing, it's not loading
+			m->loading=false;
+		m->sampled=false;
+		if(m->autoplay&&!m->loading)
+			m->play=false;
+		if(!m->play)
+			m->autoplay=false;
+		m->frames++;
+		rv|=SPIFFY_FRAME;
+		if(m->rzx)
+		{
+			if(rzx_frame(m->rzx, m->fetches))
+			{
+				spiffy_rzx_stop(m);
+				rv|=SPIFFY_RZX_END;
+			}
+			m->fetches=0;
+		}
+	}
+	return(rv);
+}
+
+static void scrn_update(spiffy_machine *m) // TODO: Maybe one day generate floating bus & ULA snow, but that will be hard!
+{
+	SDL_Surface *screen=m->screen;
+	int Tstates=m->Tstates;
+	ram_t *ram=&m->ram;
+	bus_t *bus=&m->bus;
+	ula_t *ula=&m->ula;
+	bool p128=cap_128_paging(m->m);
+	bool t128=cap_128_ula_timings(m->m);
+	int line,col;
+	if(t128)
+	{
+		line=((Tstates)/228)-15;
+		col=(((Tstates)%228)<<1);
+	}
+	else
+	{
+		line=((Tstates+12)/224)-16;
+		col=(((Tstates+12)%224)<<1);
+	}
+	if(likely((line>=0) && (line<296)))
+	{
+		bool contend=false;
+		if((col>=0) && (col<screen->w))
+		{
+			uint8_t uladb=0, ulaab=(bus->portfe&0x07)<<3;
+			int ccol=(col>>3)-4;
+			int crow=(line>>3)-6;
+			if((ccol>=0) && (ccol<0x20) && (crow>=0) && (crow<0x18))
+			{
+				/* there should probably be some split bus thing going on here  *
+				 * - that would presumably make contention behave correctly too */
+				if(p128)
+				{
+					unsigned int vram=bus->port7ffd&8?9:7; // RAM7, RAM5
+					uint16_t	dbh=(crow&0x18)|(line%8),
+								dbl=((crow&0x7)<<5)|ccol,
+								abh=ula->timex_enabled?dbh+0x20:0x18|(crow>>3),
+								abl=dbl;
+					uladb=ram->bank[vram][(dbh<<8)+dbl];
+					ulaab=ram->bank[vram][(abh<<8)+abl];
+					contend=!(((Tstates%8)==0)||((Tstates%8)==7)); // TODO probably wrong
+				}
+				else
+				{
+					uint16_t	dbh=0x40|(crow&0x18)|(line%8),
+								dbl=((crow&0x7)<<5)|ccol,
+								abh=ula->timex_enabled?dbh+0x20:0x58|(crow>>3),
+								abl=dbl;
+					uladb=ram_read(ram, (dbh<<8)+dbl);
+					ulaab=ram_read(ram, (abh<<8)+abl);
+					contend=!(((Tstates%8)==6)||((Tstates%8)==7));
+				}
+			}
+			if(ula->t1)
+			{
+				if(((bus->addr&0xC000)==0x4000))
+					ula->memwait=true;
+				if(p128)
+				{
+					if((bus->addr&0xC000)==0xC000)
+					{
+						if(ram->paged[3]&1)
+							ula->memwait=true;
+					}
+				}
+				if((bus->iorq&&!(bus->addr&1))||(ula->ulaplus_enabled&&((bus->addr==0xff3b)||(bus->addr==0xbf3b))))
+					ula->iowait=true;
+				ula->t1=false;
+			}
+			else
+			{
+				if(!bus->mreq)
+					ula->memwait=false;
+				if(!bus->iorq)
+					ula->iowait=false;
+				ula->t1=!bus->mreq;
+			}
+			bus->clk_inhibit=(ula->memwait||ula->iowait)&&contend;
+			if(!m->blind&&!(m->frames&m->frameskip))
+			{
+				if(unlikely(m->filt_mask&&!m->filt)&&!(m->filt=calloc(1, sizeof(*m->filt)))) // filters keep their history here; only needed once they're on
+				{
+					perror("calloc");
+					m->filt_mask=0;
+				}
+				int ink=ulaab&0x07;
+				int paper=(ulaab&0x38)>>3;
+				uint8_t r,g,b;
+				uint8_t s=0x80>>(((Tstates+12)%4)<<1);
+				bool d=uladb&s;
+				if(ula->ulaplus_enabled&&(ula->ulaplus_mode&1))
+				{
+					uint8_t clut=ulaab>>6;
+					uint8_t pix=d?ula->ulaplus_regs[(clut<<4)+ink]:ula->ulaplus_regs[(clut<<4)+paper+8];
+					uint8_t pr=(pix>>2)&7,pg=(pix>>5)&7,pb=pix&3;
+					pb=(pb<<1)|(pb&1);
+					r=scale38(pr);
+					g=scale38(pg);
+					b=scale38(pb);
+					filter_pix(m->filt, m->filt_mask, col, line, &r, &g, &b);
+					pset(screen, col, line, r, g, b);
+					d=uladb&(s>>1);
+					pix=d?ula->ulaplus_regs[(clut<<4)+ink]:ula->ulaplus_regs[(clut<<4)+paper+8];
+					pr=(pix>>2)&7;pg=(pix>>5)&7;pb=pix&3;
+					pb=(pb<<1)|(pb&1);
+					r=scale38(pr);
+					g=scale38(pg);
+					b=scale38(pb);
+					filter_pix(m->filt, m->filt_mask, col+1, line, &r, &g, &b);
+					pset(screen, col+1, line, r, g, b);
+				}
+				else
+				{
+					bool flash=ulaab&0x80;
+					bool bright=ulaab&0x40;
+					uint8_t t=bright?240:200;
+					if(flash && (m->Fstate&0x10))
+						d=!d;
+					uint8_t pix=d?ink:paper;
+					r=(pix&2)?t:0;
+					g=(pix&4)?t:0;
+					b=(pix&1)?t:0;
+					if(pix==1) b+=15;
+					filter_pix(m->filt, m->filt_mask, col, line, &r, &g, &b);
+					pset(screen, col, line, r, g, b);
+					d=uladb&(s>>1);
+					if(flash && (m->Fstate&0x10))
+						d=!d;
+					pix=d?ink:paper;
+					r=(pix&2)?t:0;
+					g=(pix&4)?t:0;
+					b=(pix&1)?t:0;
+					if(pix==1) b+=15;
+					filter_pix(m->filt, m->filt_mask, col+1, line, &r, &g, &b);
+					pset(screen, col+1, line, r, g, b);
+				}
+			}
+		}
+	}
+}
+
+static uint8_t scale38(uint8_t v)
+{
+	uint8_t rv=0;
+	if(v&4) rv|=0x90;
+	if(v&2) rv|=0x4A;
+	if(v&1) rv|=0x25;
+	return(rv);
+}
+
+static void getedge(spiffy_machine *m)
+{
+	int block=tape_position(m->deck);
+	if(unlikely(block!=m->oldtapeblock))
+	{
+		m->oldtapeblock=block;
+		if(m->stopper)
+			m->play=false;
+	}
+	if(m->edgeflags&LIBSPECTRUM_TAPE_FLAGS_STOP)
+		m->play=false;
+	if(m->edgeflags&LIBSPECTRUM_TAPE_FLAGS_STOP48)
+		m->play=false;
+	if(!(m->edgeflags&LIBSPECTRUM_TAPE_FLAGS_NO_EDGE))
+		m->ear=!m->ear;
+	if(m->edgeflags&LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW)
+		m->ear=false;
+	if(m->edgeflags&LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH)
+		m->ear=true;
+	if(m->edgeflags&LIBSPECTRUM_TAPE_FLAGS_TAPE)
+	{
+		m->play=false;
+		m->T_to_tape_edge=0;
+		m->edgeflags=0;
+	}
+	if(m->play)
+		tape_next_edge(m->deck, &m->T_to_tape_edge, &m->edgeflags);
+}
+
+/* How long we can skip ahead without the ULA possibly contending, or reaching an interrupt or the end of the frame.
+   Matches the display area in scrn_update(), with a little slack for the ULA's wait state */
+static unsigned int uncontended_for(const spiffy_machine *m)
+{
+	int Tstates=m->Tstates, T_per_frame=m->T_per_frame;
+	bool t128=cap_128_ula_timings(m->m);
+	int start=(t128?63*228:64*224-12)-8, end=(t128?255*228:256*224-12)+8;
+	if(Tstates<=32) return(0); // INT is still asserted
+	if(Tstates<start) return(start-Tstates);
+	if((Tstates>=end)&&(Tstates<T_per_frame)) return(T_per_frame-1-Tstates);
+	return(0);
+}
+
+/* Trap of LD-BYTES: loads the next block straight from the tape image, then returns through SA/LD-RET.
+   Only standard-speed ROM blocks are handled; for anything else we return false, and the block is loaded from the edges instead.
+   IX, DE, A and F (so the carry the caller tests) are left as the ROM would leave them, and so are B, H and L; C and A' aren't
+   quite.  The ROM's C (0x01 or 0x21, or its complement) depends on the EAR level when it was called and how many edges the
+   leader and sync had, none of which a tape image tells us, so we always leave 0x01, and A' the same */
+static bool ldtrap(tape_deck *deck, z80 *cpu, ram_t *ram)
+{
+	int b=tape_next_data_block(deck);
+	if(b<0) return(false);
+	if(deck->blocks[b].type!=LIBSPECTRUM_TAPE_BLOCK_ROM) return(false);
+	const uint8_t *data=deck->blocks[b].data;
+	size_t length=deck->blocks[b].len;
+	if(!data||!length) return(false);
+	tape_seek_block(deck, b+1);
+	// LD-BYTES: INC D; EX AF,AF'; DEC D; DI
+	uint8_t flag=AREG;
+	bool load=FREG&FC, first=true;
+	cpu->regs[19]=flag; // A'
+	cpu->IFF[0]=cpu->IFF[1]=false;
+	CREG=0x01; // the ROM's would depend on EAR, and the edges so far; see above
+	HREG=0;
+	size_t p=0;
+	while(1)
+	{
+		// LD-8-BITS
+		if(p>=length) // ran out of tape: LD-EDGE-2 times out, RET NC
+		{
+			LREG=0x01;
+			BREG=0;
+			FREG=(FREG&~FC)|FZ;
+			break;
+		}
+		LREG=data[p++];
+		HREG^=LREG;
+		if(!*DE) // LD A,H; CP 01; RET
+		{
+			AREG=HREG;
+			cpu->ods.y=7;
+			op_alu(cpu, 0x01);
+			BREG=0xB0;
+			break;
+		}
+		// LD-LOOP
+		if(first) // LD-FLAG: RL C; XOR L; RET NZ; LD A,C; RRA; LD C,A
+		{
+			first=false;
+			AREG=flag;
+			cpu->ods.y=5;
+			op_alu(cpu, LREG);
+			if(AREG) break;
+			cpu->regs[19]=0x01; // A', from C; so not necessarily the ROM's
+			cpu->regs[18]=FZ|FP|(load?FC:0); // F'
+			continue;
+		}
+		if(load)
+			ram_write(ram, *Ix, LREG);
+		else // LD-VERIFY: LD A,(IX+00); XOR L; RET NZ
+		{
+			AREG=ram_read(ram, *Ix);
+			cpu->ods.y=5;
+			op_alu(cpu, LREG);
+			if(AREG) break;
+		}
+		(*Ix)++;
+		(*DE)--;
+	}
+	*PC=0x053F; // SA/LD-RET restores the border, checks BREAK, re-enables interrupts and returns
+	return(true);
+}
+
+/* Trap of SA-BYTES: writes the block (flag, DE bytes from IX, and parity) straight to the TAP or TZX, then returns through SA/LD-RET
+   with the registers as the ROM would leave them */
+static void satrap(z80 *cpu, ram_t *ram, tape_encoder *tenc)
+{
+	uint16_t len=*DE;
+	uint8_t *buf=malloc(len+2);
+	if(!buf)
+	{
+		perror("malloc");
+		return;
+	}
+	uint8_t parity=buf[0]=AREG;
+	for(unsigned int i=0;i<len;i++)
+		parity^=buf[i+1]=ram_read(ram, *Ix+i);
+	buf[len+1]=parity;
+	bool ok=tape_encode_block(tenc, buf, len+2u);
+	free(buf);
+	if(!ok) // leave the ROM to save it through MIC, rather than tell it the block's saved
+	{
+		fprintf(stderr, "Tape save of %u bytes failed to trap, saving it in real time\n", len);
+		return;
+	}
+	// SA-BYTES: INC DE; DEC IX; then one DEC DE and INC IX per byte (including flag and parity), until D=FF
+	*Ix+=len+1;
+	*DE=0xFFFF;
+	*HL=0;
+	BREG=0;
+	CREG=0x0E; // LD BC,3B0E
+	AREG=0; // LD A,D; INC A
+	FREG=FZ|FH|FC; // carry from the BREAK test (RRA)
+	cpu->regs[19]=0x0D; // A'
+	cpu->regs[18]=FS|0x20|FH|0x08|FN; // F', from the last DEC H of SA-LEADER
+	cpu->IFF[0]=cpu->IFF[1]=false;
+	*PC=0x053F; // SA/LD-RET
+}
+
+static void putedge(spiffy_machine *m)
+{
+	uint8_t pulse[5];
+	size_t len=1;
+	if(m->T_since_tape_edge>0xFF)
+	{
+		pulse[0]=0;
+		pulse[1]=m->T_since_tape_edge;
+		pulse[2]=m->T_since_tape_edge>>8;
+		pulse[3]=m->T_since_tape_edge>>16;
+		pulse[4]=m->T_since_tape_edge>>24;
+		len=5;
+	}
+	else
+		pulse[0]=m->T_since_tape_edge;
+	if(bgw_write(m->trec, pulse, len)) // the header's pulse count has to match what's in the file
+		m->trecpuls++;
+	else
+		m->trecdrop++;
+	m->T_since_tape_edge=0;
+}
+
+static void trecfinish(bgwriter *trec, unsigned long trecpuls)
+{
+	FILE *fp=bgw_finish(trec);
+	if(!fp) return;
+	fseek(fp, 0x1D, SEEK_SET);
+	fputc(trecpuls, fp);
+	fputc(trecpuls>>8, fp);
+	fputc(trecpuls>>16, fp);
+	fputc(trecpuls>>24, fp);
+	fclose(fp);
+}
+
+
+bool spiffy_load(spiffy_machine *m, const char *fn, bool native)
+{
+	mapfile map;
+	if(ram_own(&m->ram)||!map_file(fn, &map)) return(false);
+	if((map.len>=4)&&!memcmp(map.buf, "RZX!", 4))
+	{
+		unmap_file(&map);
+		return(rzx_load(m, fn));
+	}
+	bool rv=false, done=false;
+	const char *ext=strrchr(fn, '.');
+	if(native) // try our own readers first; they decline anything they can't handle
+	{
+		tape_deck *d=NULL;
+		if((map.len>=8)&&!memcmp(map.buf, "ZXTape!\x1a", 8))
+			d=tape_load_mapped(&map, true);
+		else if(ext&&!strcasecmp(ext, ".tap"))
+			d=tape_load_mapped(&map, false);
+		else if(ext&&!strcasecmp(ext, ".sna"))
+			rv=done=snap_load_sna(map.buf, map.len, m->m, &m->cpu, &m->bus, &m->ram, &m->Tstates);
+		else if(ext&&!strcasecmp(ext, ".z80"))
+			rv=done=snap_load_z80(map.buf, map.len, m->m, &m->cpu, &m->bus, &m->ram, &m->Tstates);
+		if(d)
+		{
+			tape_free(m->deck);
+			m->deck=d;
+			m->tape_mounts++;
+			fprintf(stderr, "Mounted tape '%s'\n", fn);
+			done=true;
+		}
+	}
+	libspectrum_id_t type;
+	libspectrum_class_t class;
+	if(done||libspectrum_identify_file_raw(&type, fn, map.buf, map.len)||libspectrum_identify_class(&class, type))
+	{
+		unmap_file(&map);
+		return(rv);
+	}
+	switch(class)
+	{
+		case LIBSPECTRUM_CLASS_TAPE:
+		{
+			libspectrum_tape *lt=libspectrum_tape_alloc();
+			if(lt)
+			{
+				if(libspectrum_tape_read(lt, map.buf, map.len, type, fn))
+					libspectrum_tape_free(lt);
+				else
+				{
+					tape_free(m->deck);
+					m->tape_mounts++;
+					if((m->deck=tape_load(lt)))
+						fprintf(stderr, "Mounted tape '%s'\n", fn);
+				}
+			}
+		}
+		break;
+		case LIBSPECTRUM_CLASS_SNAPSHOT:
+		{
+			libspectrum_snap *snap=libspectrum_snap_alloc();
+			if(libspectrum_snap_read(snap, map.buf, map.len, type, fn))
+				fprintf(stderr, "Snap load failed\n");
+			else
+			{
+				loadsnap(snap, &m->cpu, &m->bus, &m->ram, &m->Tstates);
+				rv=true;
+			}
+			libspectrum_snap_free(snap);
+		}
+		break;
+		default:
+			fprintf(stderr, "This class of file is not supported!\n");
+		break;
+	}
+	unmap_file(&map);
+	return(rv);
+}
+
+static void loadsnap(libspectrum_snap *snap, z80 *cpu, bus_t *bus, ram_t *ram, int *Tstates)
+{
+	if(snap)
+	{
+		if(libspectrum_snap_machine(snap)!=LIBSPECTRUM_MACHINE_48) fprintf(stderr, "loadsnap: warning: machine is not 48, snap will probably fail\n");
+		z80_reset(cpu, bus);
+		AREG=libspectrum_snap_a(snap);
+		FREG=libspectrum_snap_f(snap);
+		*BC=libspectrum_snap_bc(snap);
+		*DE=libspectrum_snap_de(snap);
+		*HL=libspectrum_snap_hl(snap);
+		aREG=libspectrum_snap_a_(snap);
+		fREG=libspectrum_snap_f_(snap);
+		*BC_=libspectrum_snap_bc_(snap);
+		*DE_=libspectrum_snap_de_(snap);
+		*HL_=libspectrum_snap_hl_(snap);
+		*Ix=libspectrum_snap_ix(snap);
+		*Iy=libspectrum_snap_iy(snap);
+		*Intvec=libspectrum_snap_i(snap);
+		*Refresh=libspectrum_snap_r(snap);
+		*SP=libspectrum_snap_sp(snap);
+		*PC=libspectrum_snap_pc(snap);
+		cpu->IFF[0]=libspectrum_snap_iff1(snap);
+		cpu->IFF[1]=libspectrum_snap_iff2(snap);
+		cpu->intmode=libspectrum_snap_im(snap);
+		*Tstates=libspectrum_snap_tstates(snap);
+		cpu->halt=libspectrum_snap_halted(snap);
+		cpu->block_ints=libspectrum_snap_last_instruction_ei(snap);
+		bus->portfe=libspectrum_snap_out_ula(snap);
+		memcpy(ram->bank[1], libspectrum_snap_pages(snap, 5), 0x4000);
+		memcpy(ram->bank[2], libspectrum_snap_pages(snap, 2), 0x4000);
+		memcpy(ram->bank[3], libspectrum_snap_pages(snap, 0), 0x4000);
+		// At present we ignore SLT data
+	}
+}
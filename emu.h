@@ -0,0 +1,98 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	emu.h - the machine context, for those (the frontend and debugger) that look inside it
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL.h>
+#include "libspiffy.h"
+#include "z80.h"
+#include "vchips.h"
+#include "audio.h"
+#include "bgwrite.h"
+#include "tape.h"
+#include "loader.h"
+#include "filters.h"
+#include "rzx.h"
+#include "breaks.h"
+
+struct spiffy_machine
+{
+	machine m;
+	int T_per_frame;
+	z80 cpu;
+	bus_t bus;
+	ula_t ula;
+	ram_t ram;
+	bool ay_enabled;
+	ay_t ay;
+	int Tstates; // since the start of the frame, in the ULA's T-states
+	unsigned int clock; // CPU T-states per ULA T-state: 1 is a real Spectrum, more is a turbo one
+	unsigned int clock_sub; // CPU T-states into this ULA T-state
+	int frames;
+	int Fstate; // FLASH state
+	uint8_t kenc[8]; // encoded keyboard state
+	bool kempston; // Kempston joystick on port 1F, reading bus.kempbyte
+	// Tape playback
+	tape_deck *deck;
+	unsigned int tape_mounts; // tapes mounted so far, so a tape can be told from a later one (which may get the same deck address)
+	bool play;
+	bool stopper; // stop tape at end of this block?
+	bool edgeload; // edge loader (and traps) enabled
+	bool autotape; // start and stop the tape when a loader is detected
+	bool autoplay; // we started the tape, so we can stop it
+	bool ear; // tape reading EAR
+	uint32_t T_to_tape_edge;
+	int edgeflags;
+	int oldtapeblock;
+	bool loading, sampled; // is a loader sampling EAR?  Has one done so this frame?
+	unsigned int ear_reads, odd_reads; // successive port FE reads that do, and don't, look like a loader's
+	unsigned int unsampled; // frames since a loader last sampled EAR
+	uint64_t ear_read_T;
+	uint8_t ear_read_b;
+	const loader_sig *accel; // edge-sampling loop last seen reading the ULA
+	uint16_t accel_head;
+	bool debug; // being single-stepped, so don't skip ahead through loaders...
+	const breaks *breaks; // ... or over these; NULL if there aren't any
+	// Tape recording
+	bgwriter *trec;
+	trec_format trecfmt;
+	tape_encoder *tenc; // when recording to a TAP or TZX
+	unsigned long trecpuls, trecdrop; // CSW pulses written, and dropped (the writer's queue was full)
+	uint32_t T_since_tape_edge;
+	bool oldmic;
+	// Input recording
+	rzx *rzx; // recording, or replaying, what the CPU reads from ports; or NULL
+	unsigned int fetches; // M1 cycles this frame, by which RZX keeps time
+	bool old_m1;
+	// ZX Printer
+	bool zxp_enabled;
+	bool zxp_fix; // ZXP address is A6.¬A2, rather than ¬A2
+	unsigned int zxp_stylus_posn; // ranges from 0 to 384, with the paper starting at 128
+	bool zxp_slow_motor; // d1
+	bool zxp_stop_motor; // d2
+	bool zxp_stylus_power; // d7
+	bool zxp_d0_latch; // encoder disc
+	bool zxp_d7_latch; // stylus hits left of paper
+	bool zxp_feed_button; // is the feed button being held?
+	int zxp_height_offset; // offset of height field in zxp_output pbm file
+	unsigned int zxp_rows;
+	FILE *zxp_output;
+	// Display
+	SDL_Surface *screen;
+	bool own_screen;
+	unsigned int y_prnt; // the printer's area of the screen (its paper is the bottom row)
+	bool paper; // draw the printer's paper there?  A clone leaves that to its parent
+	int frameskip; // only draw frames where !(frames&frameskip)
+	bool blind; // draw nothing at all (speculative frames, that nobody will see)
+	unsigned int filt_mask; // which graphics filters to enable (see filters.h)
+	filter_state *filt; // NULL until the filters are first used
+};
+
+void pset(SDL_Surface * screen, int x, int y, uint8_t r, uint8_t g, uint8_t b);
+void pget(SDL_Surface * screen, int x, int y, uint8_t *r, uint8_t *g, uint8_t *b);
@@ -1,3 +1,4 @@
+#pragma once
 /*
 	spiffy - ZX spectrum emulator
 	
@@ -16,5 +17,16 @@
 #define FILT_SLOW	0x20
 #define FILT_PAL	0x40
 
+typedef struct
+{
+	uint8_t lastr, lastg, lastb, misg;
+	uint8_t rowr[320], rowg[320], rowb[320];
+	uint8_t old[320][296][3];
+	uint8_t lumx;
+	signed int oldcr[320], oldcb[320];
+	bool field;
+}
+filter_state; // what the filters remember between pixels (and frames), for one screen
+
 const char *filter_name(unsigned int filt_id);
-void filter_pix(unsigned int filt_mask, unsigned int x, unsigned int y, uint8_t *r, uint8_t *g, uint8_t *b);
+void filter_pix(filter_state *f, unsigned int filt_mask, unsigned int x, unsigned int y, uint8_t *r, uint8_t *g, uint8_t *b); // f should start zeroed
@@ -0,0 +1,140 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	hash.c - machine state hashing
+*/
+
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define FNV_PRIME	0x100000001b3ULL
+#define HASH_K1		0x9e3779b97f4a7c15ULL
+#define HASH_K2		0xc2b2ae3d27d4eb4fULL
+
+uint64_t hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+	const uint8_t *p=buf;
+	while(len--)
+	{
+		h^=*p++;
+		h*=FNV_PRIME;
+	}
+	return(h);
+}
+
+static inline uint64_t hash_round(uint64_t lane, uint64_t w)
+{
+	lane^=w*HASH_K1;
+	return(((lane<<31)|(lane>>33))*HASH_K2);
+}
+
+static inline uint64_t load_le64(const uint8_t *p) // whatever the host's byte order, so logs compare across hosts; on x86 it's one load
+{
+	uint64_t w=0;
+	for(unsigned int i=0;i<8;i++)
+		w|=(uint64_t)p[i]<<(i*8);
+	return(w);
+}
+
+uint64_t hash_words(uint64_t h, const void *buf, size_t len)
+{
+	const uint8_t *p=buf;
+	uint64_t lane[4]={h, h^HASH_K1, h^HASH_K2, ~h}; // four independent lanes, so the multiplies overlap
+	for(;len>=32;len-=32,p+=32)
+		for(unsigned int i=0;i<4;i++)
+			lane[i]=hash_round(lane[i], load_le64(p+i*8));
+	for(unsigned int i=0;i<4;i++)
+		h=hash_round(h, lane[i]);
+	return(hash_bytes(h, p, len));
+}
+
+uint64_t state_hash(const z80 *cpu, const bus_t *bus, const ram_t *ram, const ay_t *ay, int Tstates)
+{
+	uint8_t misc[8]={cpu->IFF[0], cpu->IFF[1], cpu->intmode, cpu->halt, bus->portfe, bus->port7ffd, ay->regsel, 0};
+	uint8_t T[4]={Tstates, Tstates>>8, Tstates>>16, Tstates>>24}; // little-endian, as hash_words reads
+	uint64_t h=hash_bytes(HASH_INIT, cpu->regs, sizeof(cpu->regs));
+	h=hash_bytes(h, misc, sizeof(misc));
+	h=hash_bytes(h, T, sizeof(T));
+	h=hash_bytes(h, ay->reg, sizeof(ay->reg));
+	for(unsigned int i=ram->roms;i<ram->banks;i++) // ROMs can't change
+		h=hash_words(h, ram->bank[i], 0x4000);
+	return(h);
+}
+
+hashlog *hashlog_open(const char *fn, bool compare)
+{
+	hashlog *l=malloc(sizeof(*l));
+	if(!l)
+	{
+		perror("malloc");
+		return(NULL);
+	}
+	if(!(l->fp=fopen(fn, compare?"r":"w")))
+	{
+		fprintf(stderr, "hashlog: couldn't open `%s': %s\n", fn, strerror(errno));
+		free(l);
+		return(NULL);
+	}
+	l->fn=fn;
+	l->compare=compare;
+	l->frames=0;
+	l->ended=false;
+	l->logged=0;
+	l->diverged=false;
+	return(l);
+}
+
+bool hashlog_frame(hashlog *l, uint64_t h)
+{
+	unsigned int frame=++l->frames;
+	if(!l->compare)
+	{
+		fprintf(l->fp, "%u %016llx\n", frame, (unsigned long long)h);
+		return(false);
+	}
+	if(l->ended) return(false);
+	unsigned int lframe;
+	unsigned long long lh;
+	if(fscanf(l->fp, "%u %llx", &lframe, &lh)!=2)
+	{
+		l->ended=true;
+		l->logged=frame-1;
+		return(false);
+	}
+	if((lframe!=frame)||(lh!=h))
+	{
+		if(lframe!=frame)
+			fprintf(stderr, "hashlog: `%s' is out of step: frame %u where we're at %u\n", l->fn, lframe, frame);
+		else
+			fprintf(stderr, "hashlog: frame %u diverges from `%s': expected %016llx, got %016llx\n", frame, l->fn, lh, (unsigned long long)h);
+		l->diverged=true;
+	}
+	return(l->diverged);
+}
+
+bool hashlog_close(hashlog *l)
+{
+	if(!l) return(true);
+	bool ok=!l->diverged;
+	if(l->compare&&ok)
+	{
+		unsigned int lframe;
+		unsigned long long lh;
+		if(l->ended)
+			fprintf(stderr, "hashlog: all %u frames in `%s' match (we ran %u)\n", l->logged, l->fn, l->frames);
+		else if(fscanf(l->fp, "%u %llx", &lframe, &lh)==2)
+			fprintf(stderr, "hashlog: stopped at frame %u, but `%s' goes on\n", l->frames, l->fn);
+		else
+			fprintf(stderr, "hashlog: %u frames match `%s'\n", l->frames, l->fn);
+	}
+	if(fclose(l->fp))
+	{
+		fprintf(stderr, "hashlog: error closing `%s': %s\n", l->fn, strerror(errno));
+		ok=false;
+	}
+	free(l);
+	return(ok);
+}
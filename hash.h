@@ -0,0 +1,39 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	hash.h - machine state hashing
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "z80.h"
+#include "vchips.h"
+#include "audio.h"
+
+#define HASH_INIT	0xcbf29ce484222325ULL // FNV-1a offset basis
+
+uint64_t hash_bytes(uint64_t h, const void *buf, size_t len); // FNV-1a, continuing from h
+uint64_t hash_words(uint64_t h, const void *buf, size_t len); // continuing from h; eight bytes at a time, so much faster than hash_bytes for big buffers, but depends on host byte order
+uint64_t state_hash(const z80 *cpu, const bus_t *bus, const ram_t *ram, const ay_t *ay, int Tstates); // registers, RAM (not ROM), paging and ULA ports, and AY registers
+
+/* A log of the state hash at every frame boundary, one "frame hash" line per frame; or, comparing, such a log read back
+   and checked against the frames as they come */
+typedef struct
+{
+	FILE *fp;
+	const char *fn;
+	bool compare;
+	unsigned int frames; // frames so far
+	bool ended; // comparing, and the log has run out
+	unsigned int logged; // ... after this many frames
+	bool diverged; // comparing, and a frame didn't match
+}
+hashlog;
+
+hashlog *hashlog_open(const char *fn, bool compare); // NULL (having said why) on failure
+bool hashlog_frame(hashlog *l, uint64_t h); // logs or checks the next frame.  true if we've diverged from the log (having said where)
+bool hashlog_close(hashlog *l); // frees l; false if we diverged, or the log couldn't be written.  Comparing, also says how far we matched
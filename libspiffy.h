@@ -0,0 +1,39 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	libspiffy.h - the emulator as a library
+
+	A spiffy_machine is a whole Spectrum: CPU, bus, ULA, RAM, AY, tape deck and ZX printer, and the screen the ULA draws
+	on.  Machines share nothing writable, so any number of them can be run at once, each on its own thread; the ROM image
+	they're made with is only ever read, so one copy can serve them all.  A clone shares its parent's RAM until one of them
+	writes to it, a page at a time, so forking a machine doesn't mean copying it.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL.h>
+#include "machine.h"
+
+typedef struct spiffy_machine spiffy_machine;
+
+#define SPIFFY_FRAME	0x01 // spiffy_tstep() reached the end of a frame
+#define SPIFFY_ERROR	0x02 // ... or the CPU hit something it couldn't execute
+#define SPIFFY_RZX_END	0x04 // ... or an RZX replay ran out (the machine carries on, but with live input)
+
+uint8_t *spiffy_load_rom(machine m, const char *fn); // reads rom_length(m) 16k images into a malloc()ed buffer; fn NULL for default_rom(m).  NULL (having said why) on failure
+spiffy_machine *spiffy_new(machine m, const uint8_t *rom, SDL_Surface *screen); // rom must outlive the machine.  screen NULL makes an offscreen one of its own.  NULL (having said why) on failure
+void spiffy_free(spiffy_machine *m); // also finishes any tape recording, and the printer's output
+spiffy_machine *spiffy_clone(spiffy_machine *m, SDL_Surface *screen); // a copy of m, as it is now, which then runs on its own.  RAM is shared copy-on-write, so it's cheap.  The clone doesn't record tape, or save (or draw) the printer's output.  screen NULL makes an offscreen copy of m's.  NULL (having said why) on failure
+bool spiffy_load(spiffy_machine *m, const char *fn, bool native); // mounts a tape, or loads a snapshot (returning true).  native: try our own readers before libspectrum's
+bool spiffy_printer(spiffy_machine *m, const char *fn, bool fix); // connects a ZX Printer, saving its output to fn (if we can).  fix: decode A6.¬A2, for ZXI devices
+bool spiffy_trec_start(spiffy_machine *m, const char *fn); // records MIC to a tape, in the format its name implies
+void spiffy_trec_stop(spiffy_machine *m);
+bool spiffy_rzx_record(spiffy_machine *m, const char *fn); // records every port read to an RZX, starting from a snapshot of now (which the machine is reloaded from, so it starts just as a replay will).  Turns the tape traps off, as what they load isn't read from a port
+bool spiffy_rzx_stop(spiffy_machine *m); // finishes recording (writing the file) or replaying; false if the file couldn't be written, or the replay went out of step
+void spiffy_keys(spiffy_machine *m, bool kstate[8][5]); // sets which keys are held down: [half-row][bit]
+int spiffy_tstep(spiffy_machine *m); // runs one of the CPU's T-states (sometimes more, when a trap or loader skips ahead), which is one of the ULA's unless the CPU is clocked faster; returns SPIFFY_* flags
+int spiffy_run(spiffy_machine *m, unsigned int frames); // runs up to the end of the frames'th frame from now; returns SPIFFY_ERROR if the CPU did
+uint64_t spiffy_hash(const spiffy_machine *m); // as state_hash()
+SDL_Surface *spiffy_screen(const spiffy_machine *m);
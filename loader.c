@@ -0,0 +1,83 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	loader.c - tape loader acceleration
+
+	Most loaders, whether the ROM's or a custom one, wait for an edge with some variant of
+		INC B; RET Z; [LD A,n]; IN A,(FE); [RRA; [RET NC]]; XOR C; AND n; JR Z,loop
+	While EAR stays put, every pass does the same thing apart from counting B up, so we can
+	run any number of passes at once, provided the next edge (or B wrapping to 0) doesn't
+	come in the middle of them.
+*/
+
+#include "loader.h"
+#include "ops.h"
+#include "bits.h"
+
+#define W	-1
+
+static const loader_sig loader_sigs[]=
+{
+	{.name="LD-SAMPLE", .len=13, .code={0x04, 0xC8, 0x3E, W, 0xDB, 0xFE, 0x1F, 0xD0, 0xA9, 0xE6, 0x20, 0x28, 0xF3}, .in=4, .row=3, .earbit=0x20, .breakchk=true, .T=59, .fetches=9},
+	{.name="LD-SAMPLE, no BREAK", .len=12, .code={0x04, 0xC8, 0x3E, W, 0xDB, 0xFE, 0x1F, 0xA9, 0xE6, 0x20, 0x28, 0xF4}, .in=4, .row=3, .earbit=0x20, .breakchk=false, .T=54, .fetches=8},
+	{.name="LD-SAMPLE, no LD A", .len=11, .code={0x04, 0xC8, 0xDB, 0xFE, 0x1F, 0xD0, 0xA9, 0xE6, 0x20, 0x28, 0xF5}, .in=2, .row=-1, .earbit=0x20, .breakchk=true, .T=52, .fetches=8},
+	{.name="LD-SAMPLE, no LD A or BREAK", .len=10, .code={0x04, 0xC8, 0xDB, 0xFE, 0x1F, 0xA9, 0xE6, 0x20, 0x28, 0xF6}, .in=2, .row=-1, .earbit=0x20, .breakchk=false, .T=47, .fetches=7},
+	{.name="unrotated", .len=11, .code={0x04, 0xC8, 0x3E, W, 0xDB, 0xFE, 0xA9, 0xE6, 0x40, 0x28, 0xF5}, .in=4, .row=3, .earbit=0x40, .breakchk=false, .T=50, .fetches=7},
+	{.name="unrotated, no LD A", .len=9, .code={0x04, 0xC8, 0xDB, 0xFE, 0xA9, 0xE6, 0x40, 0x28, 0xF7}, .in=2, .row=-1, .earbit=0x40, .breakchk=false, .T=43, .fetches=6},
+};
+#define NLOADER_SIGS	(sizeof(loader_sigs)/sizeof(loader_sigs[0]))
+
+static bool loader_at(const loader_sig *sig, const ram_t *ram, uint16_t head)
+{
+	for(unsigned int i=0;i<sig->len;i++)
+		if((sig->code[i]>=0)&&(ram_read(ram, head+i)!=sig->code[i]))
+			return(false);
+	return(true);
+}
+
+const loader_sig *loader_match(const ram_t *ram, uint16_t inaddr, uint16_t *head)
+{
+	for(unsigned int s=0;s<NLOADER_SIGS;s++)
+	{
+		const loader_sig *sig=loader_sigs+s;
+		if(loader_at(sig, ram, inaddr-sig->in))
+		{
+			*head=inaddr-sig->in;
+			return(sig);
+		}
+	}
+	return(NULL);
+}
+
+static bool loader_break(const uint8_t kenc[8], uint8_t hi) // would the RET NC be taken?
+{
+	for(int i=0;i<8;i++)
+		if(!(hi&(1<<i))&&(kenc[i]&1))
+			return(true);
+	return(false);
+}
+
+unsigned int loader_skip(const loader_sig *sig, z80 *cpu, const ram_t *ram, uint16_t head, bool ear, const uint8_t kenc[8], unsigned int T_to_tape_edge, unsigned int Tmax)
+{
+	if(!loader_at(sig, ram, head)) return(0); // overwritten since we saw it
+	if(ear!=!!(CREG&sig->earbit)) return(0); // the next pass will see the edge
+	if(sig->breakchk)
+	{
+		if(sig->row>=0)
+		{
+			if(loader_break(kenc, ram_read(ram, head+sig->row))) return(0);
+		}
+		else if(loader_break(kenc, AREG)||loader_break(kenc, 0)) // first pass reads with A as we find it, the rest with 0
+			return(0);
+	}
+	if(!T_to_tape_edge) return(0);
+	unsigned int k=min((T_to_tape_edge-1)/sig->T, Tmax/sig->T);
+	k=min(k, 255u-BREG);
+	if(!k) return(0);
+	BREG+=k;
+	AREG=0;
+	FREG=FZ|FH|FP;
+	*Refresh=(*Refresh&0x80)|((*Refresh+k*sig->fetches)&0x7f);
+	return(k*sig->T);
+}
@@ -0,0 +1,31 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	loader.h - tape loader acceleration
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "z80.h"
+#include "vchips.h"
+
+#define LOADER_MAXLEN	16
+
+typedef struct
+{
+	const char *name;
+	unsigned int len;
+	int16_t code[LOADER_MAXLEN]; // -1 matches any byte
+	unsigned int in; // offset of the IN A,(FE)
+	int row; // offset of the immediate of the LD A,n that selects keyboard half-rows, or -1 if the IN reads with A as left by the last pass
+	uint8_t earbit; // bit of C holding the EAR level the loop waits to change from
+	bool breakchk; // has a RET NC after the RRA (BREAK check)
+	unsigned int T; // T-states per pass, uncontended
+	unsigned int fetches; // M1 cycles per pass, for R
+}
+loader_sig;
+
+const loader_sig *loader_match(const ram_t *ram, uint16_t inaddr, uint16_t *head); // inaddr is the address of the IN A,(FE) opcode; *head gets the loop's INC B
+unsigned int loader_skip(const loader_sig *sig, z80 *cpu, const ram_t *ram, uint16_t head, bool ear, const uint8_t kenc[8], unsigned int T_to_tape_edge, unsigned int Tmax); // runs as many whole passes as finish before both the next edge and Tmax; returns T-states taken
@@ -30,11 +30,11 @@
 #define FC 0x01
 
 // decoding tables (registers)
-uint8_t tbl_r[8];
-uint8_t tbl_rp[4];
-uint8_t tbl_rp2[4];
+extern const uint8_t tbl_r[8];
+extern const uint8_t tbl_rp[4];
+extern const uint8_t tbl_rp2[4];
 // 	(other tables)
-uint8_t tbl_im[4];
+extern const uint8_t tbl_im[4];
 
 // Names/ptrs for the common regs; these tricks rely on the system being little-endian
 #define AREG	cpu->regs[3]
@@ -0,0 +1,288 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	rewind.c - in-memory rewind history
+*/
+
+#include "rewind.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "z80.h"
+
+/* A delta is a run of records, each [skip:16][n:16][n words]: skip that many unchanged 8-byte words of RAM, then XOR
+   in the n that follow.  Most of RAM doesn't change from one second to the next, so comparing (and skipping) it a
+   word at a time is what the capture costs */
+
+#define RW_WORDS	(0x4000/8) // per bank
+
+#define RW_AT(r, i)	((r)->ring+(((r)->head+(i))%(r)->size))
+
+static inline void put16(uint8_t *p, unsigned int v)
+{
+	p[0]=v;
+	p[1]=v>>8;
+}
+
+static inline unsigned int get16(const uint8_t *p)
+{
+	return(p[0]|(p[1]<<8));
+}
+
+static size_t rewind_encode(rewind_buf *r, const ram_t *ram) // leaves ram in r->ram, and what it XORed out of it in r->scratch; returns the latter's length
+{
+	uint64_t *ref=(uint64_t *)r->ram;
+	uint8_t *o=r->scratch, *rec=NULL; // rec is the open record, if n
+	unsigned int skip=0, n=0;
+	for(unsigned int b=r->roms;b<r->banks;b++)
+	{
+		const uint8_t *src=ram->bank[b];
+		for(unsigned int i=0;i<RW_WORDS;i++,ref++)
+		{
+			uint64_t v, x;
+			memcpy(&v, src+i*8, 8);
+			if(!(x=v^*ref))
+			{
+				if(n)
+				{
+					put16(rec+2, n);
+					n=0;
+				}
+				if(++skip==0xffff) // an empty record, to carry the skip
+				{
+					put16(o, skip);
+					put16(o+2, 0);
+					o+=4;
+					skip=0;
+				}
+				continue;
+			}
+			*ref=v;
+			if(!n)
+			{
+				rec=o;
+				put16(rec, skip);
+				o+=4;
+				skip=0;
+			}
+			memcpy(o, &x, 8);
+			o+=8;
+			if(++n==0xffff)
+			{
+				put16(rec+2, n);
+				n=0;
+			}
+		}
+	}
+	if(n)
+		put16(rec+2, n);
+	return(o-r->scratch);
+}
+
+static void rewind_apply(rewind_buf *r, const uint8_t *d, size_t len) // XORs a delta into r->ram
+{
+	uint64_t *ref=(uint64_t *)r->ram;
+	const uint8_t *e=d+len;
+	while(d<e)
+	{
+		ref+=get16(d);
+		unsigned int n=get16(d+2);
+		d+=4;
+		while(n--)
+		{
+			uint64_t x;
+			memcpy(&x, d, 8);
+			*ref++^=x;
+			d+=8;
+		}
+	}
+}
+
+static void rewind_drop(rewind_buf *r) // forgets the oldest capture
+{
+	rewind_frame *f=RW_AT(r, 0);
+	free(f->delta);
+	r->used-=sizeof(*f)+f->dlen;
+	r->head=(r->head+1)%r->size;
+	r->count--;
+}
+
+static int rewind_grow(rewind_buf *r)
+{
+	unsigned int size=r->size?r->size*2:16;
+	rewind_frame *ring=malloc(size*sizeof(*ring));
+	if(!ring)
+		return(1);
+	for(unsigned int i=0;i<r->count;i++)
+	{
+		ring[i]=*RW_AT(r, i);
+		z80_copy(&ring[i].m.cpu, &RW_AT(r, i)->m.cpu);
+	}
+	free(r->ring);
+	r->ring=ring;
+	r->size=size;
+	r->head=0;
+	return(0);
+}
+
+rewind_buf *rewind_new(const spiffy_machine *m, unsigned int period, size_t budget)
+{
+	rewind_buf *r=malloc(sizeof(*r));
+	if(!r)
+	{
+		perror("rewind: malloc");
+		return(NULL);
+	}
+	r->period=period?period:1;
+	r->budget=budget;
+	r->used=0;
+	r->ring=NULL;
+	r->size=r->head=r->count=0;
+	r->roms=m->ram.roms;
+	r->banks=m->ram.banks;
+	size_t words=(r->banks-r->roms)*RW_WORDS;
+	r->ram=malloc(words*8);
+	r->scratch=malloc(words*10+4); // at worst, every other word changed
+	if(!r->ram||!r->scratch)
+	{
+		perror("rewind: malloc");
+		rewind_free(r);
+		return(NULL);
+	}
+	return(r);
+}
+
+void rewind_free(rewind_buf *r)
+{
+	if(!r)
+		return;
+	while(r->count)
+		rewind_drop(r);
+	free(r->ring);
+	free(r->ram);
+	free(r->scratch);
+	free(r);
+}
+
+void rewind_capture(rewind_buf *r, const spiffy_machine *m)
+{
+	if(m->frames%r->period)
+		return;
+	if(r->count)
+	{
+		rewind_frame *n=RW_AT(r, r->count-1);
+		size_t len=rewind_encode(r, &m->ram);
+		if(len&&!(n->delta=malloc(len)))
+		{
+			perror("rewind: malloc");
+			while(r->count) // they're all lost, now r->ram has moved on from them
+				rewind_drop(r);
+		}
+		else
+		{
+			if(len)
+				memcpy(n->delta, r->scratch, len);
+			n->dlen=len;
+			r->used+=len;
+		}
+	}
+	else
+	{
+		for(unsigned int b=r->roms;b<r->banks;b++)
+			memcpy(r->ram+(b-r->roms)*0x4000, m->ram.bank[b], 0x4000);
+	}
+	if(r->count==r->size&&rewind_grow(r))
+	{
+		perror("rewind: malloc");
+		return;
+	}
+	rewind_frame *f=RW_AT(r, r->count++);
+	f->m=*m;
+	z80_copy(&f->m.cpu, &m->cpu);
+	f->tape_mount=0;
+	if(m->deck)
+	{
+		f->tape_mount=m->tape_mounts;
+		f->tape_pos=m->deck->pos;
+		f->tape_block=m->deck->block;
+		f->tape_T=m->deck->T;
+		f->tape_ended=m->deck->ended;
+	}
+	f->delta=NULL;
+	f->dlen=0;
+	r->used+=sizeof(*f);
+	while(r->used>r->budget&&r->count>1)
+		rewind_drop(r);
+}
+
+bool rewind_step(rewind_buf *r, spiffy_machine *m)
+{
+	if(!r->count)
+		return(false);
+	rewind_frame *f=RW_AT(r, r->count-1);
+	if(m->frames==f->m.frames&&m->Tstates==f->m.Tstates) // already there, so go back one more
+	{
+		if(r->count<2)
+			return(false);
+		r->count--;
+		r->used-=sizeof(*f);
+		f=RW_AT(r, r->count-1);
+		rewind_apply(r, f->delta, f->dlen);
+		free(f->delta);
+		f->delta=NULL;
+		r->used-=f->dlen;
+		f->dlen=0;
+	}
+	if(ram_own(&m->ram))
+	{
+		perror("rewind: ram_own");
+		return(false);
+	}
+	for(unsigned int b=r->roms;b<r->banks;b++)
+		memcpy(m->ram.bank[b], r->ram+(b-r->roms)*0x4000, 0x4000);
+	/* Only what the machine did; what the host set up (the keyboard, joystick, settings, screen, recording and
+	   printer output, debugger) stays as it is now */
+	const spiffy_machine *s=&f->m;
+	z80_copy(&m->cpu, &s->cpu);
+	uint8_t kempbyte=m->bus.kempbyte;
+	m->bus=s->bus;
+	m->bus.kempbyte=kempbyte;
+	m->ula=s->ula;
+	memcpy(m->ram.paged, s->ram.paged, sizeof(m->ram.paged));
+	m->ram.plock=s->ram.plock;
+	m->ay=s->ay;
+	m->Tstates=s->Tstates;
+	m->clock_sub=s->clock_sub;
+	m->frames=s->frames;
+	m->Fstate=s->Fstate;
+	m->ear=s->ear;
+	m->T_to_tape_edge=s->T_to_tape_edge;
+	m->edgeflags=s->edgeflags;
+	m->oldtapeblock=s->oldtapeblock;
+	m->loading=s->loading;
+	m->sampled=s->sampled;
+	m->ear_reads=s->ear_reads;
+	m->odd_reads=s->odd_reads;
+	m->unsampled=s->unsampled;
+	m->ear_read_T=s->ear_read_T;
+	m->ear_read_b=s->ear_read_b;
+	m->accel=s->accel;
+	m->accel_head=s->accel_head;
+	if(m->deck&&(f->tape_mount==m->tape_mounts)) // if it's another tape now, leave it where it is
+	{
+		m->deck->pos=f->tape_pos;
+		m->deck->block=f->tape_block;
+		m->deck->T=f->tape_T;
+		m->deck->ended=f->tape_ended;
+		m->play=s->play;
+		m->autoplay=s->autoplay;
+	}
+	m->zxp_stylus_posn=s->zxp_stylus_posn;
+	m->zxp_slow_motor=s->zxp_slow_motor;
+	m->zxp_stop_motor=s->zxp_stop_motor;
+	m->zxp_stylus_power=s->zxp_stylus_power;
+	m->zxp_d0_latch=s->zxp_d0_latch;
+	m->zxp_d7_latch=s->zxp_d7_latch;
+	return(true);
+}
@@ -0,0 +1,47 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	rewind.h - in-memory rewind history
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "emu.h"
+
+#define REWIND_PERIOD	50 // default frames between captures
+#define REWIND_BUDGET	4096 // default kB of history to keep
+
+typedef struct
+{
+	spiffy_machine m; // all of the machine but its RAM (and what isn't its to rewind; see rewind_step)
+	unsigned int tape_mount; // the tape that was in (its m->tape_mounts), or 0 for none; and where it had got to
+	size_t tape_pos;
+	unsigned int tape_block;
+	uint64_t tape_T;
+	bool tape_ended;
+	uint8_t *delta; // this capture's RAM, XORed with the next one's, run-length encoded; NULL for the newest
+	size_t dlen;
+}
+rewind_frame;
+
+/* The newest capture's RAM is kept whole; each older one is kept as the difference from the one after it, so stepping
+   back is a matter of undoing one difference, and the oldest captures can be dropped without touching the rest */
+typedef struct
+{
+	unsigned int period; // frames between captures
+	size_t budget, used; // bytes we may use for captures, and are using
+	rewind_frame *ring;
+	unsigned int size, head, count; // ring capacity, oldest capture, captures held
+	unsigned int roms, banks; // the RAM is banks [roms, banks)
+	uint8_t *ram; // the newest capture's RAM
+	uint8_t *scratch; // for encoding a delta, which can be bigger than the RAM
+}
+rewind_buf;
+
+rewind_buf *rewind_new(const spiffy_machine *m, unsigned int period, size_t budget); // budget in bytes.  NULL (having said why) on failure
+void rewind_free(rewind_buf *r);
+void rewind_capture(rewind_buf *r, const spiffy_machine *m); // call at the end of every frame; captures every period'th
+bool rewind_step(rewind_buf *r, spiffy_machine *m); // goes back to the newest capture, or to the one before if we're still at it.  false if there's nothing to go back to
@@ -0,0 +1,337 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	rzx.c - RZX input recordings
+*/
+
+#include "rzx.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#include "bits.h"
+
+#define RZX_CREATOR		0x10 // block IDs
+#define RZX_SNAPSHOT	0x30
+#define RZX_INPUT		0x80
+#define RZX_REPEAT		0xffff // a frame's read count, meaning the last frame's reads again
+#define RZX_EXTERNAL	0x01 // snapshot block flags: it's only a file name
+#define RZX_ENCRYPTED	0x01 // input block flags
+#define RZX_COMPRESSED	0x02 // either
+
+#define W(p)	((unsigned int)((p)[0]|((p)[1]<<8)))
+#define DW(p)	((size_t)W(p)|((size_t)W((p)+2)<<16))
+
+static inline void put16(uint8_t *p, unsigned int v)
+{
+	p[0]=v;
+	p[1]=v>>8;
+}
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p+2, v>>16);
+}
+
+static bool rzx_grow(rzx *r, size_t n) // room for n more bytes of frames
+{
+	if(r->len+n<=r->size)
+		return(true);
+	size_t size=max(r->size*2, r->len+n);
+	uint8_t *data=realloc(r->data, size);
+	if(!data)
+	{
+		perror("rzx: realloc");
+		return(false);
+	}
+	r->data=data;
+	r->size=size;
+	return(true);
+}
+
+rzx *rzx_record(const char *fn, const uint8_t *snap, size_t snaplen, const char *ext, uint32_t T0)
+{
+	rzx *r=calloc(1, sizeof(*r));
+	if(!r)
+	{
+		perror("rzx: calloc");
+		return(NULL);
+	}
+	if(!(r->fp=fopen(fn, "wb")))
+	{
+		fprintf(stderr, "rzx: couldn't open `%s': %s\n", fn, strerror(errno));
+		free(r);
+		return(NULL);
+	}
+	if(!(r->snap=malloc(snaplen))||!rzx_grow(r, 4096))
+	{
+		perror("rzx: malloc");
+		fclose(r->fp);
+		free(r->snap);
+		free(r);
+		return(NULL);
+	}
+	memcpy(r->snap, snap, snaplen);
+	r->snaplen=snaplen;
+	memcpy(r->ext, ext, 4);
+	r->T0=T0;
+	r->open=0;
+	r->len=4; // the first frame's header, filled in at its end
+	return(r);
+}
+
+static uint8_t *rzx_inflate(const uint8_t *src, size_t len, size_t hint, size_t *olen) // hint: how long it should be, or 0 if we don't know
+{
+	size_t size=hint?hint:len*4+256;
+	uint8_t *dst=malloc(size);
+	z_stream z={.next_in=(Bytef *)src, .avail_in=len};
+	if(!dst||(inflateInit(&z)!=Z_OK))
+	{
+		fprintf(stderr, "rzx: couldn't start decompressing\n");
+		free(dst);
+		return(NULL);
+	}
+	int e;
+	do
+	{
+		if(z.total_out==size)
+		{
+			uint8_t *d=realloc(dst, size*=2);
+			if(!d)
+			{
+				perror("rzx: realloc");
+				break;
+			}
+			dst=d;
+		}
+		z.next_out=dst+z.total_out;
+		z.avail_out=size-z.total_out;
+		e=inflate(&z, Z_NO_FLUSH);
+	}
+	while((e==Z_OK)||((e==Z_BUF_ERROR)&&!z.avail_out));
+	inflateEnd(&z);
+	if(e!=Z_STREAM_END)
+	{
+		fprintf(stderr, "rzx: bad compressed data\n");
+		free(dst);
+		return(NULL);
+	}
+	*olen=z.total_out;
+	return(dst);
+}
+
+static bool rzx_next(rzx *r) // starts the next frame; false if there isn't one
+{
+	if((r->frames>=r->nframes)||(r->pos+4>r->len))
+		return(false);
+	const uint8_t *p=r->data+r->pos;
+	r->fetches=W(p);
+	unsigned int n=W(p+2);
+	r->pos+=4;
+	if(n!=RZX_REPEAT)
+	{
+		if(r->pos+n>r->len)
+		{
+			fprintf(stderr, "rzx: frame %u is cut short\n", r->frames);
+			return(false);
+		}
+		r->in=r->data+r->pos;
+		r->nin=n;
+		r->pos+=n;
+	}
+	r->got=0;
+	return(true);
+}
+
+rzx *rzx_play(const char *fn)
+{
+	mapfile map;
+	if(!map_file(fn, &map)) return(NULL);
+	rzx *r=calloc(1, sizeof(*r));
+	if(!r)
+	{
+		perror("rzx: calloc");
+		unmap_file(&map);
+		return(NULL);
+	}
+	r->playing=true;
+	const uint8_t *buf=map.buf;
+	bool ok=(map.len>=10)&&!memcmp(buf, "RZX!", 4);
+	if(!ok)
+		fprintf(stderr, "rzx: `%s' isn't an RZX file\n", fn);
+	size_t blen;
+	for(size_t p=10;ok&&!r->data&&(p+5<=map.len);p+=blen)
+	{
+		blen=DW(buf+p+1);
+		if((blen<5)||(blen>map.len-p))
+		{
+			fprintf(stderr, "rzx: `%s' is malformed (block at %zu)\n", fn, p);
+			break;
+		}
+		const uint8_t *b=buf+p;
+		if((b[0]==RZX_SNAPSHOT)&&!r->snap&&(blen>=17))
+		{
+			uint32_t flags=DW(b+5);
+			memcpy(r->ext, b+9, 4);
+			if(flags&RZX_EXTERNAL)
+			{
+				fprintf(stderr, "rzx: `%s' refers to its snapshot by name, which we can't follow\n", fn);
+				break;
+			}
+			if(flags&RZX_COMPRESSED)
+			{
+				if(!(r->snap=rzx_inflate(b+17, blen-17, DW(b+13), &r->snaplen)))
+					break;
+			}
+			else if((r->snap=malloc(blen-17)))
+			{
+				memcpy(r->snap, b+17, r->snaplen=blen-17);
+			}
+		}
+		else if((b[0]==RZX_INPUT)&&r->snap&&(blen>=18))
+		{
+			r->nframes=DW(b+5);
+			r->T0=DW(b+10);
+			uint32_t flags=DW(b+14);
+			if(flags&RZX_ENCRYPTED)
+			{
+				fprintf(stderr, "rzx: `%s' is encrypted\n", fn);
+				break;
+			}
+			if(flags&RZX_COMPRESSED)
+			{
+				if(!(r->data=rzx_inflate(b+18, blen-18, 0, &r->len)))
+					break;
+			}
+			else if((r->data=malloc(blen-18)))
+			{
+				memcpy(r->data, b+18, r->len=blen-18);
+			}
+		}
+	}
+	unmap_file(&map);
+	if(!r->snap||!r->data||!rzx_next(r))
+	{
+		if(r->snap&&r->data)
+			fprintf(stderr, "rzx: `%s' has no frames\n", fn);
+		else if(ok)
+			fprintf(stderr, "rzx: `%s' has no snapshot and input recording we can use\n", fn);
+		free(r->snap);
+		free(r->data);
+		free(r);
+		return(NULL);
+	}
+	return(r);
+}
+
+static bool rzx_put_block(FILE *fp, uint8_t id, const uint8_t *hdr, size_t hlen, const uint8_t *data, size_t len) // compressed, if it's data
+{
+	uint8_t *z=NULL;
+	uLongf zlen=0;
+	if(data)
+	{
+		zlen=compressBound(len);
+		if(!(z=malloc(zlen))||(compress2(z, &zlen, data, len, Z_BEST_COMPRESSION)!=Z_OK))
+		{
+			fprintf(stderr, "rzx: couldn't compress\n");
+			free(z);
+			return(false);
+		}
+	}
+	uint8_t b[5];
+	b[0]=id;
+	put32(b+1, 5+hlen+zlen);
+	bool ok=(fwrite(b, 1, 5, fp)==5)&&(fwrite(hdr, 1, hlen, fp)==hlen)&&(fwrite(z, 1, zlen, fp)==zlen);
+	free(z);
+	return(ok);
+}
+
+bool rzx_close(rzx *r)
+{
+	if(!r) return(true);
+	bool ok=true;
+	if(r->playing)
+	{
+		fprintf(stderr, "rzx: played %u of %u frames", r->frames, r->nframes);
+		if(r->desync)
+			fprintf(stderr, ", %u of them out of step", r->desync);
+		fprintf(stderr, "\n");
+		ok=!r->desync;
+	}
+	else
+	{
+		uint8_t hdr[24];
+		memcpy(hdr, "RZX!", 4);
+		hdr[4]=0; // version 0.13
+		hdr[5]=13;
+		put32(hdr+6, 0); // flags: not signed
+		ok=fwrite(hdr, 1, 10, r->fp)==10;
+		memset(hdr, 0, 24);
+		strcpy((char *)hdr, "spiffy");
+		put16(hdr+20, 0); // version 0.0
+		put16(hdr+22, 0);
+		ok=ok&&rzx_put_block(r->fp, RZX_CREATOR, hdr, 24, NULL, 0);
+		put32(hdr, RZX_COMPRESSED);
+		memcpy(hdr+4, r->ext, 4);
+		put32(hdr+8, r->snaplen);
+		ok=ok&&rzx_put_block(r->fp, RZX_SNAPSHOT, hdr, 12, r->snap, r->snaplen);
+		put32(hdr, r->frames); // the frame still open, which isn't finished, is dropped
+		hdr[4]=0;
+		put32(hdr+5, r->T0);
+		put32(hdr+9, RZX_COMPRESSED);
+		ok=ok&&rzx_put_block(r->fp, RZX_INPUT, hdr, 13, r->data, r->open);
+		if(fclose(r->fp))
+			ok=false;
+		if(!ok)
+			fprintf(stderr, "rzx: error writing recording\n");
+		else
+			fprintf(stderr, "rzx: recorded %u frames\n", r->frames);
+	}
+	free(r->snap);
+	free(r->data);
+	free(r);
+	return(ok);
+}
+
+void rzx_in(rzx *r, uint8_t val)
+{
+	if(r->playing)
+		r->got++;
+	else if(rzx_grow(r, 1))
+		r->data[r->len++]=val;
+}
+
+bool rzx_frame(rzx *r, unsigned int fetches)
+{
+	if(r->playing)
+	{
+		if((fetches!=r->fetches)||(r->got!=r->nin))
+		{
+			if(!r->desync++)
+				fprintf(stderr, "rzx: frame %u out of step: %u fetches and %u reads, where the recording had %u and %u\n", r->frames, fetches, r->got, r->fetches, r->nin);
+		}
+		r->frames++;
+		return(!rzx_next(r));
+	}
+	unsigned int n=r->len-r->open-4;
+	if(n&&(n==r->nlast)&&!memcmp(r->data+r->last, r->data+r->open+4, n))
+	{
+		r->len=r->open+4;
+		n=RZX_REPEAT;
+	}
+	else
+	{
+		r->last=r->open+4;
+		r->nlast=n;
+	}
+	put16(r->data+r->open, min(fetches, 0xffff));
+	put16(r->data+r->open+2, n);
+	r->frames++;
+	if(!rzx_grow(r, 4))
+		return(false); // we'll lose the frames from here on
+	r->open=r->len;
+	r->len+=4;
+	return(false);
+}
@@ -0,0 +1,50 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	rzx.h - RZX input recordings
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* An RZX is a snapshot, and then everything the CPU read from an I/O port, frame by frame; each frame also says how
+   many opcode fetches (M1 cycles) it had, so a replay can tell if it's out of step.  Since nothing else comes into
+   the machine from outside, replaying the reads from the snapshot reproduces the run exactly */
+typedef struct
+{
+	FILE *fp; // recording: the file, which is written when we're closed
+	bool playing;
+	uint8_t *data; // the frames, as in the file: [fetches:16][n:16][n bytes read], or n=0xffff for the last frame's again
+	size_t len, size;
+	unsigned int frames; // recorded, or played
+	uint8_t *snap; // the snapshot we started from
+	size_t snaplen;
+	char ext[4]; // its type, as a file extension ("sna")
+	uint32_t T0; // T-states into the frame at the start
+	// recording
+	size_t open; // the current frame's header
+	size_t last; // the previous frame's reads, and how many
+	unsigned int nlast;
+	// playing
+	unsigned int nframes; // in the file
+	size_t pos; // the next frame's header
+	const uint8_t *in; // the current frame's reads
+	unsigned int nin, got;
+	unsigned int fetches; // the current frame's fetches
+	unsigned int desync; // frames that weren't in step
+}
+rzx;
+
+rzx *rzx_record(const char *fn, const uint8_t *snap, size_t snaplen, const char *ext, uint32_t T0); // ext is 4 bytes, NUL-padded, as in the file ("sna").  NULL (having said why) on failure
+rzx *rzx_play(const char *fn); // reads the first snapshot, and the input recording that follows it.  NULL (having said why) on failure
+bool rzx_close(rzx *r); // frees r; recording, writes the file first (false if we can't).  Playing, says how the replay went
+static inline uint8_t rzx_peek(const rzx *r) // playing: what the CPU's port read is to get
+{
+	return((r->got<r->nin)?r->in[r->got]:0xff);
+}
+void rzx_in(rzx *r, uint8_t val); // the CPU has read val from a port
+bool rzx_frame(rzx *r, unsigned int fetches); // at the end of each frame.  true once a replay has run out of frames
@@ -0,0 +1,100 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	sched.c - frame pacing
+*/
+
+#include "sched.h"
+#include <errno.h>
+#include <string.h>
+#ifdef WINDOWS
+#include <SDL.h>
+#endif /* WINDOWS */
+
+#define NS	1000000000LL
+
+const char *sched_bucket_names[SCHED_BUCKETS]={"<0.1ms", "<0.5ms", "<1ms", "<2ms", "<5ms", "<10ms", "more"};
+static const int64_t sched_bucket_ns[SCHED_BUCKETS-1]={100000, 500000, 1000000, 2000000, 5000000, 10000000};
+
+int64_t sched_now(void)
+{
+#ifndef WINDOWS
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return(t.tv_sec*NS+t.tv_nsec);
+#else /* WINDOWS */
+	return(SDL_GetTicks()*1000000LL);
+#endif /* WINDOWS */
+}
+
+static void sleep_until(int64_t deadline)
+{
+#ifndef WINDOWS
+	struct timespec t={.tv_sec=deadline/NS, .tv_nsec=deadline%NS};
+	int e;
+	while((e=clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL))==EINTR);
+	if(e)
+		fprintf(stderr, "clock_nanosleep: %s\n", strerror(e));
+#else /* WINDOWS */
+	int64_t left=deadline-sched_now(); // no absolute sleep here; SDL_Delay only has ms, and may oversleep, which the next deadline makes up for
+	if(left>0)
+		SDL_Delay(left/1000000);
+#endif /* WINDOWS */
+}
+
+void sched_init(sched *s, int64_t period)
+{
+	memset(s, 0, sizeof(*s));
+	s->period=period;
+}
+
+void sched_period(sched *s, int64_t period)
+{
+	s->period=period;
+}
+
+void sched_stop(sched *s)
+{
+	s->running=false;
+}
+
+void sched_wait(sched *s)
+{
+	int64_t now=sched_now();
+	if(!s->running) // the frame we've just finished is the first; it's due a period from now
+	{
+		s->deadline=now+s->period;
+		s->running=true;
+	}
+	else if(now-s->deadline>SCHED_RESYNC*s->period) // too far behind to catch up
+	{
+		s->deadline=now;
+		s->resyncs++;
+	}
+	sleep_until(s->deadline);
+	int64_t late=sched_now()-s->deadline;
+	unsigned int b=0;
+	while((b<SCHED_BUCKETS-1)&&(late>=sched_bucket_ns[b]))
+		b++;
+	s->hist[b]++;
+	s->frames++;
+	if(late>s->worst)
+		s->worst=late;
+	s->deadline+=s->period;
+}
+
+void sched_report(sched *s, FILE *fp)
+{
+	if(!s->frames) return;
+	fprintf(fp, "jitter:");
+	for(unsigned int b=0;b<SCHED_BUCKETS;b++)
+		fprintf(fp, " %s %u", sched_bucket_names[b], s->hist[b]);
+	fprintf(fp, "; worst %.2fms", s->worst/1e6);
+	if(s->resyncs)
+		fprintf(fp, "; fell behind %u times", s->resyncs);
+	fprintf(fp, "\n");
+	memset(s->hist, 0, sizeof(s->hist));
+	s->frames=s->resyncs=0;
+	s->worst=0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	sched.h - frame pacing
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SCHED_BUCKETS	7 // lateness under 0.1, 0.5, 1, 2, 5, 10ms, and more
+#define SCHED_RESYNC	4 // frames behind before we give up catching up
+
+/* Each frame has a deadline on the monotonic clock, a period after the last one's (not after whenever we got there),
+   so lateness in one frame is made up in the next rather than piling up; only if we fall right behind do we start
+   again from now.  On Windows, there's only SDL's millisecond clock and SDL_Delay, so expect coarser jitter */
+typedef struct
+{
+	int64_t deadline; // when this frame is due, in ns by sched_now()
+	int64_t period; // ns per frame
+	bool running; // deadline set?
+	unsigned int hist[SCHED_BUCKETS]; // frames since the last report, by how late we woke for them
+	unsigned int frames, resyncs;
+	int64_t worst; // ns
+}
+sched;
+
+extern const char *sched_bucket_names[SCHED_BUCKETS];
+
+int64_t sched_now(void); // ns on the monotonic clock, from some arbitrary start
+void sched_init(sched *s, int64_t period); // period in ns
+void sched_period(sched *s, int64_t period); // from the next frame on
+void sched_wait(sched *s); // sleeps until the frame's deadline, and sets the next
+void sched_stop(sched *s); // we're not pacing for a while (paused, or flat out); start afresh when we next wait
+void sched_report(sched *s, FILE *fp); // prints the histogram so far, and starts a new one
@@ -0,0 +1,325 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	snap.c - native snapshot readers (and an SNA writer)
+
+	These read SNA and Z80 files straight into the machine, without going through a libspectrum_snap: uncompressed
+	pages are copied straight from the file into their RAM banks, and compressed ones unpacked into them.
+	Anything we don't handle (other machines, odd formats) is left to libspectrum.
+*/
+
+#include "snap.h"
+#include <stdlib.h>
+#include <string.h>
+#include "ops.h"
+#include "bits.h"
+
+#define W(p)	((unsigned int)((p)[0]|((p)[1]<<8)))
+#define SNA_HDR	27
+#define SNA_48	(SNA_HDR+0xc000)
+#define Z80_HDR	30
+
+static int snap_bank(machine m, unsigned int page) // ram->bank index of RAM page, or -1
+{
+	if(cap_128_paging(m)) return((page<8)?(int)page+2:-1);
+	switch(page)
+	{
+		case 5: return(1);
+		case 2: return(2);
+		case 0: return(3);
+	}
+	return(-1);
+}
+
+static void snap_paging(machine m, bus_t *bus, ram_t *ram, uint8_t port7ffd)
+{
+	if(!cap_128_paging(m)) return;
+	bus->port7ffd=port7ffd;
+	ram->paged[0]=(port7ffd&0x10)?1:0;
+	ram->paged[3]=(port7ffd&0x7)+2;
+}
+
+bool snap_load_sna(const uint8_t *buf, size_t len, machine m, z80 *cpu, bus_t *bus, ram_t *ram, int *Tstates)
+{
+	bool s128=len>SNA_48;
+	uint8_t port7ffd=0x30; // a 48K snap on a 128 wants the 48 BASIC ROM, and paging locked
+	if(s128)
+	{
+		if(!cap_128_paging(m)||(len<SNA_48+4)) return(false);
+		port7ffd=buf[SNA_48+2];
+		unsigned int top=port7ffd&0x7, rest=((top==2)||(top==5))?6:5; // the remaining pages don't include the one at 0xC000, unless it's also at 0x4000 or 0x8000
+		if(len!=SNA_48+4+rest*0x4000u) return(false);
+	}
+	else if(len!=SNA_48) return(false);
+	const uint8_t *h=buf, *pages=buf+SNA_HDR;
+	z80_reset(cpu, bus);
+	*Intvec=h[0];
+	*HL_=W(h+1);
+	*DE_=W(h+3);
+	*BC_=W(h+5);
+	fREG=h[7];
+	aREG=h[8];
+	*HL=W(h+9);
+	*DE=W(h+11);
+	*BC=W(h+13);
+	*Iy=W(h+15);
+	*Ix=W(h+17);
+	cpu->IFF[0]=cpu->IFF[1]=h[19]&0x04;
+	*Refresh=h[20];
+	FREG=h[21];
+	AREG=h[22];
+	*SP=W(h+23);
+	cpu->intmode=h[25]&3;
+	bus->portfe=h[26]&0x07;
+	snap_paging(m, bus, ram, port7ffd);
+	memcpy(ram->bank[snap_bank(m, 5)], pages, 0x4000);
+	memcpy(ram->bank[snap_bank(m, 2)], pages+0x4000, 0x4000);
+	memcpy(ram->bank[snap_bank(m, s128?port7ffd&0x7:0)], pages+0x8000, 0x4000);
+	if(s128)
+	{
+		const uint8_t *t=pages+0xc000;
+		*PC=W(t);
+		t+=4;
+		for(unsigned int p=0;p<8;p++)
+			if((p!=5)&&(p!=2)&&(p!=(port7ffd&0x7u)))
+			{
+				memcpy(ram->bank[snap_bank(m, p)], t, 0x4000);
+				t+=0x4000;
+			}
+	}
+	else // PC is on the stack; RETN
+	{
+		*PC=ram_read_word(ram, *SP);
+		*SP+=2;
+	}
+	*Tstates=0;
+	return(true);
+}
+
+uint8_t *snap_save_sna(machine m, const z80 *cpu, const bus_t *bus, const ram_t *ram, size_t *len)
+{
+	bool s128=cap_128_paging(m);
+	unsigned int top=s128?bus->port7ffd&0x7:0;
+	*len=SNA_48+(s128?4+(((top==2)||(top==5))?6:5)*0x4000u:0);
+	uint8_t *buf=malloc(*len);
+	if(!buf) return(NULL);
+	uint8_t *h=buf, *pages=buf+SNA_HDR;
+	uint16_t sp=*SP;
+	memcpy(pages, ram->bank[snap_bank(m, 5)], 0x4000);
+	memcpy(pages+0x4000, ram->bank[snap_bank(m, 2)], 0x4000);
+	memcpy(pages+0x8000, ram->bank[snap_bank(m, top)], 0x4000);
+	if(s128)
+	{
+		uint8_t *t=pages+0xc000;
+		t[0]=*PC;
+		t[1]=*PC>>8;
+		t[2]=bus->port7ffd;
+		t[3]=0; // TR-DOS not paged
+		t+=4;
+		for(unsigned int p=0;p<8;p++)
+			if((p!=5)&&(p!=2)&&(p!=top))
+			{
+				memcpy(t, ram->bank[snap_bank(m, p)], 0x4000);
+				t+=0x4000;
+			}
+	}
+	else // push PC, for the loader to RETN; if the stack's in ROM, it's lost, but then so is the snap
+	{
+		sp-=2;
+		if(sp>=0x4000) pages[sp-0x4000]=*PC;
+		if((uint16_t)(sp+1)>=0x4000) pages[(uint16_t)(sp+1)-0x4000]=*PC>>8;
+	}
+	h[0]=*Intvec;
+	h[1]=*HL_;
+	h[2]=*HL_>>8;
+	h[3]=*DE_;
+	h[4]=*DE_>>8;
+	h[5]=*BC_;
+	h[6]=*BC_>>8;
+	h[7]=fREG;
+	h[8]=aREG;
+	h[9]=*HL;
+	h[10]=*HL>>8;
+	h[11]=*DE;
+	h[12]=*DE>>8;
+	h[13]=*BC;
+	h[14]=*BC>>8;
+	h[15]=*Iy;
+	h[16]=*Iy>>8;
+	h[17]=*Ix;
+	h[18]=*Ix>>8;
+	h[19]=cpu->IFF[1]?0x04:0;
+	h[20]=*Refresh;
+	h[21]=FREG;
+	h[22]=AREG;
+	h[23]=sp;
+	h[24]=sp>>8;
+	h[25]=cpu->intmode;
+	h[26]=bus->portfe&0x07;
+	return(buf);
+}
+
+static bool z80_unpack(const uint8_t *src, size_t len, uint8_t *dst) // ED ED n b is n copies of b.  false unless it fills exactly 16k.  dst can be NULL, to just check
+{
+	size_t o=0, i=0;
+	while((o<0x4000)&&(i<len))
+	{
+		if((i+3<len)&&(src[i]==0xed)&&(src[i+1]==0xed))
+		{
+			unsigned int n=src[i+2];
+			if(o+n>0x4000) return(false);
+			if(dst) memset(dst+o, src[i+3], n);
+			o+=n;
+			i+=4;
+		}
+		else
+		{
+			if(dst) dst[o]=src[i];
+			o++;
+			i++;
+		}
+	}
+	return(o==0x4000);
+}
+
+static size_t z80_unpack_48(const uint8_t *src, size_t len, uint8_t *const dst[3]) // version 1: all 48k in one stream.  Returns bytes used, or 0 if it doesn't fill 48k
+{
+	size_t o=0, i=0;
+	while((o<0xc000)&&(i<len))
+	{
+		unsigned int n=1;
+		uint8_t b=src[i];
+		if((i+3<len)&&(src[i]==0xed)&&(src[i+1]==0xed))
+		{
+			n=src[i+2];
+			b=src[i+3];
+			i+=4;
+		}
+		else
+			i++;
+		if(o+n>0xc000) return(0);
+		for(;n;n--,o++)
+			if(dst[0]) dst[o>>14][o&0x3fff]=b;
+	}
+	return((o==0xc000)?i:0);
+}
+
+static void z80_regs(const uint8_t *h, z80 *cpu, bus_t *bus)
+{
+	uint8_t flags=(h[12]==0xff)?1:h[12]; // 255 means 1, for compatibility
+	z80_reset(cpu, bus);
+	AREG=h[0];
+	FREG=h[1];
+	*BC=W(h+2);
+	*HL=W(h+4);
+	*PC=W(h+6);
+	*SP=W(h+8);
+	*Intvec=h[10];
+	*Refresh=(h[11]&0x7f)|((flags&1)<<7);
+	bus->portfe=(flags>>1)&0x07;
+	*DE=W(h+13);
+	*BC_=W(h+15);
+	*DE_=W(h+17);
+	*HL_=W(h+19);
+	aREG=h[21];
+	fREG=h[22];
+	*Iy=W(h+23);
+	*Ix=W(h+25);
+	cpu->IFF[0]=h[27];
+	cpu->IFF[1]=h[28];
+	cpu->intmode=h[29]&3;
+}
+
+static int z80_page_bank(machine m, bool z128, uint8_t page) // bank to load a version 2/3 page into, or -1 to skip it
+{
+	if(z128) return(((page>=3)&&(page<=10))?snap_bank(m, page-3):-1);
+	switch(page)
+	{
+		case 4: return(snap_bank(m, 2));
+		case 5: return(snap_bank(m, 0));
+		case 8: return(snap_bank(m, 5));
+	}
+	return(-1);
+}
+
+bool snap_load_z80(const uint8_t *buf, size_t len, machine m, z80 *cpu, bus_t *bus, ram_t *ram, int *Tstates)
+{
+	if(len<Z80_HDR) return(false);
+	const uint8_t *h=buf;
+	if(W(h+6)) // version 1: 48k only
+	{
+		bool packed=(h[12]!=0xff)&&(h[12]&0x20);
+		uint8_t *dst[3]={NULL, NULL, NULL};
+		if(packed?!z80_unpack_48(buf+Z80_HDR, len-Z80_HDR, dst):(len<Z80_HDR+0xc000)) return(false);
+		z80_regs(h, cpu, bus);
+		snap_paging(m, bus, ram, 0x30);
+		dst[0]=ram->bank[snap_bank(m, 5)];
+		dst[1]=ram->bank[snap_bank(m, 2)];
+		dst[2]=ram->bank[snap_bank(m, 0)];
+		if(packed)
+			z80_unpack_48(buf+Z80_HDR, len-Z80_HDR, dst);
+		else
+			for(unsigned int i=0;i<3;i++)
+				memcpy(dst[i], buf+Z80_HDR+i*0x4000, 0x4000);
+		*Tstates=0;
+		return(true);
+	}
+	if(len<Z80_HDR+2) return(false);
+	size_t ext=W(h+30), hdr=Z80_HDR+2+ext;
+	bool v3;
+	if(ext==23) v3=false;
+	else if((ext==54)||(ext==55)) v3=true;
+	else return(false);
+	if(len<hdr) return(false);
+	bool z128;
+	switch(h[34]) // hardware mode
+	{
+		case 0: case 1: z128=false; break; // 48k, 48k+IF1
+		case 3: z128=!v3; break; // 128k (v2), or 48k+MGT (v3)
+		case 4: z128=true; break; // 128k+IF1 (v2), or 128k (v3)
+		case 5: case 6: if(!v3) return(false); z128=true; break; // 128k+IF1, 128k+MGT
+		default: return(false);
+	}
+	if(!z128&&(h[37]&0x80)) return(false); // 16k
+	if(z128&&!cap_128_paging(m)) return(false);
+	for(unsigned int pass=0;pass<2;pass++) // check all the pages before we touch anything
+	{
+		if(pass)
+		{
+			z80_regs(h, cpu, bus);
+			*PC=W(h+32);
+			snap_paging(m, bus, ram, z128?h[35]:0x30);
+		}
+		size_t p=hdr;
+		while(p<len)
+		{
+			if(len-p<3) return(false);
+			size_t plen=W(buf+p);
+			int bank=z80_page_bank(m, z128, buf[p+2]);
+			p+=3;
+			bool raw=(plen==0xffff);
+			if(raw) plen=0x4000;
+			if(len-p<plen) return(false);
+			if(bank>=0)
+			{
+				if(raw)
+				{
+					if(pass) memcpy(ram->bank[bank], buf+p, 0x4000);
+				}
+				else if(!z80_unpack(buf+p, plen, pass?ram->bank[bank]:NULL))
+					return(false);
+			}
+			p+=plen;
+		}
+	}
+	*Tstates=0;
+	if(v3)
+	{
+		int T_per_frame=frame_length(m), quarter=T_per_frame/4;
+		int t=(((h[57]+1)%4)+1)*quarter-(W(h+55)+1);
+		if((t>=0)&&(t<T_per_frame))
+			*Tstates=t;
+	}
+	return(true);
+}
@@ -0,0 +1,23 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	snap.h - native snapshot readers (and an SNA writer)
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "z80.h"
+#include "vchips.h"
+#include "machine.h"
+
+/* Each loads the snapshot in buf straight into the machine, and returns true; or returns false, having touched nothing,
+   if the file is malformed or isn't for a machine like m (in which case the caller can try libspectrum instead) */
+bool snap_load_sna(const uint8_t *buf, size_t len, machine m, z80 *cpu, bus_t *bus, ram_t *ram, int *Tstates);
+bool snap_load_z80(const uint8_t *buf, size_t len, machine m, z80 *cpu, bus_t *bus, ram_t *ram, int *Tstates);
+
+/* Returns the machine state as an SNA file (malloc()ed, *len bytes long), or NULL if out of memory.  The machine isn't
+   touched: on a 48, PC is pushed onto the stack in the file's copy of the RAM, not the real one */
+uint8_t *snap_save_sna(machine m, const z80 *cpu, const bus_t *bus, const ram_t *ram, size_t *len);
@@ -19,6 +19,7 @@
 #include <SDL/SDL_audio.h>
 #include <SDL/SDL_ttf.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <math.h>
 #include <signal.h>
@@ -36,65 +37,91 @@
 #include "audio.h"
 #include "filters.h"
 #include "coretest.h"
+#include "bgwrite.h"
+#include "tape.h"
+#include "loader.h"
+#include "snap.h"
+#include "hash.h"
+#include "bench.h"
+#include "emu.h"
+#include "rewind.h"
+#include "sched.h"
+#include "breaks.h"
 
 #define GPL_MSG "spiffy Copyright (C) 2010-13 Edward Cree.\n\
  This program comes with ABSOLUTELY NO WARRANTY; for details see the GPL v3.\n\
  This is free software, and you are welcome to redistribute it\n\
  under certain conditions: GPL v3+\n"
 
-bool zxp_enabled=false; // Emulate a connected ZX Printer?
-machine zx_machine=MACHINE_48;
-unsigned int filt_mask=0; // Which graphics filters to enable (see filters.h)
+#define SPEED_MAX	1000 // highest --speed=N%, short of max
+#define FRAME_NS	20000000LL // a real Spectrum's frame, near enough
+
+static const unsigned int speeds[]={50, 100, 200, 400}; // F11 steps through these, then flat out
+#define nspeeds	(sizeof(speeds)/sizeof(*speeds))
 
 // helper fns
-void scrn_update(SDL_Surface *screen, int Tstates, int frames, int frameskip, int Fstate, ram_t *ram, bus_t *bus, ula_t *ula);
-uint8_t scale38(uint8_t v);
-void getedge(libspectrum_tape *deck, bool *play, bool stopper, bool *ear, uint32_t *T_to_tape_edge, int *edgeflags, int *oldtapeblock, unsigned int *tapeblocklen);
-void putedge(uint32_t *T_since_tape_edge, unsigned long *trecpuls, FILE *trec);
-void loadfile(const char *fn, libspectrum_tape **deck, libspectrum_snap **snap);
-void loadsnap(libspectrum_snap *snap, z80 *cpu, bus_t *bus, ram_t *ram, int *Tstates);
+#ifdef AUDIO
+void arecfinish(audiobuf *abuf);
+#endif /* AUDIO */
 void savesnap(libspectrum_snap **snap, z80 *cpu, bus_t *bus, ram_t *ram, int Tstates);
+bool fork_test(spiffy_machine *m, unsigned long n);
 
 int main(int argc, char * argv[])
 {
-	TTF_Font *font=NULL;
-	if(!TTF_Init())
-	{
-		font=TTF_OpenFont(PREFIX"/share/fonts/Vera.ttf", 12);
-		if(!font) font=TTF_OpenFont("Vera.ttf", 12);
-		if(!font)
-		{
-			fprintf(stderr, "Failed to open font (Vera.ttf)\n");
-			return(1);
-		}
-	}
 	if(libspectrum_init())
 	{
 		fprintf(stderr, "Failed to initialise libspectrum\n");
 		return(1);
 	}
+	machine zx_machine=MACHINE_48;
 	bool debug=false; // Generate debugging info?
 	bool debugcycle=false; // Single-Tstate stepping?
 	bool trace=false; // execution tracing in debugger?
 	bool coretest=false; // run the core tests?
+	bool bench=false; // run the benchmarks?
+	const char *batch=NULL, *batch_out="batch-out", *batch_baseline=NULL; // run a corpus of titles?
+	unsigned long fuzz=0; // fuzz cases to run
+	bool break_test=false; // check the breakpoint bitmaps?
+	unsigned long fork_n=0; // clones to make at the end, to test spiffy_clone()
+	unsigned int rewind_period=0; // frames between rewind captures; 0 to keep no history
+	unsigned int rewind_kb=REWIND_BUDGET;
+	unsigned int runahead=0; // frames to run a clone ahead of the machine, to show instead of where it's got to
+	unsigned long long fuzz_seed=time(NULL);
 	bool pause=false;
-	bool stopper=false; // stop tape at end of this block?
+	unsigned int speed=100; // percentage of a real Spectrum's speed to run at; 0 for flat out
+	unsigned int cpu_clock=1; // CPU clock, in multiples of 3.5MHz
 	bool edgeload=true; // edge loader enabled
-	#ifdef AUDIO
+	bool autotape=true; // start and stop the tape when a loader is detected, and only run flat out while it's sampling
+	bool native_files=true; // read TAP, TZX, SNA and Z80 files ourselves, rather than through libspectrum
 	bool delay=true; // attempt to maintain approximately a true Speccy speed, 50fps at 69888 T-states per frame, which is 3.4944MHz
+	bool jitter=false; // report how well we keep to that, every second
+	#ifdef AUDIO
 	uint16_t filterfactor=52; // this value minimises noise with various beeper engines (dunno why).  Other good values are 38, 76
 	update_sinc(filterfactor);
+	const char *render_fn=NULL; // if set, render audio offline to this WAV file instead of using the sound card
 	#endif /* AUDIO */
-	const char *fn=NULL;
-	ay_enabled=false;
+	unsigned int maxframes=0; // if nonzero, quit after this many frames
+	bool headless=false; // no window, UI, font or sound card; just run the machine
+	int until_pc=-1; // if >=0, quit when an instruction at this address is about to run
+	int until_addr=-1, until_val=0; // if until_addr>=0, quit at the end of a frame when (until_addr) holds until_val
+	const char *dump_screen_fn=NULL, *dump_ram_fn=NULL, *dump_snap_fn=NULL; // written on exit
+	bool dump_hash=false; // print a hash of the machine state on exit
+	bool dump_stats=false; // print frames, T-states and time taken on exit
+	const char *hashlog_fn=NULL; // log the state hash at every frame
+	const char *rzx_fn=NULL; // record our input to an RZX
+	bool hashlog_compare=false; // ... or check it against the log
+	unsigned int nfiles=0;
+	const char **files=NULL; // loaded in order, so a snapshot can be followed by a tape for it to load
+	bool ay_enabled=false;
 	bool ulaplus_enabled=false;
 	bool timex_enabled=false;
+	bool zxp_enabled=false; // Emulate a connected ZX Printer?
 	const char *zxp_fn="zxp.pbm";
 	bool zxp_fix=false; // change the ZXP address from ¬A2 to A6.¬A2?  For compatibility with ZXI devices
+	unsigned int filt_mask=0; // Which graphics filters to enable (see filters.h)
 	js_type keystick=JS_C; // keystick mode: Cursor, Sinclair, Kempston, disabled
 	bool showkb=false; // show a keyboard helper?
-	unsigned int nbreaks=0;
-	unsigned int *breakpoints=NULL;
+	breaks bks;
 	int arg;
 	/* First, look for a machine type, to get defaults */
 	for(arg=1;arg<argc;arg++)
@@ -107,6 +134,7 @@ int main(int argc, char * argv[])
 	}
 	/* Now we apply those defaults */
 	ay_enabled=cap_ay(zx_machine);
+	breaks_init(&bks, zx_machine);
 	/* Then process normal args */
 	for(arg=1;arg<argc;arg++)
 	{
@@ -116,17 +144,12 @@ int main(int argc, char * argv[])
 		}
 		else if(strncmp(argv[arg], "-b=", 3) == 0)
 		{ // activate debugging mode at a breakpoint
-			unsigned int breakpoint;
-			if(sscanf(argv[arg]+3, "%04x", &breakpoint)==1)
+			uint16_t addr;
+			int bank;
+			if(breaks_parse(&bks, argv[arg]+3, &addr, &bank))
 			{
-				unsigned int n=nbreaks++;
-				unsigned int *nbp=realloc(breakpoints, nbreaks*sizeof(unsigned int));
-				if(!nbp)
-				{
-					perror("malloc");
+				if(!breaks_add(&bks, addr, bank, 0))
 					return(1);
-				}
-				(breakpoints=nbp)[n]=breakpoint;
 			}
 			else
 			{
@@ -170,6 +193,14 @@ int main(int argc, char * argv[])
 		{ // enable 8x1 attribute mode
 			timex_enabled=true;
 		}
+		else if(strncmp(argv[arg], "--clock=", 8) == 0)
+		{ // turbo CPU, with the ULA still at 50Hz
+			if((sscanf(argv[arg]+8, "%u", &cpu_clock)!=1)||!cpu_clock||(cpu_clock>8)||(cpu_clock&(cpu_clock-1)))
+			{
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+				cpu_clock=1;
+			}
+		}
 		else if(strcmp(argv[arg], "--kb") == 0)
 		{ // enable keyboard assistant
 			showkb=true;
@@ -186,377 +217,424 @@ int main(int argc, char * argv[])
 		{ // run the core tests
 			coretest=true;
 		}
+		else if(strncmp(argv[arg], "--fuzz=", 7) == 0)
+		{ // differential fuzzing of the core
+			if(sscanf(argv[arg]+7, "%lu,%llx", &fuzz, &fuzz_seed)<1)
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+		}
+		else if(strcmp(argv[arg], "--break-test") == 0)
+		{ // self-test the breakpoint bitmaps
+			break_test=true;
+		}
+		else if(strncmp(argv[arg], "--fork-test=", 12) == 0)
+		{ // clone the machine at exit, and check the clones
+			if(sscanf(argv[arg]+12, "%lu", &fork_n)!=1)
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+		}
+		else if(strcmp(argv[arg], "--rewind") == 0)
+		{ // keep a rewind history
+			rewind_period=REWIND_PERIOD;
+		}
+		else if(strncmp(argv[arg], "--rewind=", 9) == 0)
+		{ // ... capturing every so many frames, in so many kB
+			if(sscanf(argv[arg]+9, "%u,%u", &rewind_period, &rewind_kb)<1)
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+		}
+		else if(strncmp(argv[arg], "--run-ahead=", 12) == 0)
+		{ // cut input lag by showing the future
+			if(sscanf(argv[arg]+12, "%u", &runahead)!=1)
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+		}
+		else if(strcmp(argv[arg], "--bench") == 0)
+		{ // run the benchmarks
+			bench=true;
+		}
+		else if(strncmp(argv[arg], "--batch=", 8) == 0)
+		{ // run a corpus of snapshots and tapes
+			batch=argv[arg]+8;
+		}
+		else if(strncmp(argv[arg], "--batch-out=", 12) == 0)
+		{ // where the batch runner puts its screenshots and results
+			batch_out=argv[arg]+12;
+		}
+		else if(strncmp(argv[arg], "--batch-baseline=", 17) == 0)
+		{ // the batch runner's results from an earlier pass, to compare with
+			batch_baseline=argv[arg]+17;
+		}
+		else if(strcmp(argv[arg], "--autotape") == 0)
+		{ // enable automatic tape start/stop
+			autotape=true;
+		}
+		else if(strcmp(argv[arg], "--no-autotape") == 0)
+		{ // disable automatic tape start/stop
+			autotape=false;
+		}
+		else if(strcmp(argv[arg], "--no-traps") == 0)
+		{ // start with the tape traps and edge-loader off
+			edgeload=false;
+		}
+		else if(strcmp(argv[arg], "--libspectrum") == 0)
+		{ // load all tapes and snapshots through libspectrum
+			native_files=false;
+		}
+		else if(strcmp(argv[arg], "--headless") == 0)
+		{ // run without a window, UI or sound card, flat out
+			headless=true;
+			delay=false;
+		}
+		else if(strcmp(argv[arg], "--jitter") == 0)
+		{ // report frame pacing every second
+			jitter=true;
+		}
+		else if(strncmp(argv[arg], "--speed=", 8) == 0)
+		{ // run faster or slower than a real Spectrum
+			if(strcmp(argv[arg]+8, "max") == 0)
+				speed=0;
+			else if((sscanf(argv[arg]+8, "%u", &speed)!=1)||!speed||(speed>SPEED_MAX))
+			{
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+				speed=100;
+			}
+		}
+		else if(strncmp(argv[arg], "--until-pc=", 11) == 0)
+		{ // stop when PC reaches an address
+			unsigned int addr;
+			if(sscanf(argv[arg]+11, "%04x", &addr)==1)
+				until_pc=addr&0xffff;
+			else
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+		}
+		else if(strncmp(argv[arg], "--until-mem=", 12) == 0)
+		{ // stop when a memory location holds a value
+			unsigned int addr, val;
+			if(sscanf(argv[arg]+12, "%04x=%02x", &addr, &val)==2)
+			{
+				until_addr=addr&0xffff;
+				until_val=val&0xff;
+			}
+			else
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+		}
+		else if(strncmp(argv[arg], "--dump-screen=", 14) == 0)
+		{ // save a screenshot on exit
+			dump_screen_fn=argv[arg]+14;
+		}
+		else if(strncmp(argv[arg], "--dump-ram=", 11) == 0)
+		{ // save the RAM on exit
+			dump_ram_fn=argv[arg]+11;
+		}
+		else if(strncmp(argv[arg], "--dump-snap=", 12) == 0)
+		{ // save an SNA snapshot on exit
+			dump_snap_fn=argv[arg]+12;
+		}
+		else if(strcmp(argv[arg], "--dump-hash") == 0)
+		{ // print the state hash on exit
+			dump_hash=true;
+		}
+		else if(strncmp(argv[arg], "--hash-log=", 11) == 0)
+		{ // write the state hash at every frame to a log
+			hashlog_fn=argv[arg]+11;
+			hashlog_compare=false;
+		}
+		else if(strncmp(argv[arg], "--rzx-record=", 13) == 0)
+		{ // record the machine's input, to replay later
+			rzx_fn=argv[arg]+13;
+		}
+		else if(strncmp(argv[arg], "--hash-compare=", 15) == 0)
+		{ // check the state hash at every frame against a log, and stop at the first difference
+			hashlog_fn=argv[arg]+15;
+			hashlog_compare=true;
+		}
+		else if(strcmp(argv[arg], "--dump-stats") == 0)
+		{ // print how much we ran, and how long it took, on exit
+			dump_stats=true;
+		}
+		else if(strncmp(argv[arg], "--filters=", 10) == 0)
+		{ // start with some graphics filters on
+			if(sscanf(argv[arg]+10, "%x", &filt_mask)!=1)
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+		}
+		else if(strncmp(argv[arg], "--frames=", 9) == 0)
+		{ // stop after a given number of frames
+			if(sscanf(argv[arg]+9, "%u", &maxframes)!=1)
+				fprintf(stderr, "Ignoring bad argument '%s'\n", argv[arg]);
+		}
+		#ifdef AUDIO
+		else if(strncmp(argv[arg], "--render=", 9) == 0)
+		{ // render audio offline to a WAV file
+			render_fn=argv[arg]+9;
+			delay=false;
+		}
+		#endif /* AUDIO */
 		else if(strncmp(argv[arg], "-m", 2)==0)
 		{ // ignore it; we handled -mMachine in the first pass
 		}
 		else
 		{ // unrecognised option, assume it's a filename
-			fn=argv[arg];
+			unsigned int n=nfiles++;
+			const char **nf=realloc(files, nfiles*sizeof(*files));
+			if(!nf)
+			{
+				perror("malloc");
+				return(1);
+			}
+			(files=nf)[n]=argv[arg];
 		}
 	}
 	
 	fprintf(stderr, GPL_MSG);
 	
 	if(coretest)
+		return(coretest_run("tests.in", "tests.expected", "tests.known"));
+	if(fuzz)
+		return(coretest_fuzz(fuzz, fuzz_seed, "fuzz.in"));
+	if(break_test)
+		return(breaks_check()?1:0);
+	
+	if(bench)
+		return(bench_run(argv[0]));
+	if(batch)
+		return(batch_run(argv[0], batch, batch_out, maxframes?maxframes:BATCH_FRAMES, batch_baseline));
+	
+	TTF_Font *font=NULL;
+	if(!headless&&!TTF_Init())
 	{
-		FILE *f;
-		const char *progname = argv[0];
-		const char *testsfile = "tests.in";
-		/* Initialise the tables used by the Z80 core */
-		z80_init();
-
-		f = fopen( testsfile, "r" );
-		if( !f ) {
-			fprintf( stderr, "%s: couldn't open tests file `%s': %s\n", progname,
-				 testsfile, strerror( errno ) );
-			return 1;
-		}
-		while(run_test(f));
-		if( fclose(f) ) {
-			fprintf( stderr, "%s: couldn't close `%s': %s\n", progname, testsfile,
-				 strerror( errno ) );
-			return 1;
-		}
-		return 0;
+		font=TTF_OpenFont(PREFIX"/share/fonts/Vera.ttf", 12);
+		if(!font) font=TTF_OpenFont("Vera.ttf", 12);
+		if(!font)
+		{
+			fprintf(stderr, "Failed to open font (Vera.ttf)\n");
+			return(1);
+		}
 	}
 	
-	// State
-	z80 _cpu, *cpu=&_cpu; // we want to work with a pointer
-	bus_t _bus, *bus=&_bus;
-	ula_t _ula, *ula=&_ula;
-	ram_t _ram, *ram=&_ram;
-	
 	ui_offsets(showkb, zxp_enabled);
-	SDL_Surface * screen=gf_init(320, y_end);
-	if(!screen)
+	SDL_Surface * screen;
+	button *buttons=NULL;
+	if(headless) // an offscreen surface, so the ULA (and printer) can still draw
 	{
-		fprintf(stderr, "Failed to set up video\n");
-		return(2);
+		pause=false;
+		if(!(screen=SDL_CreateRGBSurface(SDL_SWSURFACE, 320, y_end, 32, 0xff0000, 0xff00, 0xff, 0)))
+		{
+			fprintf(stderr, "SDL_CreateRGBSurface: %s\n", SDL_GetError());
+			return(2);
+		}
+	}
+	else
+	{
+		if(!(screen=gf_init(320, y_end)))
+		{
+			fprintf(stderr, "Failed to set up video\n");
+			return(2);
+		}
+		ui_init(screen, &buttons, zx_machine, edgeload, pause, showkb, zxp_enabled);
 	}
-	button *buttons;
-	ui_init(screen, &buttons, edgeload, pause, showkb, zxp_enabled);
 	int errupt=0;
-	bus->portfe=0; // used by mixaudio (for the beeper), tape writing (MIC) and the screen update (for the BORDCR)
-	bus->port7ffd=0; // controls paging
-	bus->kempbyte=0; // used in Kempston keystick mode
-	bool ear=false; // tape reading EAR
 	bool kstate[8][5]; // keyboard state
-	uint8_t kenc[8]; // encoded keyboard state
 	for(int i=0;i<8;i++)
-	{
 		for(int j=0;j<5;j++)
 			kstate[i][j]=false;
-		kenc[i]=0;
-	}
 	if(init_keyboard())
 	{
 		fprintf(stderr, "spiffy: failed to load keymap\n");
 		return(1);
 	}
-	ula->t1=false;
-	ula->memwait=false;
-	ula->iowait=false;
-	if((ula->ulaplus_enabled=ulaplus_enabled))
-	{
-		ula->ulaplus_regsel=0;
-		for(unsigned int reg=0;reg<64;reg++)
-			ula->ulaplus_regs[reg]=0;
-		ula->ulaplus_mode=0;
-	}
-	ula->timex_enabled=timex_enabled;
 #ifdef AUDIO
-	if(SDL_InitSubSystem(SDL_INIT_AUDIO))
-	{
-		fprintf(stderr, "spiffy: failed to initialise audio subsystem:\tSDL_InitSubSystem:%s\n", SDL_GetError());
-		return(3);
-	}
 	uint8_t *sinc_rate=get_sinc_rate();
-	SDL_AudioSpec fmt;
-	fmt.freq = SAMPLE_RATE;
-	fmt.format = AUDIO_S16;
-	fmt.channels = 1;
-	fmt.samples = AUDIOBUFLEN*2;
-	fmt.callback = mixaudio;
-	audiobuf abuf = {.rp=0, .wp=0, .record=NULL, .busy={true, true}};
-	fmt.userdata = &abuf;
-
-	/* Open the audio device */
-	if ( SDL_OpenAudio(&fmt, NULL) < 0 ) {
-		fprintf(stderr, "Unable to open audio: %s\n", SDL_GetError());
-		return(3);
+	audiobuf abuf = {.rp=0, .wp=0, .record=NULL, .busy={true, true}, .lock=NULL, .taken=NULL};
+	unsigned long abits_acc=0; // fractional accumulator for the 'bits' sample clock
+	bool soundcard=false; // is something taking bits from abuf, in real time?
+	double afill=-1, adrift=0; // how full 'bits' is at the end of a frame, smoothed (-ve until we've looked); and how far the sound card's clock seems to be from sch's
+	long abits_trim=0; // added to abits_per, so we make bits as fast as the sound card takes them
+	FILE *arender=NULL;
+	if(render_fn)
+	{
+		if(!(arender=fopen(render_fn, "wb")))
+		{
+			fprintf(stderr, "spiffy: failed to open `%s': %s\n", render_fn, strerror(errno));
+			return(3);
+		}
+		wavheader(arender);
 	}
-#endif /* AUDIO */
-	
-	// ZX Printer state
-	unsigned int zxp_stylus_posn=0; // ranges from 0 to 384, with the paper starting at 128
-	bool zxp_slow_motor=false; // d1
-	bool zxp_stop_motor=true; // d2
-	bool zxp_stylus_power=false; // d7
-	bool zxp_d0_latch=false; // encoder disc
-	bool zxp_d7_latch=false; // stylus hits left of paper
-	bool zxp_feed_button=false; // is the feed button being held?
-	int zxp_height_offset; // offset of height field in zxp_output pbm file
-	unsigned int zxp_rows=0;
-	FILE *zxp_output=NULL;
-	if(zxp_enabled)
+	else if(!headless)
 	{
-		zxp_output=fopen(zxp_fn, "wb");
-		if(!zxp_output)
+		if(SDL_InitSubSystem(SDL_INIT_AUDIO))
 		{
-			fprintf(stderr, "Failed to open `%s'; ZX printer output will not be saved!\n", zxp_fn);
-			perror("\tfopen");
+			fprintf(stderr, "spiffy: failed to initialise audio subsystem:\tSDL_InitSubSystem:%s\n", SDL_GetError());
+			return(3);
 		}
-		else
-			zxp_height_offset=pbm_putheader(zxp_output, 256, 0);
+		SDL_AudioSpec fmt;
+		fmt.freq = SAMPLE_RATE;
+		fmt.format = AUDIO_S16;
+		fmt.channels = 1;
+		fmt.samples = AUDIOBUFLEN*2;
+		fmt.callback = mixaudio;
+		fmt.userdata = &abuf;
+
+		/* Open the audio device */
+		if ( SDL_OpenAudio(&fmt, NULL) < 0 ) {
+			fprintf(stderr, "Unable to open audio: %s\n", SDL_GetError());
+			return(3);
+		}
+		if(!(abuf.lock=SDL_CreateMutex())||!(abuf.taken=SDL_CreateCond()))
+		{
+			fprintf(stderr, "spiffy: failed to set up audio:\t%s\n", SDL_GetError());
+			return(3);
+		}
+		soundcard=true;
 	}
+#endif /* AUDIO */
 	
 	// Timing
-	struct timeval frametime[100];
-	gettimeofday(frametime, NULL);
+	int64_t frametime[100]; // ns, by sched_now()
+	frametime[0]=sched_now();
 	for(int i=1;i<100;i++) frametime[i]=frametime[0];
+	sched sch;
+	sched_init(&sch, FRAME_NS);
 	
 	// Mouse handling
 	pos mouse;
-	SDL_GetMouseState(&mouse.x, &mouse.y);
+	if(!headless)
+		SDL_GetMouseState(&mouse.x, &mouse.y);
 	//SDL_ShowCursor(SDL_DISABLE);
 	char button;
 	unsigned int hover=nbuttons;
 	
 	// Spectrum State
-	const char *rom_file=default_rom(zx_machine);
-	FILE *fp = configopen(rom_file, "rb");
-	if(!fp)
-	{
-		fprintf(stderr, "Failed to open Spectrum ROM `%s'!\n", rom_file);
+	uint8_t *rom=spiffy_load_rom(zx_machine, NULL);
+	if(!rom)
 		return(1);
-	}
-	if(ram_init(ram, fp, zx_machine))
-	{
-		fprintf(stderr, "Failed to set up RAM\n");
+	spiffy_machine *m=spiffy_new(zx_machine, rom, screen);
+	if(!m)
 		return(1);
+	z80 *cpu=&m->cpu; // we want to work with pointers
+	bus_t *bus=&m->bus;
+	ula_t *ula=&m->ula;
+	ram_t *ram=&m->ram;
+	m->y_prnt=y_prnt;
+	m->filt_mask=filt_mask;
+	m->edgeload=edgeload;
+	m->autotape=autotape;
+	m->clock=cpu_clock;
+	m->kempston=(keystick==JS_K);
+	breaks_sync(&bks, ram);
+	m->breaks=&bks;
+	if((ula->ulaplus_enabled=ulaplus_enabled))
+	{
+		ula->ulaplus_regsel=0;
+		for(unsigned int reg=0;reg<64;reg++)
+			ula->ulaplus_regs[reg]=0;
+		ula->ulaplus_mode=0;
 	}
-	fclose(fp);
-	
-	z80_init(); // initialise decoding tables
-	int Fstate=0; // FLASH state
-	z80_reset(cpu, bus);
-	bus_reset(bus);
-	ay_init(&ay);
-	#ifdef AUDIO
-	if(ay_enabled)
+	ula->timex_enabled=timex_enabled;
+	if((m->ay_enabled=ay_enabled))
 	{
+		#ifdef AUDIO
 		*sinc_rate=2;
 		filterfactor=128;
 		update_sinc(filterfactor);
+		#endif /* AUDIO */
 	}
-	#endif /* AUDIO */
+	if(zxp_enabled)
+		spiffy_printer(m, zxp_fn, zxp_fix);
 	
-	libspectrum_tape *deck=NULL;
-	bool play=false;
-	int oldtapeblock=-1;
-	unsigned int tapeblocklen=0;
 	libspectrum_snap *snap=NULL;
-	FILE *trec=NULL;
-	unsigned long trecpuls=0;
-	uint32_t T_since_tape_edge=0;
-	bool oldmic=false;
 	unsigned int keyb_mode=0;
 	
-	SDL_Flip(screen);
+	if(!headless)
+		SDL_Flip(screen);
 #ifdef AUDIO
 	// Start sound
-	SDL_PauseAudio(0);
+	SDL_PauseAudio(pause);
 #endif /* AUDIO */
 	
 	int frames=0;
-	int Tstates=0;
-	int T_per_frame=frame_length(zx_machine);
+	int T_per_frame=m->T_per_frame;
 	bool debug_screen=false; // should we update the screen when single-stepping?
-	uint32_t T_to_tape_edge=0;
-	int edgeflags=0;
 	
-	if(fn)
+	for(unsigned int f=0;f<nfiles;f++)
 	{
-		loadfile(fn, &deck, &snap);
-		if(snap)
-		{
-			loadsnap(snap, cpu, bus, ram, &Tstates);
-			fprintf(stderr, "Loaded snap '%s'\n", fn);
-			libspectrum_snap_free(snap);
-			snap=NULL;
-		}
+		if(spiffy_load(m, files[f], native_files))
+			fprintf(stderr, "Loaded snap '%s'\n", files[f]);
 	}
+	free(files);
+	#ifdef AUDIO
+	if(arender&&m->deck) // nobody to press Play for us
+		m->play=true;
+	#endif /* AUDIO */
+	
+	if(rzx_fn&&!spiffy_rzx_record(m, rzx_fn))
+		return(1);
+	
+	rewind_buf *rw=NULL;
+	if(rewind_period&&!(rw=rewind_new(m, rewind_period, rewind_kb*1024ULL)))
+		return(1);
+	
+	hashlog *hlog=NULL;
+	if(hashlog_fn&&!(hlog=hashlog_open(hashlog_fn, hashlog_compare)))
+		return(1);
+	
+	int Tstart=m->Tstates;
+	struct timeval runstart;
+	gettimeofday(&runstart, NULL);
 	
 	// Main program loop
 	while(likely(!errupt))
 	{
-		if(unlikely(nbreaks))
+		if(unlikely(bks.live)&&!debug&&(cpu->M==0)&&(cpu->dT==0)&&(cpu->shiftstate==0)&&breaks_test(&bks, ram, *PC))
 		{
-			for(unsigned int bp=0;bp<nbreaks;bp++)
-			{
-				if((!debug)&&(*PC==breakpoints[bp])&&(cpu->M==0)&&(cpu->dT==0)&&(cpu->shiftstate==0))
-				{
-					debug=true;
-				}
-			}
+			debug=true;
+			breaks_hit(&bks, ram, *PC);
+		}
+		if(unlikely(until_pc>=0)&&(*PC==until_pc)&&(cpu->M==0)&&(cpu->dT==0)&&(cpu->shiftstate==0))
+		{
+			fprintf(stderr, "Reached PC=%04x at frame %d\n", until_pc, frames);
+			break;
 		}
-		Tstates++;
+		bool turbo=(m->play&&(m->loading||!m->autotape))||!speed; // run unthrottled, frameskipped and muted
 		#ifdef AUDIO
-		if(!(Tstates%(T_per_frame*50/(SAMPLE_RATE**sinc_rate))))
+		m->frameskip=headless?(dump_screen_fn?0:~0):arender?~0:turbo?7:0; // when rendering or headless, don't bother drawing (unless we want a screenshot)
+		unsigned long abits_per=(unsigned long)T_per_frame*((arender||turbo)?100:speed)/2+((arender||turbo)?0:abits_trim); // T-states per 'bits' sample, times SAMPLE_RATE*sinc_rate; off 100%, the pitch follows
+		if(!pause&&!m->clock_sub&&(arender||!headless)&&((abits_acc+=SAMPLE_RATE**sinc_rate)>=abits_per)) // once per ULA T-state; headless, nobody's listening
 		{
-			abuf.play=play||trec;
+			abits_acc-=abits_per;
+			abuf.play=turbo||m->trec;
 			unsigned int newwp=(abuf.wp+1)%AUDIOBITLEN;
-			if(delay&&!(play||trec))
+			if(delay&&!(turbo||m->trec)&&(newwp==abuf.rp)) // full; abits_trim should stop this happening, but if it does, wait for mixaudio to take some
 			{
-				unsigned int waits=0;
+				SDL_LockMutex(abuf.lock);
 				while(newwp==abuf.rp)
-				{
-					if(waits++>AUDIO_MAXWAITS)
+					if(SDL_CondWaitTimeout(abuf.taken, abuf.lock, AUDIO_OVERRUN_MS)==SDL_MUTEX_TIMEDOUT)
 					{
-						fprintf(stderr, "Audio overrun!  waits %u\n", waits);
+						fprintf(stderr, "Audio overrun!  waited %ums\n", AUDIO_OVERRUN_MS);
 						break;
 					}
-					usleep(AUDIO_WAIT);
-				}
+				SDL_UnlockMutex(abuf.lock);
 			}
 			abuf.bits[abuf.wp]=(bus->portfe&PORTFE_SPEAKER)?0x80:0;
-			if(ear) abuf.bits[abuf.wp]^=0x40;
+			if(m->ear) abuf.bits[abuf.wp]^=0x40;
 			if((bus->portfe&PORTFE_MIC)&&(bus->portfe&PORTFE_SPEAKER)) abuf.bits[abuf.wp]^=0x08;
-			if(ay_enabled)
+			if(m->ay_enabled)
 			{
-				abuf.bits[abuf.wp]+=(ay.out[0]+ay.out[1]+ay.out[2])/8;
+				abuf.bits[abuf.wp]+=(m->ay.out[0]+m->ay.out[1]+m->ay.out[2])/8;
 			}
+			if(turbo&&!arender)
+				abuf.bits[abuf.wp]=0;
 			abuf.wp=newwp;
+			if(arender)
+				mixaudio_offline(&abuf, arender);
 		}
+		#else /* !AUDIO */
+		m->frameskip=headless?(dump_screen_fn?0:~0):turbo?7:0;
 		#endif /* AUDIO */
-		if(play&&!pause)
-		{
-			if(unlikely(!deck))
-				play=false;
-			else if(T_to_tape_edge)
-				T_to_tape_edge--;
-			else
-			{
-				getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-			}
-		}
-		if(bus->mreq)
-			do_ram(ram, bus);
-		
-		if(unlikely(trec&&!pause))
-			T_since_tape_edge++;
-		
-		if(unlikely(bus->iorq&&(bus->tris==TRIS_OUT)))
-		{
-			if(!(bus->addr&0x01)) // ULA
-			{
-				bus->portfe=bus->data;
-				if(trec&&((bus->portfe&PORTFE_MIC)?!oldmic:oldmic))
-				{
-					putedge(&T_since_tape_edge, &trecpuls, trec);
-					oldmic=bus->portfe&PORTFE_MIC;
-				}
-			}
-			else if(cap_128_paging(zx_machine)&&!(bus->addr&0x8002)) // 128 Paging
-			{
-				if(!(bus->port7ffd&0x20))
-				{
-					bus->port7ffd=bus->data;
-					ram->paged[0]=(bus->port7ffd&0x10)?1:0;
-					ram->paged[3]=(bus->port7ffd&0x7)+2;
-				}
-			}
-			else if(zxp_enabled&&!(bus->addr&0x04)&&((!zxp_fix)||(bus->addr&0x40))) // ZX Printer
-			{
-				zxp_d0_latch=false;
-				zxp_d7_latch=false;
-				zxp_slow_motor=bus->data&0x02;
-				zxp_stop_motor=bus->data&0x04;
-				zxp_stylus_power=bus->data&0x80;
-			}
-			else if(ay_enabled&&((bus->addr&0x8002)==0x8000))
-			{
-				if(bus->addr&0x4000)
-					ay.regsel=bus->data;
-				else if(ay.regsel<16)
-				{
-					ay.reg[ay.regsel]=bus->data;
-					if(ay.regsel==13)
-					{
-						ay.envcount=0;
-						ay.envstop=false;
-						ay.envrev=false;
-						if(bus->data&0x04) ay.env=0;
-						else ay.env=15;
-					}
-				}
-			}
-			else if(ula->ulaplus_enabled&&(bus->addr==0xbf3b))
-			{
-				ula->ulaplus_regsel=bus->data;
-			}
-			else if(ula->ulaplus_enabled&&(bus->addr==0xff3b))
-			{
-				if(!(ula->ulaplus_regsel&0xC0))
-				{
-					ula->ulaplus_regs[ula->ulaplus_regsel]=bus->data;
-				}
-				else if(ula->ulaplus_regsel==0x40)
-				{
-					ula->ulaplus_mode=bus->data;
-				}
-			}
-		}
-		
-		if(unlikely(bus->iorq&&(bus->tris==TRIS_IN)))
-		{
-			if(!(bus->addr&0x01)) // ULA
-			{
-				uint8_t hi=bus->addr>>8;
-				bus->data=(ear?0x40:0)|0x1f;
-				for(int i=0;i<8;i++)
-					if(!(hi&(1<<i)))
-						bus->data&=~kenc[i];
-			}
-			else if(zxp_enabled&&!(bus->addr&0x04)&&((!zxp_fix)||(bus->addr&0x40))) // ZX Printer
-			{
-				bus->data=0x3e;
-				if(zxp_d0_latch) bus->data|=0x01;
-				if(zxp_d7_latch) bus->data|=0x80;
-			}
-			else if((keystick==JS_K)&&((bus->addr&0xFF)==0x1F)) // Kempston joystick
-			{
-				bus->data=bus->kempbyte;
-			}
-			else if(ay_enabled&&((bus->addr&0x8002)==0x8000))
-			{
-				if(bus->addr&0x4000)
-				{
-					bus->data=ay.reg[ay.regsel];
-				}
-			}
-			else if(ula->ulaplus_enabled&&(bus->addr==0xff3b))
-			{
-				if(!(ula->ulaplus_regsel&0xC0))
-				{
-					bus->data=ula->ulaplus_regs[ula->ulaplus_regsel];
-				}
-				else if(ula->ulaplus_regsel==0x40)
-				{
-					bus->data=ula->ulaplus_mode;
-				}
-			}
-			else
-				bus->data=0xff; // technically this is wrong, TODO floating bus
-		}
 		
 		if(unlikely(debug&&(((cpu->M==0)&&(cpu->dT==0)&&(cpu->shiftstate==0))||debugcycle)))
 		{
 			SDL_PauseAudio(1);
-			debugctx ctx={.Tstates=Tstates, .cpu=cpu, .bus=bus, .ram=ram, .ula=ula, .ay=&ay};
+			debugctx ctx={.Tstates=m->Tstates, .cpu=cpu, .bus=bus, .ram=ram, .ula=ula, .ay=m->ay_enabled?&m->ay:NULL};
 			if(trace)
 				show_state(ctx);
-			if(debug_screen)
+			if(debug_screen&&!headless)
 				SDL_Flip(screen);
 			int derrupt=0;
 			static unsigned int blanks=0;
@@ -567,9 +645,12 @@ int main(int argc, char * argv[])
 					fprintf(stderr, "EOF on stdin, closing debugger\n");
 					nodebug:
 					debug=false;
-					bugbutton.col=0x4f4f4f;
-					bugbutton.tooltip="Debugger is unavailable";
-					drawbutton(screen, bugbutton);
+					if(!headless)
+					{
+						bugbutton.col=0x4f4f4f;
+						bugbutton.tooltip="Debugger is unavailable";
+						drawbutton(screen, bugbutton);
+					}
 					break;
 				}
 				fprintf(stderr, ">");
@@ -626,6 +707,8 @@ int main(int argc, char * argv[])
 							else
 								fprintf(stderr, h_cmds);
 						}
+						else if(headless&&(!strcmp(cmd, "w")||!strcmp(cmd, "@")||!strcmp(cmd, "screen")))
+							fprintf(stderr, "screen: there is no screen when headless\n");
 						else if(strcmp(cmd, "w")==0) // short for 'screen show'
 							SDL_Flip(screen);
 						else if(strcmp(cmd, "@")==0) // short for 'screen raster'
@@ -651,13 +734,13 @@ int main(int argc, char * argv[])
 								int line,col;
 								if(t128)
 								{
-									line=((Tstates)/228)-15;
-									col=(((Tstates)%228)<<1);
+									line=((m->Tstates)/228)-15;
+									col=(((m->Tstates)%228)<<1);
 								}
 								else
 								{
-									line=((Tstates+12)/224)-16;
-									col=(((Tstates+12)%224)<<1);
+									line=((m->Tstates+12)/224)-16;
+									col=(((m->Tstates+12)%224)<<1);
 								}
 								fprintf(stderr, "raster: %d,%d\n", line, col);
 								if(likely((line>=0) && (line<296)))
@@ -702,60 +785,69 @@ int main(int argc, char * argv[])
 								debugval_display(stderr, val);
 							}
 						}
-						else if((strcmp(cmd, "b")==0)||(strcmp(cmd, "break")==0))
+						else if((strcmp(cmd, "b")==0)||(strcmp(cmd, "break")==0)||(strcmp(cmd, "b1")==0)||(strcmp(cmd, "tb")==0))
 						{
-							const char *rest=drgv[1];
-							unsigned int bp=0;
-							if(rest&&(sscanf(rest, "%x", &bp)==1))
-							{
-								unsigned int n=nbreaks++;
-								unsigned int *nbp=realloc(breakpoints, nbreaks*sizeof(unsigned int));
-								if(!nbp)
-								{
-									perror("malloc");
-								}
-								else
-								{
-									(breakpoints=nbp)[n]=bp;
-									fprintf(stderr, "breakpoint at %04x\n", bp);
-								}
-							}
-							else
+							unsigned int flags=(cmd[0]=='t')?BREAK_TEMP:(cmd[1]=='1')?BREAK_ONCE:0;
+							uint16_t addr;
+							int bank;
+							if(!drgv[1])
+								fprintf(stderr, "%s: missing argument\n", cmd);
+							else if(!breaks_parse(&bks, drgv[1], &addr, &bank))
+								fprintf(stderr, "%s: bad address '%s'\n", cmd, drgv[1]);
+							else if(breaks_add(&bks, addr, bank, flags))
 							{
-								fprintf(stderr, "break: missing argument\n");
+								fprintf(stderr, "breakpoint at ");
+								breaks_show(stderr, &bks, bks.list+bks.n-1);
+								fprintf(stderr, "\n");
 							}
 						}
-						else if((strcmp(cmd, "!b")==0)||(strcmp(cmd, "!break")==0))
+						else if((strcmp(cmd, "!b")==0)||(strcmp(cmd, "!break")==0)||(strcmp(cmd, "en")==0)||(strcmp(cmd, "enable")==0)||(strcmp(cmd, "dis")==0)||(strcmp(cmd, "disable")==0))
 						{
-							const char *rest=drgv[1];
-							unsigned int bp=0;
-							if(rest&&(sscanf(rest, "%x", &bp)==1))
+							char what=cmd[0]; // '!'=delete, 'e'=enable, 'd'=disable; those at the address given, or all of them
+							uint16_t addr=0;
+							int bank=-1;
+							if(drgv[1]&&!breaks_parse(&bks, drgv[1], &addr, &bank))
+								fprintf(stderr, "%s: bad address '%s'\n", cmd, drgv[1]);
+							else
 							{
-								for(unsigned int i=0;i<nbreaks;i++)
+								bool found=false;
+								for(unsigned int i=0;i<bks.n;)
 								{
-									while(breakpoints[i]==bp)
+									breakpoint *bp=bks.list+i;
+									if(drgv[1]&&!breaks_match(bp, addr, bank))
+									{
+										i++;
+										continue;
+									}
+									found=true;
+									if(what=='!')
 									{
-										fprintf(stderr, "deleted breakpoint at %04x\n", breakpoints[i]);
-										if(i<--nbreaks)
-											breakpoints[i]=breakpoints[i+1];
-										else break;
+										fprintf(stderr, "deleted breakpoint at ");
+										breaks_show(stderr, &bks, bp);
+										fprintf(stderr, "\n");
+										breaks_del(&bks, i);
+										continue;
 									}
+									if(what=='e')
+										bp->flags&=~BREAK_DISABLED;
+									else
+										bp->flags|=BREAK_DISABLED;
+									fprintf(stderr, "breakpoint at ");
+									breaks_show(stderr, &bks, bp);
+									fprintf(stderr, "\n");
+									i++;
 								}
-							}
-							else
-							{
-								for(unsigned int i=0;i<nbreaks;i++)
-									fprintf(stderr, "deleted breakpoint at %04x\n", breakpoints[i]);
-								free(breakpoints);
-								breakpoints=NULL;
-								nbreaks=0;
+								if(!found)
+									fprintf(stderr, "%s: no such breakpoint\n", cmd);
 							}
 						}
 						else if((strcmp(cmd, "l")==0)||(strcmp(cmd, "list")==0))
 						{
-							for(unsigned int i=0;i<nbreaks;i++)
+							for(unsigned int i=0;i<bks.n;i++)
 							{
-								fprintf(stderr, "breakpoint at %04x\n", breakpoints[i]);
+								fprintf(stderr, "breakpoint at ");
+								breaks_show(stderr, &bks, bks.list+i);
+								fprintf(stderr, "\n");
 							}
 						}
 						else if(strcmp(cmd, "ei")==0)
@@ -1185,24 +1277,24 @@ int main(int argc, char * argv[])
 						}
 						else if((strcmp(cmd, "a")==0)||(strcmp(cmd, "aystate")==0))
 						{
-							if(ay_enabled)
+							if(m->ay_enabled)
 							{
 								if(drgv[1]&&((strcmp(drgv[1], "r")==0)||(strcmp(drgv[1], "reset")==0)))
-									ay_init(&ay);
+									ay_init(&m->ay);
 								else
 								{
 									fprintf(stderr, "Regs: AF AC BF BC CF CC NO MI AV BV CV EF EC ES IA IB\n     ");
 									for(unsigned int i=0;i<16;i++)
-										fprintf(stderr, " %02x", ay.reg[i]);
+										fprintf(stderr, " %02x", m->ay.reg[i]);
 									fprintf(stderr, "\n\n");
-									fprintf(stderr, "regsel: %u\t\tnoise: %u\n", ay.regsel, ay.noise);
-									fprintf(stderr, "env: %u\t\tenvcount: %u\n", ay.env, ay.envcount);
-									fprintf(stderr, "envstop: %s\t\tenvrev: %s\n", ay.envstop?"true ":"false", ay.envrev?"true":"false");
+									fprintf(stderr, "regsel: %u\t\tnoise: %u\n", m->ay.regsel, m->ay.noise);
+									fprintf(stderr, "env: %u\t\tenvcount: %u\n", m->ay.env, m->ay.envcount);
+									fprintf(stderr, "envstop: %s\t\tenvrev: %s\n", m->ay.envstop?"true ":"false", m->ay.envrev?"true":"false");
 									fprintf(stderr, "chans     A      B      C\n");
-									fprintf(stderr, "tone:     %c      %c      %c\n", ay.bit[0]?'1':'0', ay.bit[1]?'1':'0', ay.bit[2]?'1':'0');
-									fprintf(stderr, "noise:    %c      %c      %c\n", (ay.reg[7]&8)?'1':'0', (ay.reg[7]&0x10)?'1':'0', (ay.reg[7]&0x20)?'1':'0');
-									fprintf(stderr, "count: %06u %06u %06u\n", ay.count[0], ay.count[1], ay.count[2]);
-									fprintf(stderr, "out:    %04u   %04u   %04u\n", ay.out[0], ay.out[1], ay.out[2]);
+									fprintf(stderr, "tone:     %c      %c      %c\n", m->ay.bit[0]?'1':'0', m->ay.bit[1]?'1':'0', m->ay.bit[2]?'1':'0');
+									fprintf(stderr, "noise:    %c      %c      %c\n", (m->ay.reg[7]&8)?'1':'0', (m->ay.reg[7]&0x10)?'1':'0', (m->ay.reg[7]&0x20)?'1':'0');
+									fprintf(stderr, "count: %06u %06u %06u\n", m->ay.count[0], m->ay.count[1], m->ay.count[2]);
+									fprintf(stderr, "out:    %04u   %04u   %04u\n", m->ay.out[0], m->ay.out[1], m->ay.out[2]);
 								}
 							}
 							else
@@ -1278,460 +1370,70 @@ int main(int argc, char * argv[])
 							else
 								fprintf(stderr, "ULAplus not enabled!\n");
 						}
-						else if((strcmp(cmd, "q")==0)||(strcmp(cmd, "quit")==0))
-						{
-							errupt++;
-							derrupt++;
-						}
-						else
-						{
-							fprintf(stderr, "Unrecognised command '%s'.  Type 'h' for help\n", cmd);
-						}
-					}
-				}
-				free(line);
-			}
-			SDL_PauseAudio(0);
-		}
-		
-		if(likely(!pause))
-		{
-			errupt=z80_tstep(cpu, bus, errupt);
-			if(unlikely(play&&(*PC==0x05e7)&&(edgeload))) // Magic edge-loader (hard-coded implementation of LD-EDGE-1)
-			{
-				unsigned int wait=358;
-				while((T_to_tape_edge<wait)&&play)
-				{
-					Tstates+=T_to_tape_edge;
-					wait-=T_to_tape_edge;
-					getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-				}
-				if(play)
-				{
-					T_to_tape_edge-=wait;
-					Tstates+=wait;
-				}
-				while(1)
-				{
-					cpu->regs[5]++;
-					wait=4;
-					while((T_to_tape_edge<wait)&&play)
-					{
-						Tstates+=T_to_tape_edge;
-						wait-=T_to_tape_edge;
-						getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-					}
-					if(play)
-					{
-						T_to_tape_edge-=wait;
-						Tstates+=wait;
-					}
-					cpu->regs[2]&=~FC;
-					if(!cpu->regs[5])
-					{
-						cpu->regs[2]|=FZ;
-						wait=11;
-						while((T_to_tape_edge<wait)&&play)
-						{
-							Tstates+=T_to_tape_edge;
-							wait-=T_to_tape_edge;
-							getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-						}
-						if(play)
-						{
-							T_to_tape_edge-=wait;
-							Tstates+=wait;
-						}
-						*PC=ram_read(ram, (*SP)++);
-						*PC|=ram_read(ram, (*SP)++)<<8;
-						break;
-					}
-					else
-					{
-						cpu->regs[2]&=~FZ;
-						wait=22; // 5 + 7 + 10
-						while((T_to_tape_edge<wait)&&play)
-						{
-							Tstates+=T_to_tape_edge;
-							wait-=T_to_tape_edge;
-							getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-						}
-						if(play)
-						{
-							T_to_tape_edge-=wait;
-							Tstates+=wait;
-						}
-						uint8_t hi=0x7f;
-						uint8_t data=(ear?0x40:0)|0x1f;
-						for(int i=0;i<8;i++)
-							if(!(hi&(1<<i)))
-								data&=~kenc[i];
-						cpu->regs[3]=(data>>1)|((cpu->regs[2]&FC)?0x80:0);
-						cpu->regs[2]&=~FC;
-						if(data&1) cpu->regs[2]|=FC;
-						wait=10; // 1 + 4 + 5
-						while((T_to_tape_edge<wait)&&play)
-						{
-							Tstates+=T_to_tape_edge;
-							wait-=T_to_tape_edge;
-							getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-						}
-						if(play)
-						{
-							T_to_tape_edge-=wait;
-							Tstates+=wait;
-						}	
-						if(!(cpu->regs[2]&FC))
-						{
-							wait=6;
-							while((T_to_tape_edge<wait)&&play)
-							{
-								Tstates+=T_to_tape_edge;
-								wait-=T_to_tape_edge;
-								getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-							}
-							if(play)
-							{
-								T_to_tape_edge-=wait;
-								Tstates+=wait;
-							}
-							*PC=ram_read(ram, (*SP)++);
-							*PC|=ram_read(ram, (*SP)++)<<8;
-							break;
-						}
-						else
+						else if(strcmp(cmd, "tape")==0)
 						{
-							cpu->regs[3]^=cpu->regs[4];
-							cpu->regs[3]&=0x20;
-							cpu->regs[2]&=~FZ;
-							wait=18; // 4 + 7 + 7
-							while((T_to_tape_edge<wait)&&play)
+							const char *what=drgv[1], *rest=drgv[2];
+							double secs;
+							unsigned int b;
+							if(!m->deck)
+								fprintf(stderr, "No tape loaded!\n");
+							else if(!what)
 							{
-								Tstates+=T_to_tape_edge;
-								wait-=T_to_tape_edge;
-								getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-							}
-							if(play)
-							{
-								T_to_tape_edge-=wait;
-								Tstates+=wait;
-							}
-							if(!cpu->regs[3])
-							{
-								wait=5;
-								while((T_to_tape_edge<wait)&&play)
+								tape_wait(m->deck);
+								unsigned int cur=tape_position(m->deck);
+								for(unsigned int i=0;i<m->deck->nblocks;i++)
 								{
-									Tstates+=T_to_tape_edge;
-									wait-=T_to_tape_edge;
-									getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
+									const tape_block *tb=m->deck->blocks+i;
+									fprintf(stderr, "%c%3u %8.2fs %8.2fs %s\n", i==cur?'>':' ', i, tb->start/(T_per_frame*50.0), tb->length/(T_per_frame*50.0), tb->name);
 								}
-								if(play)
-								{
-									T_to_tape_edge-=wait;
-									Tstates+=wait;
-								}
-								continue;
-							}
-							cpu->regs[3]=cpu->regs[4];
-							cpu->regs[3]^=0xFF;
-							cpu->regs[4]=cpu->regs[3];
-							cpu->regs[3]&=7;
-							cpu->regs[3]|=8;
-							wait=36; // 4+4+4+7+7+10
-							while((T_to_tape_edge<wait)&&play)
-							{
-								Tstates+=T_to_tape_edge;
-								wait-=T_to_tape_edge;
-								getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
-							}
-							if(play)
-							{
-								T_to_tape_edge-=wait;
-								Tstates+=wait;
+								if(m->accel)
+									fprintf(stderr, "Edge-sampler: %s at %04x\n", m->accel->name, m->accel_head);
 							}
-							bus->portfe=cpu->regs[3];
-							cpu->regs[2]|=FC;
-							*PC=ram_read(ram, (*SP)++);
-							*PC|=ram_read(ram, (*SP)++)<<8;
-							wait=15; // 1+4+10
-							while((T_to_tape_edge<wait)&&play)
+							else if((strcmp(what, "b")==0)&&rest&&(sscanf(rest, "%u", &b)==1))
 							{
-								Tstates+=T_to_tape_edge;
-								wait-=T_to_tape_edge;
-								getedge(deck, &play, stopper, &ear, &T_to_tape_edge, &edgeflags, &oldtapeblock, &tapeblocklen);
+								tape_seek_block(m->deck, b);
+								m->T_to_tape_edge=0;
+								m->edgeflags=LIBSPECTRUM_TAPE_FLAGS_NO_EDGE;
 							}
-							if(play)
+							else if((strcmp(what, "t")==0)&&rest&&(sscanf(rest, "%lf", &secs)==1)&&(secs>=0))
 							{
-								T_to_tape_edge-=wait;
-								Tstates+=wait;
+								tape_seek_time(m->deck, secs*T_per_frame*50);
+								m->T_to_tape_edge=0;
+								m->edgeflags=LIBSPECTRUM_TAPE_FLAGS_NO_EDGE;
 							}
-							break;
+							else
+								fprintf(stderr, "usage: tape [b <block>|t <seconds>]\n");
+						}
+						else if((strcmp(cmd, "q")==0)||(strcmp(cmd, "quit")==0))
+						{
+							errupt++;
+							derrupt++;
+						}
+						else
+						{
+							fprintf(stderr, "Unrecognised command '%s'.  Type 'h' for help\n", cmd);
 						}
 					}
 				}
+				free(line);
 			}
-			else if(trec&&edgeload)
-			{
-				if(unlikely(*PC==0x04d8)) // Magic edge-saver part 1 (hard-coded implementation of SA-LEADER)
-				{
-					sa_leader:
-					// DJNZ SA-LEADER
-					while(1)
-					{
-						BREG--;
-						T_since_tape_edge+=8;
-						Tstates+=8;
-						if(!BREG) break;
-						T_since_tape_edge+=5;
-						Tstates+=5;
-					}
-					// OUT FE,A
-					bus->portfe=AREG;
-					T_since_tape_edge+=10;
-					Tstates+=10;
-					if((bus->portfe&PORTFE_MIC)?!oldmic:oldmic)
-					{
-						putedge(&T_since_tape_edge, &trecpuls, trec);
-						oldmic=bus->portfe&PORTFE_MIC;
-					}
-					T_since_tape_edge++;
-					Tstates++;
-					// XOR 0F
-					cpu->ods.y=5;
-					op_alu(cpu, 0x0F);
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					// LD B,A4
-					BREG=0xA4;
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					// DEC L
-					LREG=op_dec8(cpu, LREG);
-					T_since_tape_edge+=4;
-					Tstates+=4;
-					// JR NZ,SA-LEADER
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					if(!(FREG&FZ))
-					{
-						T_since_tape_edge+=5;
-						Tstates+=5;
-						goto sa_leader;
-					}
-					// DEC B
-					BREG=op_dec8(cpu, BREG);
-					T_since_tape_edge+=4;
-					Tstates+=4;
-					// DEC H
-					HREG=op_dec8(cpu, HREG);
-					T_since_tape_edge+=4;
-					Tstates+=4;
-					// JP P,SA-LEADER
-					T_since_tape_edge+=10;
-					Tstates+=10;
-					if(!(FREG&FS)) goto sa_leader;
-					// LD B,2F
-					BREG=0x2F;
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					// DJNZ SA-SYNC-1
-					while(1)
-					{
-						BREG--;
-						T_since_tape_edge+=8;
-						Tstates+=8;
-						if(!BREG) break;
-						T_since_tape_edge+=5;
-						Tstates+=5;
-					}
-					// OUT FE,A
-					bus->portfe=AREG;
-					T_since_tape_edge+=10;
-					Tstates+=10;
-					if((bus->portfe&PORTFE_MIC)?!oldmic:oldmic)
-					{
-						putedge(&T_since_tape_edge, &trecpuls, trec);
-						oldmic=bus->portfe&PORTFE_MIC;
-					}
-					T_since_tape_edge++;
-					Tstates++;
-					// LD A,0D
-					AREG=0x0D;
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					// LD B,37
-					BREG=0x37;
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					// DJNZ SA-SYNC-2
-					while(1)
-					{
-						BREG--;
-						T_since_tape_edge+=8;
-						Tstates+=8;
-						if(!BREG) break;
-						T_since_tape_edge+=5;
-						Tstates+=5;
-					}
-					// OUT FE,A
-					bus->portfe=AREG;
-					T_since_tape_edge+=10;
-					Tstates+=10;
-					if((bus->portfe&PORTFE_MIC)?!oldmic:oldmic)
-					{
-						putedge(&T_since_tape_edge, &trecpuls, trec);
-						oldmic=bus->portfe&PORTFE_MIC;
-					}
-					T_since_tape_edge++;
-					Tstates++;
-					// LD BC,3B0E
-					*BC=0x3B0E;
-					T_since_tape_edge+=10;
-					Tstates+=10;
-					// EX AF,AF'
-					uint16_t tmp=*AF;
-					*AF=*AF_;
-					*AF_=tmp;
-					T_since_tape_edge+=4;
-					Tstates+=4;
-					// LD L,A
-					LREG=AREG;
-					T_since_tape_edge+=4;
-					Tstates+=4;
-					// JP 0x0507,SA-START
-					*PC=0x0507;
-					T_since_tape_edge+=10;
-					Tstates+=10;
-				}
-				else if(unlikely(*PC==0x0514)) // Magic edge-saver part 2 (hard-coded implementation of SA-BIT-1)
-				{
-					// DJNZ SA-BIT-1
-					while(1)
-					{
-						BREG--;
-						T_since_tape_edge+=8;
-						Tstates+=8;
-						if(!BREG) break;
-						T_since_tape_edge+=5;
-						Tstates+=5;
-					}
-					// JR NC,SA-OUT
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					if(!(FREG&FC))
-					{
-						T_since_tape_edge+=5;
-						Tstates+=5;
-						goto sa_out;
-					}
-					// LD B,42
-					BREG=0x42;
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					// DJNZ SA-SET
-					while(1)
-					{
-						BREG--;
-						T_since_tape_edge+=8;
-						Tstates+=8;
-						if(!BREG) break;
-						T_since_tape_edge+=5;
-						Tstates+=5;
-					}
-					sa_out:
-					// OUT FE,A
-					bus->portfe=AREG;
-					T_since_tape_edge+=10;
-					Tstates+=10;
-					if((bus->portfe&PORTFE_MIC)?!oldmic:oldmic)
-					{
-						putedge(&T_since_tape_edge, &trecpuls, trec);
-						oldmic=bus->portfe&PORTFE_MIC;
-					}
-					T_since_tape_edge++;
-					Tstates++;
-					// LD B,3E
-					BREG=0x3E;
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					*PC=0x0520;
-					/* This section doesn't work; if I enable the hardcoded JR NZ, the tapes are unreadable.  Dunno why
-					// JR NZ,0511,SA-BIT-2
-					T_since_tape_edge+=7;
-					Tstates+=7;
-					if(!(FREG&FZ))
-					{
-						T_since_tape_edge+=5;
-						Tstates+=5;
-						*PC=0x0511;
-					}
-					else
-					{
-						*PC=0x0522;
-						// DEC B
-						BREG=op_dec8(cpu, BREG);
-						T_since_tape_edge+=4;
-						Tstates+=4;
-						// XOR A
-						cpu->ods.y=5;
-						op_alu(cpu, AREG);
-						T_since_tape_edge+=4;
-						Tstates+=4;
-						// INC A
-						AREG=op_inc8(cpu, AREG);
-						T_since_tape_edge+=4;
-						Tstates+=4;
-						// 0x0525	SA-8-BITS
-						*PC=0x0525;
-					}*/
-				}
-			}
+			breaks_sync(&bks, ram);
+			SDL_PauseAudio(pause);
 		}
+
+		m->debug=debug;
+		int tick=0;
 		if(likely(!pause))
 		{
-			scrn_update(screen, Tstates, frames, play?7:0, Fstate, ram, bus, ula);
-			if(ay_enabled&&!(Tstates&0xf))
-				ay_tstep(&ay, (Tstates&0xff));
-		}
-		if(unlikely(Tstates==32))
-			bus->irq=false;
-		if(zxp_enabled&&!(Tstates%128)) // ZX Printer emulation
-		{
-			if(zxp_stylus_power&&(zxp_stylus_posn>=128)) pset(screen, zxp_stylus_posn-96, y_prnt+119, 15, 3, 0);
-			if(!(Tstates%256))
-			{
-				if(zxp_feed_button||(!zxp_stop_motor&&!(zxp_slow_motor&&(Tstates%512))))
-				{
-					zxp_d0_latch=true;
-					if(++zxp_stylus_posn>=384)
-					{
-						zxp_stylus_posn=0;
-						zxp_rows++;
-						if(zxp_output)
-						{
-							fseek(zxp_output, zxp_height_offset, SEEK_SET);
-							fprintf(zxp_output, "%u", zxp_rows);
-							fseek(zxp_output, 0, SEEK_END);
-							for(unsigned int x=0;x<256;x++)
-							{
-								if(x) fprintf(zxp_output, " ");
-								uint8_t r, g, b;
-								pget(screen, x+32, y_prnt+119, &r, &g, &b);
-								bool dark=(r+g+b)<384;
-								fprintf(zxp_output, "%c", dark?'1':'0');
-							}
-							fprintf(zxp_output, "\n");
-							fflush(zxp_output);
-						}
-						SDL_BlitSurface(screen, &(SDL_Rect){0, y_prnt+2, screen->w, 118}, screen, &(SDL_Rect){0, y_prnt+1, screen->w, 118});
-						SDL_FillRect(screen, &(SDL_Rect){32, y_prnt+119, 256, 1}, SDL_MapRGB(screen->format, 191, 191, 195));
-					}
-					else if(zxp_stylus_posn==128)
-						zxp_d7_latch=true;
-				}
-			}
+			tick=spiffy_tstep(m);
+			if(unlikely(tick&SPIFFY_ERROR))
+				errupt++;
+			if(unlikely(tick&SPIFFY_RZX_END)&&headless) // else the user takes over from here
+				errupt++;
 		}
-		if(unlikely(Tstates>=T_per_frame)) // Frame
+		else // the machine stands still, so go straight to the UI, which sleeps until there's something to do
+			tick=SPIFFY_FRAME;
+		if(unlikely(tick&SPIFFY_FRAME)) // Frame
 		{
 			unsigned int new_kmode=0;
 			uint8_t mode=ram_read(ram, sysvarbyname("MODE")->addr);
@@ -1761,41 +1463,93 @@ int main(int argc, char * argv[])
 					new_kmode=0;
 				break;
 			}
-			if(new_kmode!=keyb_mode)
+			if((new_kmode!=keyb_mode)&&!headless)
 			{
 				keyb_mode=new_kmode;
 				keyb_update(screen, keyb_mode);
 			}
-			bus->reset=false;
-			SDL_Flip(screen);
-			Tstates-=T_per_frame;
-			bus->irq=(Tstates<32); // if we were edgeloading or edgesaving, we might have missed an irq, but we were DI anyway
-			Fstate=(Fstate+1)&0x1f; // flash alternates every 16 frames
-			struct timeval tn;
-			gettimeofday(&tn, NULL);
-			double spd=min(200/(tn.tv_sec-frametime[frames%100].tv_sec+1e-6*(tn.tv_usec-frametime[frames%100].tv_usec)),999);
-			frametime[frames++%100]=tn;
-			if(!(frames%25))
+			if(runahead&&!pause&&!headless)
+			{
+				spiffy_machine *ahead=spiffy_clone(m, screen); // with the keys held now, as the machine will see them
+				if(ahead)
+				{
+					ahead->blind=true;
+					spiffy_run(ahead, runahead-1);
+					ahead->blind=false;
+					spiffy_run(ahead, 1); // draws over the frame m just drew
+					spiffy_free(ahead);
+				}
+				else
+				{
+					fprintf(stderr, "Run-ahead failed, turning it off\n");
+					runahead=0;
+				}
+			}
+			if(delay&&!turbo&&!m->trec&&!pause) // tape recording runs flat out, muted; see abuf.play
+			{
+				#ifdef AUDIO
+				if(soundcard) // sch sets the pace, so the sound card's clock has to be made to agree with it
+				{
+					unsigned int fill=(abuf.wp+AUDIOBITLEN-abuf.rp)%AUDIOBITLEN, target=(AUDIOBITLEN+SAMPLE_RATE**sinc_rate/50)/2; // half full, but we look just after a frame's bits went in
+					if(afill<0)
+						afill=target;
+					afill+=(fill-afill)/64.0;
+					double err=(afill-target)/(AUDIOBITLEN/2.0); // +ve if we're making bits faster than they're taken
+					adrift=max(min(adrift+err*AUDIO_TRIM/256, AUDIO_TRIM), -AUDIO_TRIM); // takes up a steady drift, which err alone could only cancel some way off target
+					abits_trim=(long)T_per_frame*speed/2*max(min(err*AUDIO_TRIM+adrift, AUDIO_TRIM), -AUDIO_TRIM);
+				}
+				#endif /* AUDIO */
+				sched_period(&sch, FRAME_NS*100/speed);
+				sched_wait(&sch);
+				if(jitter&&(sch.frames>=50))
+					sched_report(&sch, stderr);
+			}
+			else
+				sched_stop(&sch);
+			if(!headless)
+				SDL_Flip(screen);
+			double spd=0;
+			if(!pause) // only a frame the machine ran counts; paused, we're here for each event the UI wakes up for
+			{
+				int64_t tn=sched_now();
+				spd=min(200/(1e-9*(tn-frametime[frames%100])),99999);
+				frametime[frames++%100]=tn;
+				if(rw)
+					rewind_capture(rw, m);
+				if(hlog&&hashlog_frame(hlog, spiffy_hash(m)))
+					errupt++;
+				if(maxframes&&((unsigned int)frames>=maxframes))
+					errupt++;
+				if(unlikely(until_addr>=0)&&(ram_read(ram, until_addr)==until_val))
+				{
+					fprintf(stderr, "(%04x)=%02x at frame %d\n", until_addr, until_val, frames);
+					errupt++;
+				}
+			}
+			if(headless)
+				continue;
+			if(pause||!(frames%25))
 			{
 				char text[32];
-				if(spd>=1)
-					sprintf(text, "Speed: %0.3g%%", spd);
+				if(pause)
+					sprintf(text, "Paused");
+				else if(spd>=1000)
+					sprintf(text, "%s: %.0f%%", speed?"Speed":"Max", spd);
+				else if(spd>=1)
+					sprintf(text, "%s: %0.3g%%", speed?"Speed":"Max", spd);
 				else
 					sprintf(text, "Speed: <1%%");
 				dtext(screen, 8, y_cntl+2, 92, text, font, 255, 255, 0, 0, 0, 0);
-				playbutton.col=play?0xbf1f3f:0x3fbf5f;
+				playbutton.col=m->play?0xbf1f3f:0x3fbf5f;
 				drawbutton(screen, playbutton);
 			}
-			if(play&&!pause)
-				tapeblocklen=max(tapeblocklen, 1)-1;
-			if(!(frames%25))
+			if(pause||!(frames%25))
 			{
 				char text[32];
-				int tapen=0;
-				if(deck)
+				if(m->deck)
 				{
-					libspectrum_tape_position(&tapen, deck);
-					snprintf(text, 32, "T%03u [%u]", (tapeblocklen+49)/50, tapen);
+					uint64_t left=tape_block_remaining(m->deck)+m->T_to_tape_edge;
+					snprintf(text, 32, "T%03u [%u]", (unsigned int)((left+T_per_frame*50-1)/(T_per_frame*50)), tape_position(m->deck));
 				}
 				else
 				{
@@ -1814,8 +1568,10 @@ int main(int argc, char * argv[])
 				#endif /* AUDIO */
 			}
 			SDL_Event event;
-			while(SDL_PollEvent(&event))
+			bool idle=pause; // wait for the first event (using no CPU), then take the rest as they come
+			while(idle?SDL_WaitEvent(&event):SDL_PollEvent(&event))
 			{
+				idle=false;
 				switch(event.type)
 				{
 					case SDL_QUIT:
@@ -1827,6 +1583,16 @@ int main(int argc, char * argv[])
 							SDL_keysym key=event.key.keysym;
 							if(key.sym==SDLK_ESCAPE)
 								debug=true;
+							else if((key.sym==SDLK_F9)&&rw&&!m->rzx) // going back would leave the RZX out of step
+								rewind_step(rw, m);
+							else if(key.sym==SDLK_F11)
+							{
+								unsigned int i=0;
+								while((i<nspeeds)&&(speeds[i]<=speed))
+									i++;
+								speed=!speed?speeds[0]:(i<nspeeds)?speeds[i]:0;
+								fprintf(stderr, speed?"Speed %u%%\n":"Speed max\n", speed);
+							}
 							#ifdef AUDIO
 							else if(key.sym==SDLK_KP_ENTER)
 								abuf.wp=(abuf.wp+1)%AUDIOBUFLEN;
@@ -1983,12 +1749,7 @@ int main(int argc, char * argv[])
 								mapk(k, kstate, true);
 							}
 							// else it's not [low] ASCII
-							for(unsigned int i=0;i<8;i++)
-							{
-								kenc[i]=0;
-								for(unsigned int j=0;j<5;j++)
-									if(kstate[i][j]) kenc[i]|=(1<<j);
-							}
+							spiffy_keys(m, kstate);
 						}
 					break;
 					case SDL_KEYUP:
@@ -2147,12 +1908,7 @@ int main(int argc, char * argv[])
 								mapk(k, kstate, false);
 							}
 							// else it's not [low] ASCII
-							for(unsigned int i=0;i<8;i++)
-							{
-								kenc[i]=0;
-								for(unsigned int j=0;j<5;j++)
-									if(kstate[i][j]) kenc[i]|=(1<<j);
-							}
+							spiffy_keys(m, kstate);
 						}
 					break;
 					case SDL_MOUSEMOTION:
@@ -2187,34 +1943,49 @@ int main(int argc, char * argv[])
 										fclose(p);
 										if(fn&&(*fn!='-'))
 										{
-											loadfile(fn+1, &deck, &snap);
-											if(snap)
-											{
-												loadsnap(snap, cpu, bus, ram, &Tstates);
+											if(spiffy_load(m, fn+1, native_files))
 												fprintf(stderr, "Loaded snap '%s'\n", fn+1);
-												libspectrum_snap_free(snap);
-												snap=NULL;
-											}
 										}
 									}
-								SDL_PauseAudio(0);
+								SDL_PauseAudio(pause);
 								}
 								else if(pos_rect(mouse, edgebutton.posn))
-									edgeload=!edgeload;
+								{
+									if(m->rzx) // what the traps load doesn't go through a port, so the recording wouldn't have it
+										fprintf(stderr, "Tape traps stay off while recording or replaying input\n");
+									else
+										m->edgeload=!m->edgeload;
+								}
 								else if(pos_rect(mouse, playbutton.posn))
-									play=!play;
+								{
+									m->play=!m->play;
+									m->autoplay=false;
+								}
 								else if(pos_rect(mouse, nextbutton.posn))
 								{
-									if(deck) libspectrum_tape_select_next_block(deck);
+									if(m->deck)
+									{
+										tape_seek_block(m->deck, tape_position(m->deck)+1);
+										m->T_to_tape_edge=0;
+										m->edgeflags=LIBSPECTRUM_TAPE_FLAGS_NO_EDGE;
+									}
 								}
 								else if(pos_rect(mouse, stopbutton.posn))
-									stopper=!stopper;
+									m->stopper=!m->stopper;
 								else if(pos_rect(mouse, rewindbutton.posn))
 								{
-									if(deck) libspectrum_tape_nth_block(deck, 0);
+									if(m->deck)
+									{
+										tape_seek_block(m->deck, 0);
+										m->T_to_tape_edge=0;
+										m->edgeflags=LIBSPECTRUM_TAPE_FLAGS_NO_EDGE;
+									}
 								}
 								else if(pos_rect(mouse, pausebutton.posn))
+								{
 									pause=!pause;
+									SDL_PauseAudio(pause); // the sound picks up where it left off
+								}
 								else if(pos_rect(mouse, resetbutton.posn))
 									bus_reset(bus);
 								else if(pos_rect(mouse, bugbutton.posn))
@@ -2234,7 +2005,7 @@ int main(int argc, char * argv[])
 										FILE *sf=fopen(fn+1, "wb");
 										if(sf)
 										{
-											savesnap(&snap, cpu, bus, ram, Tstates);
+											savesnap(&snap, cpu, bus, ram, m->Tstates);
 											uint8_t *buffer=NULL; size_t l=0;
 											int out_flags;
 											libspectrum_snap_write(&buffer, &l, &out_flags, snap, LIBSPECTRUM_ID_SNAPSHOT_Z80, NULL, 0);
@@ -2256,20 +2027,12 @@ int main(int argc, char * argv[])
 											perror("fopen");
 									}
 									free(fn);
-									SDL_PauseAudio(0);
+									SDL_PauseAudio(pause);
 								}
 								else if(pos_rect(mouse, trecbutton.posn))
 								{
-									if(trec)
-									{
-										fseek(trec, 0x1D, SEEK_SET);
-										fputc(trecpuls, trec);
-										fputc(trecpuls>>8, trec);
-										fputc(trecpuls>>16, trec);
-										fputc(trecpuls>>24, trec);
-										fclose(trec);
-										trec=NULL;
-									}
+									if(m->trec)
+										spiffy_trec_stop(m);
 									else
 									{
 										SDL_PauseAudio(1);
@@ -2280,41 +2043,14 @@ int main(int argc, char * argv[])
 											fn=fgetl(p);
 											fclose(p);
 										}
-										if(fn&&(*fn!='-'))
-										{
-											trec=fopen(fn+1, "wb");
-											if(!trec)
-												perror("fopen");
-											else
-											{
-												trecpuls=0;
-												fputs("Compressed Square Wave", trec);
-												fputc(0x1A, trec);
-												fputc(0x02, trec);
-												fputc(0x00, trec);
-												fputc(T_per_frame*50, trec);
-												fputc(T_per_frame*50>>8, trec);
-												fputc(T_per_frame*50>>16, trec);
-												fputc(T_per_frame*50>>24, trec);
-												fputc(0, trec);
-												fputc(0, trec);
-												fputc(0, trec);
-												fputc(0, trec);
-												fputc(0x01, trec);
-												fputc((bus->portfe&PORTFE_MIC)?1:0, trec);
-												fputc(0, trec);
-												fputs("Spiffy", trec);
-												for(unsigned int i=6;i<16;i++) fputc(0, trec);
-												fprintf(stderr, "Recording tape to `%s'\n", fn+1);
-												T_since_tape_edge=0;
-											}
-										}
+										if(fn&&(*fn!='-')&&spiffy_trec_start(m, fn+1))
+											fprintf(stderr, "Recording tape to `%s'\n", fn+1);
 										free(fn);
-										SDL_PauseAudio(0);
+										SDL_PauseAudio(pause);
 									}
 								}
 								else if(pos_rect(mouse, feedbutton.posn))
-									zxp_feed_button=true;
+									m->zxp_feed_button=true;
 								else if(pos_rect(mouse, jscbutton.posn))
 									keystick=JS_C;
 								else if(pos_rect(mouse, jssbutton.posn))
@@ -2327,19 +2063,19 @@ int main(int argc, char * argv[])
 								else if(pos_rect(mouse, jsxbutton.posn))
 									keystick=JS_X;
 								else if(pos_rect(mouse, bwbutton.posn))
-									filt_mask^=FILT_BW;
+									m->filt_mask^=FILT_BW;
 								else if(pos_rect(mouse, scanbutton.posn))
-									filt_mask^=FILT_SCAN;
+									m->filt_mask^=FILT_SCAN;
 								else if(pos_rect(mouse, blurbutton.posn))
-									filt_mask^=FILT_BLUR;
+									m->filt_mask^=FILT_BLUR;
 								else if(pos_rect(mouse, vblurbutton.posn))
-									filt_mask^=FILT_VBLUR;
+									m->filt_mask^=FILT_VBLUR;
 								else if(pos_rect(mouse, misgbutton.posn))
-									filt_mask^=FILT_MISG;
+									m->filt_mask^=FILT_MISG;
 								else if(pos_rect(mouse, slowbutton.posn))
-									filt_mask^=FILT_SLOW;
+									m->filt_mask^=FILT_SLOW;
 								else if(pos_rect(mouse, palbutton.posn))
-									filt_mask^=FILT_PAL;
+									m->filt_mask^=FILT_PAL;
 								#ifdef AUDIO
 								else if(pos_rect(mouse, aw_up))
 								{
@@ -2364,11 +2100,7 @@ int main(int argc, char * argv[])
 								else if(pos_rect(mouse, recordbutton.posn))
 								{
 									if(abuf.record)
-									{
-										FILE *a=abuf.record;
-										abuf.record=NULL;
-										fclose(a);
-									}
+										arecfinish(&abuf);
 									else
 									{
 										SDL_PauseAudio(1);
@@ -2383,33 +2115,37 @@ int main(int argc, char * argv[])
 										{
 											FILE *a=fopen(fn?fn+1:"record.wav", "wb");
 											if(a)
+											{
 												wavheader(a);
-											abuf.record=a;
+												if(!(abuf.record=bgw_open(a)))
+													fclose(a);
+											}
 										}
 										free(fn);
-										SDL_PauseAudio(0);
+										SDL_PauseAudio(pause);
 									}
 								}
 								recordbutton.col=abuf.record?0xff0707:0x7f0707;
 								recordbutton.tooltip=abuf.record?"Stop recording audio":"Record audio";
 								drawbutton(screen, recordbutton);
 								#endif /* AUDIO */
-								edgebutton.col=edgeload?0xffffff:0x1f1f1f;
-								edgebutton.tooltip=edgeload?"Disable edge-loader":"Enable edge-loader";
-								playbutton.col=play?0xbf1f3f:0x3fbf5f;
-								stopbutton.col=stopper?0x3f07f7:0x3f0707;
+								edgebutton.col=m->edgeload?0xffffff:0x1f1f1f;
+								edgebutton.tooltip=m->edgeload?"Disable edge-loader":"Enable edge-loader";
+								playbutton.col=m->play?0xbf1f3f:0x3fbf5f;
+								stopbutton.col=m->stopper?0x3f07f7:0x3f0707;
 								pausebutton.col=pause?0xbf6f07:0x7f6f07;
 								pausebutton.tooltip=pause?"Unpause the emulation":"Pause the emulation";
-								trecbutton.col=trec?0xcf1717:0x4f0f0f;
-								trecbutton.tooltip=trec?"Stop recording tape":"Record tape";
-								bwbutton.col=(filt_mask&FILT_BW)?0xffffff:0x9f9f9f;
-								scanbutton.col=(filt_mask&FILT_SCAN)?0x7f7fff:0x5f5fcf;
-								blurbutton.col=(filt_mask&FILT_BLUR)?0xff5f5f:0xbf3f3f;
-								vblurbutton.col=(filt_mask&FILT_VBLUR)?0xff5f5f:0xbf3f3f;
-								misgbutton.col=(filt_mask&FILT_MISG)?0x4f9f4f:0x1f5f1f;
-								slowbutton.col=(filt_mask&FILT_SLOW)?0xbfbfff:0x8f8faf;
-								palbutton.col=(filt_mask&FILT_PAL)?0x7f7fbf:0x4f4f4f;
+								trecbutton.col=m->trec?0xcf1717:0x4f0f0f;
+								trecbutton.tooltip=m->trec?"Stop recording tape":"Record tape";
+								bwbutton.col=(m->filt_mask&FILT_BW)?0xffffff:0x9f9f9f;
+								scanbutton.col=(m->filt_mask&FILT_SCAN)?0x7f7fff:0x5f5fcf;
+								blurbutton.col=(m->filt_mask&FILT_BLUR)?0xff5f5f:0xbf3f3f;
+								vblurbutton.col=(m->filt_mask&FILT_VBLUR)?0xff5f5f:0xbf3f3f;
+								misgbutton.col=(m->filt_mask&FILT_MISG)?0x4f9f4f:0x1f5f1f;
+								slowbutton.col=(m->filt_mask&FILT_SLOW)?0xbfbfff:0x8f8faf;
+								palbutton.col=(m->filt_mask&FILT_PAL)?0x7f7fbf:0x4f4f4f;
 								ksupdate(screen, buttons, keystick);
+								m->kempston=(keystick==JS_K);
 								drawbutton(screen, edgebutton);
 								drawbutton(screen, playbutton);
 								drawbutton(screen, stopbutton);
@@ -2465,7 +2201,7 @@ int main(int argc, char * argv[])
 						mouse.x=event.button.x;
 						mouse.y=event.button.y;
 						button=event.button.button;
-						zxp_feed_button=false;
+						m->zxp_feed_button=false;
 						switch(button)
 						{
 							case SDL_BUTTON_LEFT:
@@ -2484,306 +2220,167 @@ int main(int argc, char * argv[])
 	}
 	
 #ifdef AUDIO
-	abuf.play=true; // let the audio thread run free
-	abuf.busy[0]=false; // and finish
-	SDL_PauseAudio(0);
-	while(abuf.busy[1]); // wait for it to finish
-	fprintf(stderr, "Audio thread shutdown OK.\n");
-#endif
-	TTF_CloseFont(font);
-	TTF_Quit();
-	return(0);
-}
-
-void scrn_update(SDL_Surface *screen, int Tstates, int frames, int frameskip, int Fstate, ram_t *ram, bus_t *bus, ula_t *ula) // TODO: Maybe one day generate floating bus & ULA snow, but that will be hard!
-{
-	bool p128=cap_128_paging(zx_machine);
-	bool t128=cap_128_ula_timings(zx_machine);
-	int line,col;
-	if(t128)
+	if(arender)
 	{
-		line=((Tstates)/228)-15;
-		col=(((Tstates)%228)<<1);
+		wavfinish(arender);
+		fclose(arender);
+		fprintf(stderr, "Rendered %u frames of audio to `%s'\n", frames, render_fn);
 	}
-	else
+	else if(!headless)
 	{
-		line=((Tstates+12)/224)-16;
-		col=(((Tstates+12)%224)<<1);
+		abuf.play=true; // let the audio thread run free
+		abuf.busy[0]=false; // and finish
+		SDL_PauseAudio(0);
+		while(abuf.busy[1]); // wait for it to finish
+		fprintf(stderr, "Audio thread shutdown OK.\n");
+		SDL_DestroyCond(abuf.taken);
+		SDL_DestroyMutex(abuf.lock);
 	}
-	if(likely((line>=0) && (line<296)))
+	if(abuf.record)
+		arecfinish(&abuf);
+#endif
+	if(dump_screen_fn)
 	{
-		bool contend=false;
-		if((col>=0) && (col<screen->w))
+		SDL_Surface *shot=SDL_CreateRGBSurface(SDL_SWSURFACE, 320, 296, 32, 0xff0000, 0xff00, 0xff, 0);
+		if(shot)
 		{
-			uint8_t uladb=0, ulaab=(bus->portfe&0x07)<<3;
-			int ccol=(col>>3)-4;
-			int crow=(line>>3)-6;
-			if((ccol>=0) && (ccol<0x20) && (crow>=0) && (crow<0x18))
-			{
-				/* there should probably be some split bus thing going on here  *
-				 * - that would presumably make contention behave correctly too */
-				if(p128)
-				{
-					unsigned int vram=bus->port7ffd&8?9:7; // RAM7, RAM5
-					uint16_t	dbh=(crow&0x18)|(line%8),
-								dbl=((crow&0x7)<<5)|ccol,
-								abh=ula->timex_enabled?dbh+0x20:0x18|(crow>>3),
-								abl=dbl;
-					uladb=ram->bank[vram][(dbh<<8)+dbl];
-					ulaab=ram->bank[vram][(abh<<8)+abl];
-					contend=!(((Tstates%8)==0)||((Tstates%8)==7)); // TODO probably wrong
-				}
-				else
-				{
-					uint16_t	dbh=0x40|(crow&0x18)|(line%8),
-								dbl=((crow&0x7)<<5)|ccol,
-								abh=ula->timex_enabled?dbh+0x20:0x58|(crow>>3),
-								abl=dbl;
-					uladb=ram_read(ram, (dbh<<8)+dbl);
-					ulaab=ram_read(ram, (abh<<8)+abl);
-					contend=!(((Tstates%8)==6)||((Tstates%8)==7));
-				}
-			}
-			if(ula->t1)
-			{
-				if(((bus->addr&0xC000)==0x4000))
-					ula->memwait=true;
-				if(p128)
-				{
-					if((bus->addr&0xC000)==0xC000)
-					{
-						if(ram->paged[3]&1)
-							ula->memwait=true;
-					}
-				}
-				if((bus->iorq&&!(bus->addr&1))||(ula->ulaplus_enabled&&((bus->addr==0xff3b)||(bus->addr==0xbf3b))))
-					ula->iowait=true;
-				ula->t1=false;
-			}
-			else
-			{
-				if(!bus->mreq)
-					ula->memwait=false;
-				if(!bus->iorq)
-					ula->iowait=false;
-				ula->t1=!bus->mreq;
-			}
-			bus->clk_inhibit=(ula->memwait||ula->iowait)&&contend;
-			if(!(frames&frameskip))
-			{
-				int ink=ulaab&0x07;
-				int paper=(ulaab&0x38)>>3;
-				uint8_t r,g,b;
-				uint8_t s=0x80>>(((Tstates+12)%4)<<1);
-				bool d=uladb&s;
-				if(ula->ulaplus_enabled&&(ula->ulaplus_mode&1))
-				{
-					uint8_t clut=ulaab>>6;
-					uint8_t pix=d?ula->ulaplus_regs[(clut<<4)+ink]:ula->ulaplus_regs[(clut<<4)+paper+8];
-					uint8_t pr=(pix>>2)&7,pg=(pix>>5)&7,pb=pix&3;
-					pb=(pb<<1)|(pb&1);
-					r=scale38(pr);
-					g=scale38(pg);
-					b=scale38(pb);
-					filter_pix(filt_mask, col, line, &r, &g, &b);
-					pset(screen, col, line, r, g, b);
-					d=uladb&(s>>1);
-					pix=d?ula->ulaplus_regs[(clut<<4)+ink]:ula->ulaplus_regs[(clut<<4)+paper+8];
-					pr=(pix>>2)&7;pg=(pix>>5)&7;pb=pix&3;
-					pb=(pb<<1)|(pb&1);
-					r=scale38(pr);
-					g=scale38(pg);
-					b=scale38(pb);
-					filter_pix(filt_mask, col+1, line, &r, &g, &b);
-					pset(screen, col+1, line, r, g, b);
-				}
-				else
-				{
-					bool flash=ulaab&0x80;
-					bool bright=ulaab&0x40;
-					uint8_t t=bright?240:200;
-					if(flash && (Fstate&0x10))
-						d=!d;
-					uint8_t pix=d?ink:paper;
-					r=(pix&2)?t:0;
-					g=(pix&4)?t:0;
-					b=(pix&1)?t:0;
-					if(pix==1) b+=15;
-					filter_pix(filt_mask, col, line, &r, &g, &b);
-					pset(screen, col, line, r, g, b);
-					d=uladb&(s>>1);
-					if(flash && (Fstate&0x10))
-						d=!d;
-					pix=d?ink:paper;
-					r=(pix&2)?t:0;
-					g=(pix&4)?t:0;
-					b=(pix&1)?t:0;
-					if(pix==1) b+=15;
-					filter_pix(filt_mask, col+1, line, &r, &g, &b);
-					pset(screen, col+1, line, r, g, b);
-				}
-			}
+			SDL_BlitSurface(screen, &(SDL_Rect){0, 0, 320, 296}, shot, NULL);
+			if(SDL_SaveBMP(shot, dump_screen_fn))
+				fprintf(stderr, "Failed to save screenshot `%s': %s\n", dump_screen_fn, SDL_GetError());
+			SDL_FreeSurface(shot);
 		}
+		else
+			fprintf(stderr, "SDL_CreateRGBSurface: %s\n", SDL_GetError());
 	}
-}
-
-uint8_t scale38(uint8_t v)
-{
-	uint8_t rv=0;
-	if(v&4) rv|=0x90;
-	if(v&2) rv|=0x4A;
-	if(v&1) rv|=0x25;
-	return(rv);
-}
-
-void getedge(libspectrum_tape *deck, bool *play, bool stopper, bool *ear, uint32_t *T_to_tape_edge, int *edgeflags, int *oldtapeblock, unsigned int *tapeblocklen)
-{
-	int block;
-	if(likely(!libspectrum_tape_position(&block, deck)))
+	if(dump_ram_fn)
 	{
-		if(unlikely(block!=*oldtapeblock))
+		FILE *fp=fopen(dump_ram_fn, "wb");
+		if(!fp)
+			fprintf(stderr, "Failed to open `%s': %s\n", dump_ram_fn, strerror(errno));
+		else
 		{
-			*tapeblocklen=(libspectrum_tape_block_length(libspectrum_tape_current_block(deck))+69887)/69888;
-			*oldtapeblock=block;
-			if(stopper)
-				*play=false;
+			for(unsigned int i=ram->roms;i<ram->banks;i++) // 48k: 0x4000-0xFFFF; 128k: RAM0-RAM7
+				fwrite(ram->bank[i], 1, 0x4000, fp);
+			fclose(fp);
 		}
 	}
-	if(*edgeflags&LIBSPECTRUM_TAPE_FLAGS_STOP)
-		*play=false;
-	if(*edgeflags&LIBSPECTRUM_TAPE_FLAGS_STOP48)
-		*play=false;
-	if(!(*edgeflags&LIBSPECTRUM_TAPE_FLAGS_NO_EDGE))
-		*ear=!*ear;
-	if(*edgeflags&LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW)
-		*ear=false;
-	if(*edgeflags&LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH)
-		*ear=true;
-	if(*edgeflags&LIBSPECTRUM_TAPE_FLAGS_TAPE)
+	if(dump_snap_fn)
 	{
-		*play=false;
-		*T_to_tape_edge=0;
-		*edgeflags=0;
+		size_t len;
+		uint8_t *sna=snap_save_sna(zx_machine, cpu, bus, ram, &len);
+		FILE *fp=sna?fopen(dump_snap_fn, "wb"):NULL;
+		if(!sna)
+			perror("malloc");
+		else if(!fp)
+			fprintf(stderr, "Failed to open `%s': %s\n", dump_snap_fn, strerror(errno));
+		else
+		{
+			fwrite(sna, 1, len, fp);
+			fclose(fp);
+		}
+		free(sna);
 	}
-	if(*play)
-		libspectrum_tape_get_next_edge(T_to_tape_edge, edgeflags, deck);
-}
-
-void putedge(uint32_t *T_since_tape_edge, unsigned long *trecpuls, FILE *trec)
-{
-	if(*T_since_tape_edge>0xFF)
+	if(dump_hash)
+		printf("%016llx\n", (unsigned long long)spiffy_hash(m));
+	bool hashlog_ok=hashlog_close(hlog);
+	if(!spiffy_rzx_stop(m))
+		hashlog_ok=false;
+	if(fork_n&&!fork_test(m, fork_n))
+		hashlog_ok=false;
+	if(dump_stats)
 	{
-		fputc(0, trec);
-		fputc(*T_since_tape_edge, trec);
-		fputc(*T_since_tape_edge>>8, trec);
-		fputc(*T_since_tape_edge>>16, trec);
-		fputc(*T_since_tape_edge>>24, trec);
+		struct timeval runend;
+		gettimeofday(&runend, NULL);
+		printf("frames=%d Tstates=%lld usec=%lld\n", frames, (long long)m->frames*T_per_frame+m->Tstates-Tstart, (runend.tv_sec-runstart.tv_sec)*1000000LL+runend.tv_usec-runstart.tv_usec);
 	}
+	rewind_free(rw);
+	breaks_free(&bks);
+	spiffy_free(m);
+	free(rom);
+	if(headless)
+		SDL_FreeSurface(screen);
 	else
-		fputc(*T_since_tape_edge, trec);
-	if(!(++(*trecpuls)&0xFF))
 	{
-		fflush(trec);
-		fseek(trec, 0x1D, SEEK_SET);
-		fputc(*trecpuls, trec);
-		fputc(*trecpuls>>8, trec);
-		fputc(*trecpuls>>16, trec);
-		fputc(*trecpuls>>24, trec);
-		fflush(trec);
-		fseek(trec, 0, SEEK_END);
+		TTF_CloseFont(font);
+		TTF_Quit();
 	}
-	*T_since_tape_edge=0;
+	return(hashlog_ok?0:1);
 }
 
-void loadfile(const char *fn, libspectrum_tape **deck, libspectrum_snap **snap)
+#define FORK_BRANCHES	40 // one for each key
+
+bool fork_test(spiffy_machine *m, unsigned long n) // clones m n times, FORK_BRANCHES at a time, each holding down a different key for a frame.  Clones with the same key must agree, and m mustn't notice
 {
-	*snap=NULL;
-	FILE *fp=fopen(fn, "rb");
-	if(!fp)
+	uint64_t before=spiffy_hash(m), ref[FORK_BRANCHES];
+	spiffy_machine *c[FORK_BRANCHES];
+	SDL_Surface *scratch=SDL_CreateRGBSurface(SDL_SWSURFACE, 320, 296, 32, 0xff0000, 0xff00, 0xff, 0); // for the clones to draw on; nobody looks
+	if(!scratch)
 	{
-		fprintf(stderr, "Failed to open '%s': %s\n", fn, strerror(errno));
+		fprintf(stderr, "SDL_CreateRGBSurface: %s\n", SDL_GetError());
+		return(false);
 	}
-	else
+	long long clone_us=0, run_us=0;
+	bool ok=true;
+	unsigned long done=0;
+	while(ok&&(done<n))
 	{
-		string data=sslurp(fp);
-		libspectrum_id_t type;
-		if(libspectrum_identify_file_raw(&type, fn, (uint8_t *)data.buf, data.i))
-		{
-			fn=NULL;
-		}
-		else
+		unsigned int k=min(n-done, FORK_BRANCHES);
+		struct timeval t0, t1, t2;
+		gettimeofday(&t0, NULL);
+		for(unsigned int i=0;i<k;i++)
+			if(!(c[i]=spiffy_clone(m, scratch)))
+			{
+				while(i--)
+					spiffy_free(c[i]);
+				SDL_FreeSurface(scratch);
+				return(false);
+			}
+		gettimeofday(&t1, NULL);
+		for(unsigned int i=0;i<k;i++)
 		{
-			libspectrum_class_t class;
-			if(libspectrum_identify_class(&class, type))
-				fn=NULL;
-			else
+			bool kstate[8][5]={{false}};
+			kstate[i/5][i%5]=true;
+			spiffy_keys(c[i], kstate);
+			if(spiffy_run(c[i], 1))
+				ok=false;
+			uint64_t h=spiffy_hash(c[i]);
+			if(done<FORK_BRANCHES)
+				ref[i]=h;
+			else if(h!=ref[i])
 			{
-				switch(class)
-				{
-					case LIBSPECTRUM_CLASS_TAPE:
-						if(*deck) libspectrum_tape_free(*deck);
-						if((*deck=libspectrum_tape_alloc()))
-						{
-							if(libspectrum_tape_read(*deck, (uint8_t *)data.buf, data.i, type, fn))
-								libspectrum_tape_free(*deck);
-							else
-								fprintf(stderr, "Mounted tape '%s'\n", fn);
-						}
-					break;
-					case LIBSPECTRUM_CLASS_SNAPSHOT:
-						*snap=libspectrum_snap_alloc();
-						if(libspectrum_snap_read(*snap, (uint8_t *)data.buf, data.i, type, fn))
-						{
-							fprintf(stderr, "Snap load failed\n");
-							libspectrum_snap_free(*snap);
-							*snap=NULL;
-						}
-					break;
-					default:
-						fprintf(stderr, "This class of file is not supported!\n");
-					break;
-				}
+				fprintf(stderr, "fork: clone %lu (key %u,%u) diverged: %016llx, not %016llx\n", done+i, i/5, i%5, (unsigned long long)h, (unsigned long long)ref[i]);
+				ok=false;
 			}
 		}
-		free_string(&data);
+		gettimeofday(&t2, NULL);
+		for(unsigned int i=0;i<k;i++)
+			spiffy_free(c[i]);
+		clone_us+=(t1.tv_sec-t0.tv_sec)*1000000LL+t1.tv_usec-t0.tv_usec;
+		run_us+=(t2.tv_sec-t1.tv_sec)*1000000LL+t2.tv_usec-t1.tv_usec;
+		done+=k;
 	}
-}
-
-void loadsnap(libspectrum_snap *snap, z80 *cpu, bus_t *bus, ram_t *ram, int *Tstates)
-{
-	if(snap)
+	SDL_FreeSurface(scratch);
+	if(spiffy_hash(m)!=before)
 	{
-		if(libspectrum_snap_machine(snap)!=LIBSPECTRUM_MACHINE_48) fprintf(stderr, "loadsnap: warning: machine is not 48, snap will probably fail\n");
-		z80_reset(cpu, bus);
-		AREG=libspectrum_snap_a(snap);
-		FREG=libspectrum_snap_f(snap);
-		*BC=libspectrum_snap_bc(snap);
-		*DE=libspectrum_snap_de(snap);
-		*HL=libspectrum_snap_hl(snap);
-		aREG=libspectrum_snap_a_(snap);
-		fREG=libspectrum_snap_f_(snap);
-		*BC_=libspectrum_snap_bc_(snap);
-		*DE_=libspectrum_snap_de_(snap);
-		*HL_=libspectrum_snap_hl_(snap);
-		*Ix=libspectrum_snap_ix(snap);
-		*Iy=libspectrum_snap_iy(snap);
-		*Intvec=libspectrum_snap_i(snap);
-		*Refresh=libspectrum_snap_r(snap);
-		*SP=libspectrum_snap_sp(snap);
-		*PC=libspectrum_snap_pc(snap);
-		cpu->IFF[0]=libspectrum_snap_iff1(snap);
-		cpu->IFF[1]=libspectrum_snap_iff2(snap);
-		cpu->intmode=libspectrum_snap_im(snap);
-		*Tstates=libspectrum_snap_tstates(snap);
-		cpu->halt=libspectrum_snap_halted(snap);
-		cpu->block_ints=libspectrum_snap_last_instruction_ei(snap);
-		bus->portfe=libspectrum_snap_out_ula(snap);
-		memcpy(ram->bank[1], libspectrum_snap_pages(snap, 5), 0x4000);
-		memcpy(ram->bank[2], libspectrum_snap_pages(snap, 2), 0x4000);
-		memcpy(ram->bank[3], libspectrum_snap_pages(snap, 0), 0x4000);
-		// At present we ignore SLT data
+		fprintf(stderr, "fork: the clones changed their parent\n");
+		ok=false;
 	}
+	fprintf(stderr, "fork: %lu clones, %.1fus each to make, %.1fus each to run a frame; %s\n", done, clone_us/(double)max(done, 1), run_us/(double)max(done, 1), ok?"all consistent":"FAILED");
+	return(ok);
 }
+#ifdef AUDIO
+void arecfinish(audiobuf *abuf)
+{
+	bgwriter *a=abuf->record;
+	SDL_LockAudio(); // make sure mixaudio isn't halfway through a write
+	abuf->record=NULL;
+	SDL_UnlockAudio();
+	FILE *fp=bgw_finish(a);
+	if(!fp) return;
+	wavfinish(fp);
+	fclose(fp);
+}
+#endif /* AUDIO */
 
 void savesnap(libspectrum_snap **snap, z80 *cpu, bus_t *bus, ram_t *ram, int Tstates)
 {
@@ -0,0 +1,994 @@
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	tape.c - pre-decoded tape edge streams, and tape recording
+
+	The tape is run through libspectrum once, at load time (or, for TAP and TZX files whose blocks we know, read
+	straight from the mapped file), and the edges are stored as a byte stream.
+	Each edge is a little-endian base-128 varint of (delay<<1)|hasflags, followed (if hasflags) by one byte
+	of libspectrum edge flags.  A standard ROM-timing edge thus takes two bytes.
+	The BLOCK and TAPE flags are not stored; block boundaries come from the block index, and the end of the
+	stream is the end of the tape.
+
+	When recording to a TAP or TZX, MIC pulses are run through a decoder looking for ROM-timing blocks (pilot
+	tone, two sync pulses, then pairs of bit pulses), which are written as standard speed data blocks; the
+	pulses are held until we know, and anything that doesn't turn out to be a standard block is written to a
+	TZX as direct recording, with long silences as pauses.  (A TAP can only hold the standard blocks.)
+*/
+
+#include "tape.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "bits.h"
+
+#define TAPE_STORED_FLAGS	(LIBSPECTRUM_TAPE_FLAGS_STOP|LIBSPECTRUM_TAPE_FLAGS_STOP48|LIBSPECTRUM_TAPE_FLAGS_NO_EDGE|LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW|LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH|LIBSPECTRUM_TAPE_FLAGS_LENGTH_SHORT|LIBSPECTRUM_TAPE_FLAGS_LENGTH_LONG)
+#define TAPE_MAX_BYTES		(1<<28) // give up on tapes that loop forever (eg. a TZX jump back to itself)
+#define TAPE_PILOT			2168 // ROM timings, in T-states
+#define TAPE_SYNC1			667
+#define TAPE_SYNC2			735
+#define TAPE_BIT0			855
+#define TAPE_BIT1			1710
+#define TAPE_MIN_PILOT		256 // fewer pilot pulses than this aren't a pilot tone
+#define TAPE_MAX_PILOT		10000 // the ROM's header leader is 8063; of a longer tone, we only hold on to this much of the end
+#define TAPE_GAP			35000 // a pulse at least this long (10ms) is silence, not signal
+#define TAPE_RAW_T			79 // T-states per sample of direct recording (44.1kHz)
+#define TAPE_RAW_MAX		65536 // bytes of samples per direct recording block
+#define TAPE_HOLD_MAX		(1<<16) // pulses to hold before giving up on them being a block
+
+static bool tape_append(tape_deck *d, size_t *l, uint32_t tstates, int flags)
+{
+	if(d->nbytes+7>*l)
+	{
+		size_t nl=*l?*l*2:65536;
+		uint8_t *ne=realloc(d->edges, nl);
+		if(!ne)
+		{
+			perror("realloc");
+			return(false);
+		}
+		d->edges=ne;
+		*l=nl;
+	}
+	flags&=TAPE_STORED_FLAGS;
+	uint64_t v=((uint64_t)tstates<<1)|(flags?1:0);
+	do
+	{
+		d->edges[d->nbytes++]=(v&0x7f)|((v>0x7f)?0x80:0);
+		v>>=7;
+	}
+	while(v);
+	if(flags)
+		d->edges[d->nbytes++]=flags;
+	return(true);
+}
+
+typedef struct
+{
+	tape_deck *d;
+	size_t l; // allocated length of d->edges
+	int cur; // block we're charging edges to
+	uint64_t T;
+}
+tape_gen;
+
+static bool tape_gen_edge(tape_gen *g, int block, uint32_t tstates, int flags)
+{
+	tape_deck *d=g->d;
+	if(d->nbytes>=TAPE_MAX_BYTES) return(false);
+	while((g->cur<block)&&(g->cur+1<(int)d->nblocks)) // blocks without edges get an empty entry.  (If block went backwards, we're in a TZX loop; keep charging the current block)
+	{
+		g->cur++;
+		d->blocks[g->cur].offset=d->nbytes;
+		d->blocks[g->cur].start=g->T;
+	}
+	if(!tape_append(d, &g->l, tstates, flags)) return(false);
+	d->blocks[g->cur].nedges++;
+	d->blocks[g->cur].length+=tstates;
+	g->T+=tstates;
+	return(true);
+}
+
+static void tape_gen_finish(tape_gen *g)
+{
+	tape_deck *d=g->d;
+	if(d->nbytes>=TAPE_MAX_BYTES)
+		fprintf(stderr, "tape: edge stream too long (looping tape?), truncated\n");
+	while(++g->cur<(int)d->nblocks)
+	{
+		d->blocks[g->cur].offset=d->nbytes;
+		d->blocks[g->cur].start=g->T;
+	}
+}
+
+static bool tape_name_header(tape_block *b)
+{
+	if(((b->type==LIBSPECTRUM_TAPE_BLOCK_ROM)||(b->type==LIBSPECTRUM_TAPE_BLOCK_TURBO))&&(b->len==19)&&!b->data[0])
+	{
+		static const char *const what[4]={"Program", "Number array", "Character array", "Bytes"};
+		char fn[11];
+		for(unsigned int i=0;i<10;i++)
+			fn[i]=((b->data[i+2]>=32)&&(b->data[i+2]<127))?b->data[i+2]:'?';
+		fn[10]=0;
+		snprintf(b->name, TAPE_NAMELEN, "%s: %s", (b->data[1]<4)?what[b->data[1]]:"Header", fn);
+		return(true);
+	}
+	return(false);
+}
+
+static void tape_name_block(tape_block *b, libspectrum_tape_block *block)
+{
+	b->type=libspectrum_tape_block_type(block);
+	b->data=NULL;
+	b->len=0;
+	b->raw=NULL;
+	if((b->type==LIBSPECTRUM_TAPE_BLOCK_ROM)||(b->type==LIBSPECTRUM_TAPE_BLOCK_TURBO))
+	{
+		b->data=libspectrum_tape_block_data(block);
+		b->len=libspectrum_tape_block_data_length(block);
+	}
+	if(tape_name_header(b)) return;
+	if(libspectrum_tape_block_description(b->name, TAPE_NAMELEN, block))
+		b->name[0]=0;
+}
+
+static int tape_decode(void *data)
+{
+	tape_deck *d=data;
+	libspectrum_tape_iterator it;
+	unsigned int n=0;
+	for(libspectrum_tape_block *block=libspectrum_tape_iterator_init(&it, d->lt);block;block=libspectrum_tape_iterator_next(&it))
+		n++;
+	if(!(d->blocks=malloc(max(n, 1)*sizeof(tape_block))))
+	{
+		perror("malloc");
+		return(1);
+	}
+	n=0;
+	for(libspectrum_tape_block *block=libspectrum_tape_iterator_init(&it, d->lt);block;block=libspectrum_tape_iterator_next(&it))
+	{
+		tape_block *b=d->blocks+n++;
+		b->offset=0;
+		b->nedges=0;
+		b->start=b->length=0;
+		tape_name_block(b, block);
+	}
+	d->nblocks=n;
+	if(!n) return(0);
+	tape_gen g={.d=d, .l=0, .cur=-1, .T=0};
+	libspectrum_tape_nth_block(d->lt, 0);
+	while(1)
+	{
+		int p;
+		libspectrum_dword tstates;
+		int flags;
+		if(libspectrum_tape_position(&p, d->lt)) break;
+		if(libspectrum_tape_get_next_edge(&tstates, &flags, d->lt)) break;
+		if(!tape_gen_edge(&g, p, tstates, flags)) break;
+		if(flags&LIBSPECTRUM_TAPE_FLAGS_TAPE) break;
+	}
+	tape_gen_finish(&g);
+	libspectrum_tape_nth_block(d->lt, 0);
+	return(0);
+}
+
+/* Native TAP and TZX reading.  The blocks are indexed straight away (which only means walking the block headers),
+   and the edges generated from the mapping in the background, as for libspectrum tapes */
+
+#define W(p)	((unsigned int)((p)[0]|((p)[1]<<8)))
+#define D3(p)	((size_t)W(p)|((size_t)(p)[2]<<16))
+#define DW(p)	((size_t)W(p)|((size_t)W((p)+2)<<16))
+
+static bool tzx_block_size(uint8_t id, const uint8_t *p, size_t avail, size_t *size) // false if we don't know the block, or it's truncated
+{
+	size_t hdr;
+	switch(id)
+	{
+		case 0x10: hdr=4; break; // standard speed data
+		case 0x11: hdr=0x12; break; // turbo speed data
+		case 0x12: hdr=4; break; // pure tone
+		case 0x13: hdr=1; break; // pulse sequence
+		case 0x14: hdr=0x0a; break; // pure data
+		case 0x15: hdr=8; break; // direct recording
+		case 0x20: case 0x23: case 0x24: hdr=2; break; // pause, jump, loop start
+		case 0x21: case 0x30: hdr=1; break; // group start, text description
+		case 0x22: case 0x25: hdr=0; break; // group end, loop end
+		case 0x2a: hdr=4; break; // stop the tape if in 48K mode
+		case 0x2b: hdr=5; break; // set signal level
+		case 0x31: hdr=2; break; // message
+		case 0x32: hdr=2; break; // archive info
+		case 0x33: hdr=1; break; // hardware type
+		case 0x35: hdr=0x14; break; // custom info
+		case 0x5a: hdr=9; break; // glue (concatenated TZX)
+		default: return(false);
+	}
+	if(avail<hdr) return(false);
+	switch(id)
+	{
+		case 0x10: *size=hdr+W(p+2); break;
+		case 0x11: *size=hdr+D3(p+0x0f); break;
+		case 0x13: *size=hdr+2*p[0]; break;
+		case 0x14: *size=hdr+D3(p+7); break;
+		case 0x15: *size=hdr+D3(p+5); break;
+		case 0x21: case 0x30: *size=hdr+p[0]; break;
+		case 0x31: *size=hdr+p[1]; break;
+		case 0x32: *size=hdr+W(p); break;
+		case 0x33: *size=hdr+3*p[0]; break;
+		case 0x35: *size=hdr+DW(p+0x10); break;
+		default: *size=hdr; break;
+	}
+	return(*size<=avail);
+}
+
+static void tzx_name_block(tape_block *b)
+{
+	if(tape_name_header(b)) return;
+	const char *name;
+	switch(b->type)
+	{
+		case LIBSPECTRUM_TAPE_BLOCK_ROM: name="Standard Speed Data"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_TURBO: name="Turbo Speed Data"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE: name="Pure Tone"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_PULSES: name="List of Pulses"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA: name="Pure Data"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA: name="Raw Data"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_PAUSE: name=W(b->raw)?"Pause":"Stop Tape"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_GROUP_START: name="Group Start"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_GROUP_END: name="Group End"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_JUMP: name="Jump"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_LOOP_START: name="Loop Start"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_LOOP_END: name="Loop End"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_STOP48: name="Stop Tape If In 48K Mode"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_SET_SIGNAL_LEVEL: name="Set Signal Level"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_COMMENT: name="Comment"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_MESSAGE: name="Message"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO: name="Archive Info"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_HARDWARE: name="Hardware Information"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_CUSTOM: name="Custom Information"; break;
+		case LIBSPECTRUM_TAPE_BLOCK_CONCAT: name="Concatenation Block"; break;
+		default: name=""; break;
+	}
+	snprintf(b->name, TAPE_NAMELEN, "%s", name);
+}
+
+static bool tape_index(tape_deck *d, bool tzx) // false if we can't handle the file
+{
+	const uint8_t *buf=d->map.buf;
+	size_t len=d->map.len, start=0;
+	if(tzx)
+	{
+		if((len<10)||memcmp(buf, "ZXTape!\x1a", 8)) return(false);
+		start=10;
+	}
+	unsigned int n=0;
+	for(size_t p=start;p<len;n++)
+	{
+		size_t size;
+		if(tzx)
+		{
+			if(!tzx_block_size(buf[p], buf+p+1, len-p-1, &size)) return(false);
+			p+=1+size;
+		}
+		else
+		{
+			if((len-p<2)||(len-p-2<W(buf+p))) return(false);
+			p+=2+W(buf+p);
+		}
+	}
+	if(!(d->blocks=malloc(max(n, 1)*sizeof(tape_block))))
+	{
+		perror("malloc");
+		return(false);
+	}
+	n=0;
+	for(size_t p=start;p<len;n++)
+	{
+		tape_block *b=d->blocks+n;
+		b->offset=0;
+		b->nedges=0;
+		b->start=b->length=0;
+		b->data=NULL;
+		b->len=0;
+		if(tzx)
+		{
+			size_t size;
+			tzx_block_size(buf[p], buf+p+1, len-p-1, &size);
+			b->type=buf[p];
+			b->raw=buf+p+1;
+			switch(b->type)
+			{
+				case LIBSPECTRUM_TAPE_BLOCK_ROM: b->data=b->raw+4; b->len=W(b->raw+2); break;
+				case LIBSPECTRUM_TAPE_BLOCK_TURBO: b->data=b->raw+0x12; b->len=D3(b->raw+0x0f); break;
+				case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA: b->data=b->raw+0x0a; b->len=D3(b->raw+7); break;
+				case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA: b->data=b->raw+8; b->len=D3(b->raw+5); break;
+				default: break;
+			}
+			p+=1+size;
+		}
+		else
+		{
+			b->type=LIBSPECTRUM_TAPE_BLOCK_ROM;
+			b->raw=NULL;
+			b->len=W(buf+p);
+			b->data=buf+p+2;
+			p+=2+b->len;
+		}
+		tzx_name_block(b);
+	}
+	d->nblocks=n;
+	return(true);
+}
+
+static bool tape_gen_data(tape_gen *g, int block, const uint8_t *data, size_t len, unsigned int lastbits, uint32_t bit0, uint32_t bit1)
+{
+	if(!lastbits||(lastbits>8)) lastbits=8;
+	for(size_t i=0;i<len;i++)
+		for(unsigned int j=0;j<((i+1<len)?8:lastbits);j++)
+		{
+			uint32_t t=(data[i]&(0x80>>j))?bit1:bit0;
+			if(!tape_gen_edge(g, block, t, 0)||!tape_gen_edge(g, block, t, 0))
+				return(false);
+		}
+	return(true);
+}
+
+static bool tape_gen_pause(tape_gen *g, int block, unsigned int ms)
+{
+	if(!ms) return(true);
+	return(tape_gen_edge(g, block, ms*TAPE_T_MS, LIBSPECTRUM_TAPE_FLAGS_NO_EDGE|LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW));
+}
+
+static bool tape_gen_rom(tape_gen *g, int block, const uint8_t *raw, const uint8_t *data, size_t len) // standard or turbo speed data; raw is a turbo block's header, or NULL for ROM timings
+{
+	uint32_t pilot=TAPE_PILOT, sync1=TAPE_SYNC1, sync2=TAPE_SYNC2, bit0=TAPE_BIT0, bit1=TAPE_BIT1;
+	unsigned int npilot=(len&&(data[0]&0x80))?3223:8063, lastbits=8;
+	if(raw)
+	{
+		pilot=W(raw);
+		sync1=W(raw+2);
+		sync2=W(raw+4);
+		bit0=W(raw+6);
+		bit1=W(raw+8);
+		npilot=W(raw+0x0a);
+		lastbits=raw[0x0c];
+	}
+	for(unsigned int i=0;i<npilot;i++)
+		if(!tape_gen_edge(g, block, pilot, 0)) return(false);
+	if(!tape_gen_edge(g, block, sync1, 0)) return(false);
+	if(!tape_gen_edge(g, block, sync2, 0)) return(false);
+	return(tape_gen_data(g, block, data, len, lastbits, bit0, bit1));
+}
+
+static bool tape_gen_raw(tape_gen *g, int block, const uint8_t *raw, const uint8_t *data, size_t len) // direct recording: an edge wherever the sample changes
+{
+	uint32_t per=W(raw), run=0;
+	unsigned int lastbits=raw[4];
+	bool level=len&&(data[0]&0x80);
+	if(!tape_gen_edge(g, block, 0, LIBSPECTRUM_TAPE_FLAGS_NO_EDGE|(level?LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH:LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW)))
+		return(false);
+	if(!lastbits||(lastbits>8)) lastbits=8;
+	for(size_t i=0;i<len;i++)
+		for(unsigned int j=0;j<((i+1<len)?8:lastbits);j++)
+		{
+			bool s=data[i]&(0x80>>j);
+			if(s!=level)
+			{
+				if(!tape_gen_edge(g, block, run, 0)) return(false);
+				run=0;
+				level=s;
+			}
+			else if(run>UINT32_MAX-per)
+			{
+				if(!tape_gen_edge(g, block, run, LIBSPECTRUM_TAPE_FLAGS_NO_EDGE)) return(false);
+				run=0;
+			}
+			run+=per;
+		}
+	if(run&&!tape_gen_edge(g, block, run, LIBSPECTRUM_TAPE_FLAGS_NO_EDGE))
+		return(false);
+	return(true);
+}
+
+static int tape_decode_native(void *data)
+{
+	tape_deck *d=data;
+	tape_gen g={.d=d, .l=0, .cur=-1, .T=0};
+	int loop=-1; // first block of the current loop
+	unsigned int loops=0; // passes still to make
+	size_t visits=0;
+	bool ok=true;
+	for(int i=0;ok&&(i>=0)&&(i<(int)d->nblocks);i++)
+	{
+		if(++visits>TAPE_MAX_BYTES) // a tape that jumps around forever without making any edges
+		{
+			fprintf(stderr, "tape: TZX keeps jumping about, truncated\n");
+			break;
+		}
+		const tape_block *b=d->blocks+i;
+		const uint8_t *p=b->raw;
+		switch(b->type)
+		{
+			case LIBSPECTRUM_TAPE_BLOCK_ROM:
+				ok=tape_gen_rom(&g, i, NULL, b->data, b->len)&&tape_gen_pause(&g, i, p?W(p):TAPE_PAUSE);
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+				ok=tape_gen_rom(&g, i, p, b->data, b->len)&&tape_gen_pause(&g, i, W(p+0x0d));
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
+				for(unsigned int j=0;ok&&(j<W(p+2));j++)
+					ok=tape_gen_edge(&g, i, W(p), 0);
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_PULSES:
+				for(unsigned int j=0;ok&&(j<p[0]);j++)
+					ok=tape_gen_edge(&g, i, W(p+1+2*j), 0);
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+				ok=tape_gen_data(&g, i, b->data, b->len, p[4], W(p), W(p+2))&&tape_gen_pause(&g, i, W(p+5));
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+				ok=tape_gen_raw(&g, i, p, b->data, b->len)&&tape_gen_pause(&g, i, W(p+2));
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_PAUSE:
+				if(W(p))
+					ok=tape_gen_pause(&g, i, W(p));
+				else
+					ok=tape_gen_edge(&g, i, 0, LIBSPECTRUM_TAPE_FLAGS_NO_EDGE|LIBSPECTRUM_TAPE_FLAGS_STOP);
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_JUMP:
+				i+=(int16_t)W(p)-1;
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_LOOP_START:
+				loop=i+1;
+				loops=W(p);
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_LOOP_END:
+				if((loop>=0)&&loops&&--loops)
+					i=loop-1;
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_STOP48:
+				ok=tape_gen_edge(&g, i, 0, LIBSPECTRUM_TAPE_FLAGS_NO_EDGE|LIBSPECTRUM_TAPE_FLAGS_STOP48);
+			break;
+			case LIBSPECTRUM_TAPE_BLOCK_SET_SIGNAL_LEVEL:
+				ok=tape_gen_edge(&g, i, 0, LIBSPECTRUM_TAPE_FLAGS_NO_EDGE|(p[4]?LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH:LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW));
+			break;
+			default: // no edges
+			break;
+		}
+	}
+	tape_gen_finish(&g);
+	return(0);
+}
+
+#undef W
+#undef D3
+#undef DW
+
+static tape_deck *tape_new(void)
+{
+	tape_deck *d=malloc(sizeof(tape_deck));
+	if(!d)
+	{
+		perror("malloc");
+		return(NULL);
+	}
+	d->lt=NULL;
+	d->map=(mapfile){.buf=NULL, .len=0, .mapped=false};
+	d->edges=NULL;
+	d->nbytes=0;
+	d->blocks=NULL;
+	d->nblocks=0;
+	d->pos=0;
+	d->block=0;
+	d->T=0;
+	d->ended=false;
+	d->ready=false;
+	d->shared=NULL;
+	d->refs=1;
+	return(d);
+}
+
+static void tape_start(tape_deck *d, int (*decode)(void *))
+{
+	if(!(d->decoder=SDL_CreateThread(decode, d)))
+	{
+		fprintf(stderr, "tape_load: SDL_CreateThread: %s, decoding in foreground\n", SDL_GetError());
+		decode(d);
+		d->ready=true;
+	}
+}
+
+tape_deck *tape_load(libspectrum_tape *lt)
+{
+	if(!lt) return(NULL);
+	tape_deck *d=tape_new();
+	if(!d)
+	{
+		libspectrum_tape_free(lt);
+		return(NULL);
+	}
+	d->lt=lt;
+	tape_start(d, tape_decode);
+	return(d);
+}
+
+tape_deck *tape_load_mapped(mapfile *map, bool tzx)
+{
+	tape_deck *d=tape_new();
+	if(!d) return(NULL);
+	d->map=*map;
+	if(!tape_index(d, tzx))
+	{
+		free(d->blocks);
+		free(d);
+		return(NULL);
+	}
+	*map=(mapfile){.buf=NULL, .len=0, .mapped=false};
+	tape_start(d, tape_decode_native);
+	return(d);
+}
+
+void tape_wait(tape_deck *d)
+{
+	if(likely(d->ready)) return;
+	SDL_WaitThread(d->decoder, NULL);
+	d->decoder=NULL;
+	d->ready=true;
+}
+
+tape_deck *tape_clone(tape_deck *d)
+{
+	tape_wait(d);
+	tape_deck *c=malloc(sizeof(tape_deck));
+	if(!c)
+	{
+		perror("malloc");
+		return(NULL);
+	}
+	*c=*d;
+	if(!c->shared)
+		c->shared=d;
+	__atomic_add_fetch(&c->shared->refs, 1, __ATOMIC_RELAXED);
+	return(c);
+}
+
+void tape_free(tape_deck *d)
+{
+	if(!d) return;
+	tape_wait(d);
+	tape_deck *o=d->shared?d->shared:d;
+	if(d!=o)
+		free(d);
+	if(__atomic_sub_fetch(&o->refs, 1, __ATOMIC_ACQ_REL)) // still playing in some clone
+		return;
+	if(o->lt)
+		libspectrum_tape_free(o->lt);
+	unmap_file(&o->map);
+	free(o->edges);
+	free(o->blocks);
+	free(o);
+}
+
+static uint32_t tape_read_edge(const tape_deck *d, size_t *pos, int *flags)
+{
+	uint64_t v=0;
+	unsigned int shift=0;
+	uint8_t c;
+	do
+	{
+		c=d->edges[(*pos)++];
+		v|=(uint64_t)(c&0x7f)<<shift;
+		shift+=7;
+	}
+	while(c&0x80);
+	*flags=(v&1)?d->edges[(*pos)++]:0;
+	return(v>>1);
+}
+
+void tape_next_edge(tape_deck *d, uint32_t *tstates, int *flags)
+{
+	tape_wait(d);
+	if(unlikely(d->pos>=d->nbytes))
+	{
+		*tstates=0;
+		*flags=LIBSPECTRUM_TAPE_FLAGS_TAPE;
+		tape_seek_block(d, 0);
+		d->ended=true;
+		return;
+	}
+	size_t o=d->pos;
+	*tstates=tape_read_edge(d, &d->pos, flags);
+	d->T+=*tstates;
+	while((d->block+1<d->nblocks)&&(d->blocks[d->block+1].offset<=o))
+		d->block++;
+	if(d->pos>=d->nbytes) // end of tape; rewind, like libspectrum does
+	{
+		*flags|=LIBSPECTRUM_TAPE_FLAGS_TAPE;
+		tape_seek_block(d, 0);
+		d->ended=true;
+	}
+}
+
+unsigned int tape_position(tape_deck *d)
+{
+	tape_wait(d);
+	return(d->block);
+}
+
+void tape_seek_block(tape_deck *d, unsigned int block)
+{
+	tape_wait(d);
+	d->ended=false;
+	if(block>=d->nblocks)
+	{
+		d->pos=d->nbytes;
+		d->block=d->nblocks?d->nblocks-1:0;
+		d->T=d->nblocks?d->blocks[d->block].start+d->blocks[d->block].length:0;
+		return;
+	}
+	d->pos=d->blocks[block].offset;
+	d->block=block;
+	d->T=d->blocks[block].start;
+}
+
+void tape_seek_time(tape_deck *d, uint64_t T)
+{
+	tape_wait(d);
+	unsigned int b=0;
+	while((b+1<d->nblocks)&&(d->blocks[b+1].start<=T))
+		b++;
+	tape_seek_block(d, b);
+	while((d->pos<d->nbytes)&&(d->T<T))
+	{
+		size_t p=d->pos;
+		int flags;
+		uint32_t tstates=tape_read_edge(d, &p, &flags);
+		if(d->T+tstates>T) break;
+		d->pos=p;
+		d->T+=tstates;
+		while((d->block+1<d->nblocks)&&(d->blocks[d->block+1].offset<=d->pos))
+			d->block++;
+	}
+}
+
+uint64_t tape_block_remaining(tape_deck *d)
+{
+	tape_wait(d);
+	if(!d->nblocks) return(0);
+	uint64_t end=d->blocks[d->block].start+d->blocks[d->block].length;
+	return((end>d->T)?end-d->T:0);
+}
+
+int tape_next_data_block(tape_deck *d)
+{
+	tape_wait(d);
+	unsigned int b=d->block;
+	while((b+1<d->nblocks)&&(d->blocks[b+1].offset<=d->pos))
+		b++;
+	while((b<d->nblocks)&&!d->blocks[b].nedges)
+		b++;
+	return((b<d->nblocks)?(int)b:-1);
+}
+
+trec_format tape_format_from_name(const char *fn)
+{
+	const char *ext=strrchr(fn, '.');
+	if(ext&&!strcasecmp(ext, ".tap"))
+		return(TREC_TAP);
+	if(ext&&!strcasecmp(ext, ".tzx"))
+		return(TREC_TZX);
+	return(TREC_CSW);
+}
+
+void tape_write_header(FILE *fp, trec_format fmt)
+{
+	if(fmt==TREC_TZX)
+	{
+		fputs("ZXTape!", fp);
+		fputc(0x1A, fp);
+		fputc(1, fp); // version 1.20
+		fputc(20, fp);
+	}
+}
+
+static bool tape_write_block(bgwriter *w, trec_format fmt, const uint8_t *data, size_t len, unsigned int pause)
+{
+	uint8_t head[5];
+	size_t hl=0;
+	if(len>0xffff)
+	{
+		fprintf(stderr, "tape: a block of %zu bytes is too long to write\n", len);
+		return(false);
+	}
+	switch(fmt)
+	{
+		case TREC_TZX:
+			head[hl++]=0x10;
+			head[hl++]=pause;
+			head[hl++]=pause>>8;
+			/* fallthrough */
+		case TREC_TAP:
+			head[hl++]=len;
+			head[hl++]=len>>8;
+		break;
+		default:
+			return(false);
+	}
+	uint8_t *block=malloc(hl+len); // one write, so if the queue is full we lose the whole block, not half of it
+	if(!block)
+	{
+		perror("tape: malloc");
+		return(false);
+	}
+	memcpy(block, head, hl);
+	memcpy(block+hl, data, len);
+	bool ok=bgw_write(w, block, hl+len);
+	free(block);
+	return(ok);
+}
+
+static unsigned int tape_ms(uint32_t tstates)
+{
+	return(min(tstates/TAPE_T_MS, 0xffffu));
+}
+
+static bool tape_near(uint32_t tstates, uint32_t nominal) // within 1/8
+{
+	return((tstates>=nominal-(nominal>>3))&&(tstates<=nominal+(nominal>>3)));
+}
+
+tape_encoder *tape_encoder_new(bgwriter *w, trec_format fmt)
+{
+	tape_encoder *e=malloc(sizeof(tape_encoder));
+	if(!e)
+	{
+		perror("malloc");
+		return(NULL);
+	}
+	e->w=w;
+	e->fmt=fmt;
+	e->pulses=NULL;
+	e->npulses=e->lpulses=0;
+	e->level=false;
+	e->state=TENC_IDLE;
+	e->pilot=0;
+	e->npilot=0;
+	e->data=NULL;
+	e->len=e->ldata=0;
+	e->bits=0;
+	e->half=-1;
+	e->gap=true; // whatever came before we started recording
+	e->dropped=false;
+	return(e);
+}
+
+static bool tape_write_raw_samples(tape_encoder *e, const uint8_t *buf, size_t nbits)
+{
+	if(!nbits) return(true);
+	size_t len=(nbits+7)>>3;
+	uint8_t head[9]={0x15, TAPE_RAW_T, TAPE_RAW_T>>8, 0, 0, ((nbits-1)&7)+1, len, len>>8, len>>16};
+	return(bgw_write(e->w, head, 9)&&bgw_write(e->w, buf, len));
+}
+
+static bool tape_write_pause(tape_encoder *e, uint32_t tstates)
+{
+	unsigned int ms=max(tape_ms(tstates), 1u); // 0 would mean "stop the tape"
+	uint8_t block[3]={0x20, ms, ms>>8};
+	return(bgw_write(e->w, block, 3));
+}
+
+// writes out the first n pulses as direct recording and pauses, and drops them
+static void tape_flush_raw(tape_encoder *e, size_t n)
+{
+	bool ok=true;
+	if(e->fmt==TREC_TZX)
+	{
+		uint8_t *buf=calloc(TAPE_RAW_MAX, 1);
+		if(!buf)
+		{
+			perror("calloc");
+			ok=false;
+		}
+		else
+		{
+			size_t nbits=0;
+			uint64_t T=0; // since the start of the current direct recording block
+			bool level=e->level;
+			for(size_t i=0;i<n;i++,level=!level)
+			{
+				uint32_t p=e->pulses[i];
+				if(p>=TAPE_GAP)
+				{
+					ok=tape_write_raw_samples(e, buf, nbits)&&tape_write_pause(e, p)&&ok;
+					memset(buf, 0, TAPE_RAW_MAX);
+					nbits=0;
+					T=0;
+					continue;
+				}
+				size_t to=(T+p+(TAPE_RAW_T>>1))/TAPE_RAW_T, from=(T+(TAPE_RAW_T>>1))/TAPE_RAW_T;
+				T+=p;
+				for(size_t s=from;s<to;s++)
+				{
+					if(nbits>=TAPE_RAW_MAX*8)
+					{
+						ok=tape_write_raw_samples(e, buf, nbits)&&ok;
+						memset(buf, 0, TAPE_RAW_MAX);
+						nbits=0;
+					}
+					if(level)
+						buf[nbits>>3]|=0x80>>(nbits&7);
+					nbits++;
+				}
+			}
+			ok=tape_write_raw_samples(e, buf, nbits)&&ok;
+			free(buf);
+		}
+	}
+	else if(!e->dropped)
+	{
+		for(size_t i=0;i<n;i++)
+			if(e->pulses[i]<TAPE_GAP)
+			{
+				fprintf(stderr, "tape: non-standard recording can't be stored in a TAP, dropped\n");
+				e->dropped=true;
+				break;
+			}
+	}
+	if(!ok)
+		fprintf(stderr, "tape: writing direct recording failed\n");
+	if(n&1)
+		e->level=!e->level;
+	memmove(e->pulses, e->pulses+n, (e->npulses-n)*sizeof(uint32_t));
+	e->npulses-=n;
+	e->pilot-=min(e->pilot, n);
+}
+
+// the block from e->pilot is complete; write it (and anything before it), with a pause of tstates
+static void tape_emit_data(tape_encoder *e, uint32_t tstates)
+{
+	tape_flush_raw(e, e->pilot);
+	if(!tape_write_block(e->w, e->fmt, e->data, e->len, tape_ms(tstates)))
+		fprintf(stderr, "tape: writing block of %zu bytes failed\n", e->len);
+	e->level^=e->npulses&1;
+	e->npulses=0;
+	e->pilot=0;
+}
+
+static bool tape_data_pulse(tape_encoder *e, uint32_t tstates)
+{
+	int bit=tape_near(tstates, TAPE_BIT0)?0:tape_near(tstates, TAPE_BIT1)?1:-1;
+	if(bit<0) return(false);
+	if(e->half<0)
+	{
+		e->half=bit;
+		return(true);
+	}
+	if(bit!=e->half) return(false);
+	e->half=-1;
+	if(!e->bits)
+	{
+		if(e->len>=0xffff) return(false);
+		if(e->len>=e->ldata)
+		{
+			size_t nl=e->ldata?e->ldata*2:1024;
+			uint8_t *nd=realloc(e->data, nl);
+			if(!nd)
+			{
+				perror("realloc");
+				return(false);
+			}
+			e->data=nd;
+			e->ldata=nl;
+		}
+		e->data[e->len++]=0;
+	}
+	if(bit)
+		e->data[e->len-1]|=0x80>>e->bits;
+	e->bits=(e->bits+1)&7;
+	return(true);
+}
+
+// has the data ended with a whole number of bytes?  If so, *tstates is set to the silence after the block
+static bool tape_data_end(tape_encoder *e, uint32_t *tstates)
+{
+	if((e->half>=0)&&(e->bits==7)) // the last bit's second pulse has no edge at the end; it runs on into the silence
+	{
+		uint32_t p=e->half?TAPE_BIT1:TAPE_BIT0;
+		if(*tstates<p-(p>>3)) return(false);
+		tape_data_pulse(e, p);
+		*tstates-=min(*tstates, p);
+	}
+	else if((e->half>=0)&&!e->bits) // a lone pulse after the last byte, like the ROM's closing edge
+		e->half=-1;
+	return((e->half<0)&&!e->bits&&e->len);
+}
+
+void tape_encode_pulse(tape_encoder *e, uint32_t tstates, bool level)
+{
+	if(e->gap)
+	{
+		e->gap=false;
+		if(tstates>=TAPE_GAP) return;
+	}
+	if(e->npulses>=e->lpulses)
+	{
+		size_t nl=e->lpulses?e->lpulses*2:4096;
+		uint32_t *np=realloc(e->pulses, nl*sizeof(uint32_t));
+		if(!np)
+		{
+			perror("realloc");
+			return;
+		}
+		e->pulses=np;
+		e->lpulses=nl;
+	}
+	if(!e->npulses)
+		e->level=level;
+	size_t i=e->npulses++;
+	e->pulses[i]=tstates;
+	switch(e->state)
+	{
+		case TENC_DATA:
+			if(tape_data_pulse(e, tstates)) return;
+			e->state=TENC_IDLE;
+			e->npilot=0;
+			if(tape_data_end(e, &tstates)) // so this pulse is the silence after the block
+			{
+				tape_emit_data(e, tstates);
+				return;
+			}
+			// it was something else; it'll have to be direct recording
+		break;
+		case TENC_SYNC:
+			if(tape_near(tstates, TAPE_SYNC2))
+			{
+				e->state=TENC_DATA;
+				e->len=0;
+				e->bits=0;
+				e->half=-1;
+				return;
+			}
+			e->state=TENC_IDLE;
+			e->npilot=0;
+		break;
+		case TENC_IDLE:
+		break;
+	}
+	if(tape_near(tstates, TAPE_PILOT))
+	{
+		if(!e->npilot++)
+			e->pilot=i;
+	}
+	else if((e->npilot>=TAPE_MIN_PILOT)&&tape_near(tstates, TAPE_SYNC1))
+		e->state=TENC_SYNC;
+	else
+		e->npilot=0;
+	if((e->state==TENC_IDLE)&&(e->npulses>=TAPE_HOLD_MAX)) // a pilot tone that goes on and on (any ~800Hz note) mustn't hold everything
+	{
+		unsigned int keep=min(e->npilot, (unsigned int)TAPE_MAX_PILOT);
+		tape_flush_raw(e, e->npulses-keep);
+		e->pilot=0;
+		e->npilot=keep;
+	}
+}
+
+bool tape_encode_block(tape_encoder *e, const uint8_t *data, size_t len)
+{
+	tape_flush_raw(e, e->npulses);
+	e->state=TENC_IDLE;
+	e->npilot=0;
+	e->gap=true;
+	return(tape_write_block(e->w, e->fmt, data, len, TAPE_PAUSE));
+}
+
+void tape_encoder_finish(tape_encoder *e, uint32_t tstates)
+{
+	if(!e) return;
+	if((e->state==TENC_DATA)&&tape_data_end(e, &tstates))
+		tape_emit_data(e, max(tstates, (uint32_t)TAPE_PAUSE*TAPE_T_MS));
+	tape_flush_raw(e, e->npulses);
+	free(e->pulses);
+	free(e->data);
+	free(e);
+}
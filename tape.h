@@ -0,0 +1,101 @@
+#pragma once
+/*
+	spiffy - ZX spectrum emulator
+
+	Copyright Edward Cree, 2010-13
+	tape.h - pre-decoded tape edge streams, and tape recording
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <libspectrum.h>
+#include <SDL.h>
+#include "bgwrite.h"
+#include "bits.h"
+
+#define TAPE_NAMELEN	32
+#define TAPE_PAUSE		1000 // ms of silence after each block we write to a TZX
+#define TAPE_T_MS		3500 // T-states per ms, as TZX reckons them
+
+typedef enum
+{
+	TREC_CSW, // MIC pulses
+	TREC_TAP, // ROM blocks
+	TREC_TZX, // ROM blocks, as Standard Speed Data blocks (0x10)
+}
+trec_format;
+
+typedef struct
+{
+	size_t offset; // byte offset of the block's first edge in the edge stream
+	uint32_t nedges;
+	uint64_t start; // T-states from start of tape to start of block
+	uint64_t length; // T-states
+	libspectrum_tape_type type; // TZX block ID
+	const uint8_t *data; // the block's data bytes (flag through parity, for ROM blocks), for traps
+	size_t len;
+	const uint8_t *raw; // the block in the mapped file, after the ID byte (NULL for TAP blocks); only for the native decoder
+	char name[TAPE_NAMELEN];
+}
+tape_block;
+
+typedef struct tape_deck
+{
+	libspectrum_tape *lt; // the underlying libspectrum tape, for block data, or NULL if we're decoding the file ourselves.  Don't touch until tape_wait() has returned
+	mapfile map; // the file, when we're decoding it ourselves; block data points into it
+	uint8_t *edges; // delta-encoded edge stream; see tape.c
+	size_t nbytes;
+	tape_block *blocks;
+	unsigned int nblocks;
+	// playback state
+	size_t pos; // byte offset of next edge
+	unsigned int block; // current block
+	uint64_t T; // T-states from start of tape to the last edge returned
+	bool ended; // ran off the end and rewound itself; cleared by seeking
+	// decoder
+	SDL_Thread *decoder;
+	bool ready;
+	// clones
+	struct tape_deck *shared; // the deck whose tape a clone plays, which lives until all its clones are freed; NULL if it's our own
+	unsigned int refs; // decks playing our tape, us included
+}
+tape_deck;
+
+tape_deck *tape_load(libspectrum_tape *lt); // takes over lt, and starts decoding it in the background
+tape_deck *tape_load_mapped(mapfile *map, bool tzx); // as tape_load, but decodes a TAP or TZX file ourselves, straight from the mapping, which it takes over.  Returns NULL (and leaves *map alone) if the file has blocks we can't handle
+tape_deck *tape_clone(tape_deck *deck); // another deck, at the same place in the same tape, sharing its decoded edges
+void tape_free(tape_deck *deck);
+void tape_wait(tape_deck *deck); // waits until decoding is complete
+void tape_next_edge(tape_deck *deck, uint32_t *tstates, int *flags); // as libspectrum_tape_get_next_edge, but from the pre-decoded stream
+unsigned int tape_position(tape_deck *deck); // current block number
+void tape_seek_block(tape_deck *deck, unsigned int block);
+void tape_seek_time(tape_deck *deck, uint64_t T); // to the first edge at or after T-states from start of tape
+uint64_t tape_block_remaining(tape_deck *deck); // T-states from the last edge returned to the end of the current block
+int tape_next_data_block(tape_deck *deck); // the block the next edge comes from, skipping blocks without edges; or -1 at end of tape
+
+typedef struct
+{
+	bgwriter *w;
+	trec_format fmt;
+	uint32_t *pulses; // pulses not yet written, in T-states
+	size_t npulses, lpulses;
+	bool level; // MIC level during pulses[0]
+	enum {TENC_IDLE, TENC_SYNC, TENC_DATA} state;
+	size_t pilot; // index in pulses of the start of the pilot tone
+	unsigned int npilot; // pilot pulses seen (so far)
+	uint8_t *data; // decoded bytes of the current block
+	size_t len, ldata;
+	unsigned int bits; // bits of data[len-1] filled
+	int half; // first half of the current bit (0 or 1), or -1
+	bool gap; // the next pulse is the silence after a block we wrote
+	bool dropped; // have we warned that a TAP can't hold what we were given?
+}
+tape_encoder;
+
+trec_format tape_format_from_name(const char *fn); // by extension; anything unrecognised is CSW
+void tape_write_header(FILE *fp, trec_format fmt); // TAP and TZX only
+tape_encoder *tape_encoder_new(bgwriter *w, trec_format fmt); // TAP and TZX only.  Doesn't take over w
+void tape_encode_pulse(tape_encoder *e, uint32_t tstates, bool level); // level is MIC during the pulse
+bool tape_encode_block(tape_encoder *e, const uint8_t *data, size_t len); // a whole block, already decoded (eg. by a trap); data includes the flag and parity bytes
+void tape_encoder_finish(tape_encoder *e, uint32_t tstates); // writes out whatever's pending (tstates since the last pulse) and frees e
@@ -11,8 +11,6 @@
 #include "machine.h"
 #include <SDL_image.h>
 
-extern machine zx_machine;
-
 SDL_Surface * gf_init(unsigned int x, unsigned int y)
 {
 	SDL_Surface * screen;
@@ -67,7 +65,7 @@ SDL_Surface *configIMG_Load(const char *name)
 	return(img);
 }
 
-void ui_init(SDL_Surface *screen, button **buttons, bool edgeload, bool pause, bool keyboard, bool printer)
+void ui_init(SDL_Surface *screen, button **buttons, machine m, bool edgeload, bool pause, bool keyboard, bool printer)
 {
 	static button btn[nbuttons];
 	*buttons=btn;
@@ -77,7 +75,7 @@ void ui_init(SDL_Surface *screen, button **buttons, bool edgeload, bool pause, b
 		btn[i].tooltip=NULL;
 	}
 	char title[64];
-	snprintf(title, 64, "Spiffy - ZX Spectrum %s", name_from_machine(zx_machine));
+	snprintf(title, 64, "Spiffy - ZX Spectrum %s", name_from_machine(m));
 	SDL_WM_SetCaption(title, "Spiffy");
 	SDL_EnableUNICODE(1);
 	SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
@@ -243,14 +241,6 @@ void ui_init(SDL_Surface *screen, button **buttons, bool edgeload, bool pause, b
 		drawbutton(screen, btn[i]);
 }
 
-__attribute__((gnu_inline)) inline void pset(SDL_Surface * screen, int x, int y, uint8_t r, uint8_t g, uint8_t b)
-{
-	long int s_off = (y*screen->pitch) + x*screen->format->BytesPerPixel;
-	Uint32 pixval = SDL_MapRGB(screen->format, r, g, b),
-		* pixloc = (Uint32 *)(((uint8_t *)screen->pixels)+s_off);
-	*pixloc = pixval;
-}
-
 int line(SDL_Surface * screen, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b)
 {
 	if(x2<x1)
@@ -361,14 +351,6 @@ void drawbutton(SDL_Surface *screen, button b)
 	if(b.img) SDL_BlitSurface(b.img, NULL, screen, &b.posn);
 }
 
-__attribute__((gnu_inline)) inline void pget(SDL_Surface * screen, int x, int y, uint8_t *r, uint8_t *g, uint8_t *b)
-{
-	long int s_off = (y*screen->pitch) + x*screen->format->BytesPerPixel;
-	Uint32 *pixloc = (Uint32 *)(((uint8_t *)screen->pixels)+s_off),
-		pixval = *pixloc;
-	SDL_GetRGB(pixval, screen->format, r, g, b);
-}
-
 void ksupdate(SDL_Surface * screen, button *buttons, js_type keystick)
 {
 	for(unsigned int i=0;i<4;i++)
@@ -1,39 +1,77 @@
 #include "vchips.h"
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
 #include "bits.h"
 
-int ram_init(ram_t *ram, FILE *rom, machine m)
+unsigned int nkmaps;
+keymap *kmap;
+
+static ram_page *ram_page_new(void)
+{
+	ram_page *p=malloc(sizeof(*p));
+	if(p) p->refs=1;
+	return(p);
+}
+
+static void ram_page_put(ram_page *p)
+{
+	if(p&&!__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL))
+		free(p);
+}
+
+static bool ram_unshare(const ram_t *ram, unsigned int i) // gives bank i a page of its own.  The tables are behind pointers, so do_ram can do this through a const ram_t
+{
+	ram_page *p=ram->page[i];
+	if(__atomic_load_n(&p->refs, __ATOMIC_ACQUIRE)>1) // if it's 1, the others have all copied it already
+	{
+		ram_page *n=ram_page_new();
+		if(!n)
+		{
+			perror("malloc");
+			return(false);
+		}
+		memcpy(n->data, p->data, 0x4000);
+		ram->page[i]=n;
+		ram->bank[i]=n->data;
+		ram_page_put(p);
+	}
+	ram->write[i]=true;
+	return(true);
+}
+
+static bool ram_tables(ram_t *ram)
+{
+	ram->write=malloc(ram->banks*sizeof(bool));
+	ram->bank=malloc(ram->banks*sizeof(*ram->bank));
+	ram->page=calloc(ram->banks, sizeof(*ram->page));
+	return(ram->write&&ram->bank&&ram->page);
+}
+
+int ram_init(ram_t *ram, const uint8_t *rom, machine m)
 {
 	if(!ram) return(1);
 	ram->plock=false;
 	bool p128=cap_128_paging(m);
 	ram->banks=p128?10:4;
-	if(!(ram->write=malloc(ram->banks*sizeof(bool))))
-	{
-		perror("malloc");
-		return(1);
-	}
-	if(!(ram->bank=malloc(ram->banks*sizeof(*ram->bank))))
+	ram->roms=rom_length(m);
+	ram->own=NULL;
+	if(!ram_tables(ram)||!(rom||(ram->own=malloc(ram->roms*0x4000))))
 	{
 		perror("malloc");
+		ram_free(ram);
 		return(1);
 	}
 	for(unsigned int i=0;i<ram->banks;i++)
-		if(p128)
-			ram->write[i]=i>1;
-		else
-			ram->write[i]=i>0;
-	if(rom)
 	{
-		if(fread(ram->bank[0], 1, 0x4000, rom)!=0x4000)
-		{
-			fprintf(stderr, "Failed to read in ROM file\n");
-			return(1);
-		}
-		if(p128&&(fread(ram->bank[1], 1, 0x4000, rom)!=0x4000))
+		ram->write[i]=i>=ram->roms;
+		if(i<ram->roms)
+			ram->bank[i]=rom?(uint8_t *)rom+i*0x4000:ram->own+i*0x4000; // never written, as !write[i]
+		else if((ram->page[i]=ram_page_new()))
+			ram->bank[i]=ram->page[i]->data;
+		else
 		{
-			fprintf(stderr, "Failed to read in ROM file\n");
+			perror("malloc");
+			ram_free(ram);
 			return(1);
 		}
 	}
@@ -50,6 +88,62 @@ int ram_init(ram_t *ram, FILE *rom, machine m)
 	return(0);
 }
 
+void ram_free(ram_t *ram)
+{
+	if(ram->page)
+		for(unsigned int i=0;i<ram->banks;i++)
+			ram_page_put(ram->page[i]);
+	free(ram->page);
+	ram->page=NULL;
+	free(ram->write);
+	ram->write=NULL;
+	free(ram->bank);
+	ram->bank=NULL;
+	free(ram->own);
+	ram->own=NULL;
+}
+
+int ram_clone(ram_t *dst, ram_t *src)
+{
+	dst->banks=src->banks;
+	dst->roms=src->roms;
+	dst->plock=src->plock;
+	memcpy(dst->paged, src->paged, sizeof(dst->paged));
+	dst->own=NULL;
+	if(!ram_tables(dst)||!(!src->own||(dst->own=malloc(src->roms*0x4000))))
+	{
+		perror("malloc");
+		ram_free(dst);
+		return(1);
+	}
+	if(src->own)
+		memcpy(dst->own, src->own, src->roms*0x4000);
+	for(unsigned int i=0;i<dst->banks;i++)
+	{
+		if(i<dst->roms)
+		{
+			dst->write[i]=false;
+			dst->bank[i]=src->own?dst->own+i*0x4000:src->bank[i];
+		}
+		else
+		{
+			__atomic_add_fetch(&src->page[i]->refs, 1, __ATOMIC_RELAXED);
+			dst->page[i]=src->page[i];
+			dst->bank[i]=src->bank[i];
+			dst->write[i]=src->write[i]=false; // until one of us writes to it
+		}
+	}
+	return(0);
+}
+
+int ram_own(ram_t *ram)
+{
+	for(unsigned int i=ram->roms;i<ram->banks;i++)
+		if(!ram->write[i]&&!ram_unshare(ram, i))
+			return(1);
+	return(0);
+}
+
 uint8_t ram_read(const ram_t *ram, uint16_t addr)
 {
 	bus_t bus;
@@ -118,11 +212,15 @@ void do_ram(const ram_t *ram, bus_t *bus)
 			{
 				ram->bank[sel][bus->addr&0x3fff]=bus->data;
 			}
+			else if((sel>=ram->roms)&&ram_unshare(ram, sel)) // shared with a clone; now it's ours
+			{
+				ram->bank[sel][bus->addr&0x3fff]=bus->data;
+			}
 		}
 	}
 	else if(bus->tris==TRIS_IN)
 	{
-		bus->data=floor(rand()*256.0/RAND_MAX);
+		bus->data=0xff; // nothing there; and not rand(), so that runs (and replays) are repeatable
 	}
 }
 
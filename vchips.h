@@ -19,11 +19,20 @@ ula_t;
 
 typedef struct
 {
-	unsigned int banks;
-	bool *write;
-	uint8_t (*bank)[0x4000]; // 16384 bytes per bank
+	unsigned int refs; // RAMs using this page; it's copied before being written while there's more than one
+	uint8_t data[0x4000];
+}
+ram_page;
+
+typedef struct
+{
+	unsigned int banks, roms; // the first roms banks are ROM
+	bool *write; // can the bank be written in place?  Not if it's ROM, nor if it's a page shared with a clone
+	uint8_t **bank; // 16384 bytes per bank; the ROM banks may be a shared image, which we only read
+	ram_page **page; // the RAM banks' pages (bank[i] is page[i]->data); NULL for ROM
 	unsigned int paged[4];
 	bool plock; // paging locked out?
+	uint8_t *own; // the ROM banks, if we allocated them
 }
 ram_t;
 
@@ -35,10 +44,13 @@ typedef struct
 }
 keymap;
 
-unsigned int nkmaps;
-keymap *kmap;
+extern unsigned int nkmaps;
+extern keymap *kmap;
 
-int ram_init(ram_t *ram, FILE *rom, machine m);
+int ram_init(ram_t *ram, const uint8_t *rom, machine m); // rom is rom_length(m) 16k images, which must outlive the RAM; or NULL, to allocate (uninitialised) ROM banks of our own
+void ram_free(ram_t *ram);
+int ram_clone(ram_t *dst, ram_t *src); // dst shares src's RAM pages, copy-on-write, and its ROM
+int ram_own(ram_t *ram); // copies any pages still shared with a clone, so that bank[] can be written directly
 // for use by eg. debugger
 uint8_t ram_read(const ram_t *ram, uint16_t addr);
 void ram_write(ram_t *ram, uint16_t addr, uint8_t val);
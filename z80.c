@@ -18,34 +18,12 @@
 #define ZERR3	"spiffy: encountered bad opcode s%u x%u z%u y%u (p%u q%u) (M%u) in z80 core\n", cpu->shiftstate, cpu->ods.x, cpu->ods.z, cpu->ods.y, cpu->ods.p, cpu->ods.q, cpu->M
 #define ZERRM	"spiffy: encountered bad M-cycle %u in z80 core (s%u x%u z%u y%u)\n", cpu->M, cpu->shiftstate, cpu->ods.x, cpu->ods.z, cpu->ods.y
 
-void z80_init(void)
-{
-	// Fill in register decoding tables
-	// tbl_r: B C D E H L (HL) A
-	tbl_r[0]=5;
-	tbl_r[1]=4;
-	tbl_r[2]=7;
-	tbl_r[3]=6;
-	tbl_r[4]=9;
-	tbl_r[5]=8;
-	tbl_r[6]=26; // regs[26] does not exist and should not be used
-	tbl_r[7]=3;
-	// tbl_rp: BC DE HL SP
-	tbl_rp[0]=4;
-	tbl_rp[1]=6;
-	tbl_rp[2]=8;
-	tbl_rp[3]=16;
-	// tbl_rp2: BC DE HL AF
-	tbl_rp2[0]=4;
-	tbl_rp2[1]=6;
-	tbl_rp2[2]=8;
-	tbl_rp2[3]=2;
-	// Fill in other decoding tables
-	// tbl_im: 0 0 1 2
-	tbl_im[0]=tbl_im[1]=0;
-	tbl_im[2]=1;
-	tbl_im[3]=2;
-}
+// Register decoding tables; constant, so every machine can share them
+const uint8_t tbl_r[8]={5, 4, 7, 6, 9, 8, 26, 3}; // B C D E H L (HL) A; regs[26] does not exist and should not be used
+const uint8_t tbl_rp[4]={4, 6, 8, 16}; // BC DE HL SP
+const uint8_t tbl_rp2[4]={4, 6, 8, 2}; // BC DE HL AF
+// Other decoding tables
+const uint8_t tbl_im[4]={0, 0, 1, 2};
 
 void z80_reset(z80 *cpu, bus_t *bus)
 {
@@ -86,6 +64,13 @@ void bus_reset(bus_t *bus)
 	bus->reset=true;
 }
 
+void z80_copy(z80 *dst, const z80 *src)
+{
+	*dst=*src;
+	if(src->stp) // a port read in progress is going into one of src's own registers
+		dst->stp=(uint8_t *)dst+(src->stp-(const uint8_t *)src);
+}
+
 int z80_tstep(z80 *cpu, bus_t *bus, int errupt)
 {
 	if(bus->clk_inhibit) return(errupt);
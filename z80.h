@@ -75,7 +75,7 @@ typedef struct
 }
 bus_t;
 
-void z80_init(void);
 void z80_reset(z80 *cpu, bus_t *bus);
 void bus_reset(bus_t *bus);
+void z80_copy(z80 *dst, const z80 *src); // as *dst=*src, but keeping dst's pointers into itself
 int z80_tstep(z80 *cpu, bus_t *bus, int errupt);